@@ -25,10 +25,13 @@ extern void stream_char (zchar);
 extern void stream_word (const zchar *);
 extern void stream_new_line (void);
 
-static zchar buffer[TEXT_BUFFER_SIZE];
-static int bufpos = 0;
+#define buffer	(zctx->buffer)
+#define bufpos	(zctx->bufpos)
 
-static zchar prev_c = 0;
+#define prev_c	(zctx->prev_c)
+
+#define locked	(zctx->buffer_locked)
+#define flag	(zctx->buffer_flag)
 
 /*
  * flush_buffer
@@ -38,8 +41,6 @@ static zchar prev_c = 0;
  */
 void flush_buffer (void)
 {
-    static bool locked = FALSE;
-
     /* Make sure we stop when flush_buffer is called from flush_buffer.
        Note that this is difficult to avoid as we might print a newline
        during flush_buffer, which might cause a newline interrupt, that
@@ -78,8 +79,6 @@ void flush_buffer (void)
  */
 void print_char (zchar c)
 {
-    static bool flag = FALSE;
-
     if (message || ostream_memory || enable_buffering) {
 
 	if (!flag) {
@@ -144,4 +143,5 @@ void init_buffer(void)
     memset(buffer, 0, sizeof (zchar) * TEXT_BUFFER_SIZE);
     bufpos = 0;
     prev_c = 0;
+    locked = FALSE;
 }
@@ -26,6 +26,10 @@
 #include <string.h>
 #include "frotz.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
 #ifdef MSDOS_16BIT
 
 #include <alloc.h>
@@ -58,8 +62,8 @@ extern void script_open (void);
 extern void script_close (void);
 
 extern FILE *os_load_story (void);
-extern int os_storyfile_seek (FILE * fp, long offset, int whence);
-extern int os_storyfile_tell (FILE * fp);
+extern int os_storyfile_seek (FILE *, long offset, int whence);
+extern int os_storyfile_tell (FILE *);
 
 extern zword save_quetzal (FILE *, FILE *);
 extern zword restore_quetzal (FILE *, FILE *);
@@ -68,19 +72,9 @@ extern zword restore_squetzal (unsigned char *svf, unsigned char *stf);
 
 extern void erase_window (zword);
 
-extern void (*op0_opcodes[]) (void);
-extern void (*op1_opcodes[]) (void);
-extern void (*op2_opcodes[]) (void);
-extern void (*var_opcodes[]) (void);
-
 /* char save_name[MAX_FILE_NAME + 1] = DEFAULT_SAVE_NAME; */
 char auxilary_name[MAX_FILE_NAME + 1] = DEFAULT_AUXILARY_NAME;
 
-zbyte far *zmp = NULL;
-zbyte far *pcp = NULL;
-
-FILE *story_fp = NULL;
-
 /*
  * Data for the undo mechanism.
  * This undo mechanism is based on the scheme used in Evin Robertson's
@@ -94,21 +88,22 @@ struct undo_struct {
     undo_t *prev;
     long pc;
     long diff_size;
-    zword frame_count;
+    zword frame_cnt;
     zword stack_size;
     zword frame_offset;
     /* undo diff and stack data follow */
 };
 
-static undo_t *first_undo = NULL, *last_undo = NULL, *curr_undo = NULL;
-zbyte *undo_mem = NULL, *prev_zmp, *undo_diff;
+#define first_undo	(zctx->first_undo)
+#define last_undo	(zctx->last_undo)
+#define curr_undo	(zctx->curr_undo)
+#define undo_count	(zctx->undo_count)
 
-static int undo_count = 0;
+#define all_dirty	(zctx->all_dirty)
+#define checkpoint_mem	(zctx->checkpoint_mem)
 
-bool use_squetzal = 0;
-unsigned char *stf_buff = 0; // Holds the current story file
-unsigned char *save_buff = 0;
-zword quetzal_success;
+#define first_restart	(zctx->first_restart)
+#define stf_buff	(zctx->stf_buff)	/* Holds the current story file */
 
 // Load the story file in a buffer (useful for subsequent load/save)
 void read_story_file_to_buffer() {
@@ -250,7 +245,7 @@ void init_memory (void)
     int i, j;
 
     static struct {
-	enum story story_id;
+	enum story story;
 	zword release;
 	zbyte serial[6];
     } records[] = {
@@ -397,7 +392,7 @@ void init_memory (void)
 
     story_id = UNKNOWN;
 
-    for (i = 0; records[i].story_id != UNKNOWN; i++) {
+    for (i = 0; records[i].story != UNKNOWN; i++) {
 
 	if (h_release == records[i].release) {
 
@@ -405,7 +400,7 @@ void init_memory (void)
 		if (h_serial[j] != records[i].serial[j])
 		    goto no_match;
 
-	    story_id = records[i].story_id;
+	    story_id = records[i].story;
 
 	}
 
@@ -445,16 +440,6 @@ void init_memory (void)
     if (story_id == ZORK_ZERO && h_release == 296)
 	h_flags |= GRAPHICS_FLAG;
 
-    /* Adjust opcode tables */
-
-    if (h_version <= V4) {
-	op0_opcodes[0x09] = z_pop;
-	op1_opcodes[0x0f] = z_not;
-    } else {
-	op0_opcodes[0x09] = z_catch;
-	op1_opcodes[0x0f] = z_call_n;
-    }
-
     /* Allocate memory for story data */
 
     if ((zmp = (zbyte far *) realloc (zmp, story_size)) == NULL)
@@ -569,12 +554,177 @@ void reset_memory (void)
     undo_mem = NULL;
     undo_count = 0;
 
+    if (checkpoint_mem)
+	free (checkpoint_mem);
+    checkpoint_mem = NULL;
+
     if (zmp)
 	free (zmp);
     zmp = NULL;
 }/* reset_memory */
 
 
+/*
+ * copy_pages
+ *
+ * Copy the dirty pages of dynamic memory from src to dst.
+ *
+ */
+static void copy_pages (zbyte *dst, const zbyte *src)
+{
+    long addr;
+    int i;
+
+    for (i = 0; i < zctx->dirty_count; i++) {
+	addr = (long) zctx->dirty_pages[i] << DIRTY_PAGE_SHIFT;
+	if (addr + DIRTY_PAGE_SIZE <= h_dynamic_size)
+	    memcpy (dst + addr, src + addr, DIRTY_PAGE_SIZE);
+	else if (addr < h_dynamic_size)
+	    memcpy (dst + addr, src + addr, h_dynamic_size - addr);
+    }
+
+}/* copy_pages */
+
+
+/*
+ * clear_dirty
+ *
+ * Forget the pages written since the checkpoint. The undo stack keeps
+ * its own set of them.
+ *
+ */
+static void clear_dirty (void)
+{
+    int i;
+
+    for (i = 0; i < zctx->dirty_count; i++)
+	zctx->dirty[zctx->dirty_pages[i]] &= ~DIRTY_CHECKPOINT;
+    zctx->dirty_count = 0;
+    all_dirty &= ~DIRTY_CHECKPOINT;
+
+}/* clear_dirty */
+
+
+/*
+ * clone_memory
+ *
+ * Called on a bitwise copy of another machine: give the copy its own
+ * story memory and undo buffers, and open the story file again. The undo
+ * history is not copied.
+ *
+ */
+void clone_memory (void)
+{
+    zbyte *src_zmp = zmp;
+    zbyte *src_prev_zmp = prev_zmp;
+
+    if ((zmp = (zbyte far *) malloc (story_size)) == NULL)
+	os_fatal ("Out of memory");
+    memcpy (zmp, src_zmp, story_size);
+    pcp = zmp + (pcp - src_zmp);
+
+    if ((story_fp = os_load_story ()) == NULL)
+	os_fatal ("Cannot open story file");
+
+    if (stf_buff != NULL) {
+	stf_buff = NULL;
+	read_story_file_to_buffer ();
+    }
+
+    first_undo = last_undo = curr_undo = NULL;
+    undo_count = 0;
+    checkpoint_mem = NULL;
+
+    if (undo_mem != NULL) {
+	if ((undo_mem = malloc ((h_dynamic_size * 5) / 2 + 2)) == NULL)
+	    os_fatal ("Out of memory");
+	prev_zmp = undo_mem;
+	undo_diff = undo_mem + h_dynamic_size;
+	memcpy (prev_zmp, src_prev_zmp, h_dynamic_size);
+    }
+}/* clone_memory */
+
+
+/*
+ * checkpoint_memory
+ *
+ * Remember the dynamic memory, the stack and the PC, so that
+ * rollback_memory can return to them. Only the pages written since the
+ * previous checkpoint are copied.
+ *
+ */
+void checkpoint_memory (void)
+{
+
+    if (checkpoint_mem == NULL) {
+	if ((checkpoint_mem = malloc (h_dynamic_size)) == NULL)
+	    os_fatal ("Out of memory");
+	all_dirty |= DIRTY_CHECKPOINT;
+    }
+
+    if (all_dirty & DIRTY_CHECKPOINT)
+	memcpy (checkpoint_mem, zmp, h_dynamic_size);
+    else
+	copy_pages (checkpoint_mem, zmp);
+
+    clear_dirty ();
+
+    GET_PC (zctx->checkpoint_pc);
+    zctx->checkpoint_sp = sp - stack;
+    zctx->checkpoint_fp = fp - stack;
+    zctx->checkpoint_frame_count = frame_count;
+    memcpy (zctx->checkpoint_stack + (sp - stack), sp,
+	    (stack + STACK_SIZE - sp) * sizeof (*sp));
+
+}/* checkpoint_memory */
+
+
+/*
+ * rollback_memory
+ *
+ * Return to the state saved by checkpoint_memory, copying back only the
+ * pages written since. Returns the number of pages copied, or -1 if
+ * there is no checkpoint.
+ *
+ */
+int rollback_memory (void)
+{
+    int pages = zctx->dirty_count;
+    int i;
+
+    if (checkpoint_mem == NULL)
+	return -1;
+
+    if (all_dirty & DIRTY_CHECKPOINT) {
+	memcpy (zmp, checkpoint_mem, h_dynamic_size);
+	all_dirty |= DIRTY_UNDO;
+	pages = (h_dynamic_size + DIRTY_PAGE_SIZE - 1) >> DIRTY_PAGE_SHIFT;
+    } else {
+	copy_pages (zmp, checkpoint_mem);
+
+	/* The pages copied back changed for the undo stack too */
+
+	for (i = 0; i < zctx->dirty_count; i++)
+	    if (!(zctx->dirty[zctx->dirty_pages[i]] & DIRTY_UNDO)) {
+		zctx->dirty[zctx->dirty_pages[i]] |= DIRTY_UNDO;
+		zctx->undo_dirty_pages[zctx->undo_dirty_count++] = zctx->dirty_pages[i];
+	    }
+    }
+
+    clear_dirty ();
+
+    SET_PC (zctx->checkpoint_pc);
+    sp = stack + zctx->checkpoint_sp;
+    fp = stack + zctx->checkpoint_fp;
+    frame_count = zctx->checkpoint_frame_count;
+    memcpy (sp, zctx->checkpoint_stack + zctx->checkpoint_sp,
+	    (stack + STACK_SIZE - sp) * sizeof (*sp));
+
+    return pages;
+
+}/* rollback_memory */
+
+
 /*
  * storeb
  *
@@ -630,8 +780,6 @@ void storew (zword addr, zword value)
  */
 void z_restart (void)
 {
-    static bool first_restart = TRUE;
-
     flush_buffer ();
 
     os_restart_game (RESTART_BEGIN);
@@ -644,6 +792,7 @@ void z_restart (void)
 
 	if (fread (zmp, 1, h_dynamic_size, story_fp) != h_dynamic_size)
 	    os_fatal ("Story file read error");
+	all_dirty = DIRTY_BOTH;
 
     } else first_restart = FALSE;
 
@@ -722,6 +871,8 @@ void z_restore (void)
 
     zword success = 0;
 
+    all_dirty = DIRTY_BOTH;
+
     if (zargc != 0) {
 
 	/* Get the file name */
@@ -818,28 +969,138 @@ finished:
 
 
 /*
- * mem_diff
+ * equal_prefix_scalar
  *
- * Set diff to a Quetzal-like difference between a and b,
- * copying a to b as we go.  It is assumed that diff points to a
- * buffer which is large enough to hold the diff.
- * mem_size is the number of bytes to compare.
- * Returns the number of bytes copied to diff.
+ * Return the number of leading bytes that a and b have in common,
+ * comparing at most size bytes. Compares a word at a time.
  *
  */
-static long mem_diff (zbyte *a, zbyte *b, zword mem_size, zbyte *diff)
+static long equal_prefix_scalar (const zbyte *a, const zbyte *b, long size)
 {
-    unsigned size = mem_size;
-    zbyte *p = diff;
-    unsigned j;
+    unsigned long x, y;
+    long i = 0;
+
+    for (; i + (long) sizeof (x) <= size; i += sizeof (x)) {
+	memcpy (&x, a + i, sizeof (x));
+	memcpy (&y, b + i, sizeof (y));
+	if (x != y)
+	    break;
+    }
+    while (i < size && a[i] == b[i])
+	i++;
+    return i;
+
+}/* equal_prefix_scalar */
+
+#ifdef __SSE2__
+
+/*
+ * equal_prefix_sse2
+ *
+ * Same as equal_prefix_scalar, comparing 16 bytes at a time.
+ *
+ */
+static long equal_prefix_sse2 (const zbyte *a, const zbyte *b, long size)
+{
+    unsigned mask;
+    long i = 0;
+
+    for (; i + 16 <= size; i += 16) {
+	mask = _mm_movemask_epi8 (_mm_cmpeq_epi8 (
+	    _mm_loadu_si128 ((const __m128i *) (a + i)),
+	    _mm_loadu_si128 ((const __m128i *) (b + i))));
+	if (mask != 0xffff)
+	    return i + __builtin_ctz (~mask);
+    }
+    return i + equal_prefix_scalar (a + i, b + i, size - i);
+
+}/* equal_prefix_sse2 */
+
+/*
+ * equal_prefix_avx2
+ *
+ * Same as equal_prefix_scalar, comparing 32 bytes at a time. Only called
+ * when the processor supports AVX2.
+ *
+ */
+__attribute__ ((target ("avx2")))
+static long equal_prefix_avx2 (const zbyte *a, const zbyte *b, long size)
+{
+    unsigned mask;
+    long i = 0;
+
+    for (; i + 32 <= size; i += 32) {
+	mask = _mm256_movemask_epi8 (_mm256_cmpeq_epi8 (
+	    _mm256_loadu_si256 ((const __m256i *) (a + i)),
+	    _mm256_loadu_si256 ((const __m256i *) (b + i))));
+	if (mask != 0xffffffff)
+	    return i + __builtin_ctz (~mask);
+    }
+    _mm256_zeroupper ();	/* Mixing in SSE code is slow otherwise */
+    return i + equal_prefix_sse2 (a + i, b + i, size - i);
+
+}/* equal_prefix_avx2 */
+
+#endif
+
+static long (*equal_prefix) (const zbyte *, const zbyte *, long) = NULL;
+
+/*
+ * mem_equal_prefix
+ *
+ * Return the number of leading bytes that a and b have in common,
+ * comparing at most size bytes. The fastest version the processor
+ * supports is chosen on the first call.
+ *
+ */
+long mem_equal_prefix (const zbyte *a, const zbyte *b, long size)
+{
+    if (equal_prefix == NULL) {
+#ifdef __SSE2__
+	__builtin_cpu_init ();
+	if (__builtin_cpu_supports ("avx2"))
+	    equal_prefix = equal_prefix_avx2;
+	else
+	    equal_prefix = equal_prefix_sse2;
+#else
+	equal_prefix = equal_prefix_scalar;
+#endif
+    }
+    return equal_prefix (a, b, size);
+
+}/* mem_equal_prefix */
+
+
+/*
+ * diff_range
+ *
+ * Append the difference between size bytes of a and b to the diff at
+ * p, as mem_diff does, copying a to b. *skip holds the number of equal
+ * bytes before a not written to the diff yet, and is left with those
+ * at the end of the range. Returns the end of the diff.
+ *
+ */
+static zbyte *diff_range (zbyte *a, zbyte *b, unsigned long size, zbyte *p, unsigned long *skip)
+{
+    unsigned long j;
     zbyte c;
 
     for (;;) {
-	for (j = 0; size > 0 && (c = *a++ ^ *b++) == 0; j++)
-	    size--;
+	/* Skip the run of equal bytes, which is often short */
+	for (j = 0; j < size && j < 16 && a[j] == b[j]; j++)
+	    ;
+	if (j == 16)
+	    j += mem_equal_prefix (a + 16, b + 16, size - 16);
+	a += j;
+	b += j;
+	size -= j;
+	*skip += j;
 	if (size == 0) break;
+	c = *a++ ^ *b++;
 	size--;
-	if (j > 0x8000) {
+	j = *skip;
+	*skip = 0;
+	while (j > 0x8000) {
 	    *p++ = 0;
 	    *p++ = 0xff;
 	    *p++ = 0xff;
@@ -858,17 +1119,61 @@ static long mem_diff (zbyte *a, zbyte *b, zword mem_size, zbyte *diff)
 	*p++ = c;
 	*(b - 1) ^= c;
     }
-    return p - diff;
+    return p;
+}/* diff_range */
+
+
+/*
+ * mem_diff
+ *
+ * Set diff to a Quetzal-like difference between a and b,
+ * copying a to b as we go.  It is assumed that diff points to a
+ * buffer which is large enough to hold the diff.
+ * mem_size is the number of bytes to compare.
+ * Returns the number of bytes copied to diff.
+ *
+ */
+long mem_diff (zbyte *a, zbyte *b, long mem_size, zbyte *diff)
+{
+    unsigned long skip = 0;
+
+    return diff_range (a, b, mem_size, diff, &skip) - diff;
 }/* mem_diff */
 
 
+/*
+ * mem_diff_pages
+ *
+ * Same as mem_diff, but only compare the given pages of DIRTY_PAGE_SIZE
+ * bytes, in increasing order. The other bytes are taken to be equal.
+ *
+ */
+long mem_diff_pages (zbyte *a, zbyte *b, long mem_size, const zword *pages, int count, zbyte *diff)
+{
+    unsigned long skip = 0;
+    long addr, end = 0;
+    zbyte *p = diff;
+    int i;
+
+    for (i = 0; i < count; i++) {
+	addr = (long) pages[i] << DIRTY_PAGE_SHIFT;
+	if (addr >= mem_size)
+	    break;
+	skip += addr - end;
+	end = (addr + DIRTY_PAGE_SIZE < mem_size) ? addr + DIRTY_PAGE_SIZE : mem_size;
+	p = diff_range (a + addr, b + addr, end - addr, p, &skip);
+    }
+    return p - diff;
+}/* mem_diff_pages */
+
+
 /*
  * mem_undiff
  *
  * Applies a quetzal-like diff to dest
  *
  */
-static void mem_undiff (zbyte *diff, long diff_length, zbyte *dest)
+void mem_undiff (zbyte *diff, long diff_length, zbyte *dest)
 {
     zbyte c;
 
@@ -898,6 +1203,46 @@ static void mem_undiff (zbyte *diff, long diff_length, zbyte *dest)
 }/* mem_undiff */
 
 
+/*
+ * mem_undiff_extent
+ *
+ * Returns the number of bytes of dest that mem_undiff would change or
+ * skip over when applying the diff, so callers can bound it by the size
+ * of dest before trusting a diff they did not write.
+ *
+ */
+long mem_undiff_extent (zbyte *diff, long diff_length)
+{
+    long extent = 0;
+    zbyte c;
+
+    while (diff_length) {
+	c = *diff++;
+	diff_length--;
+	if (c == 0) {
+	    unsigned runlen;
+
+	    if (!diff_length)
+		break;
+	    runlen = *diff++;
+	    diff_length--;
+	    if (runlen & 0x80) {
+		if (!diff_length)
+		    break;
+		c = *diff++;
+		diff_length--;
+		runlen = (runlen & 0x7f) | (((unsigned) c) << 7);
+	    }
+
+	    extent += runlen + 1;
+	} else {
+	    extent++;
+	}
+    }
+    return extent;
+}/* mem_undiff_extent */
+
+
 /*
  * restore_undo
  *
@@ -919,10 +1264,11 @@ int restore_undo (void)
     /* undo possible */
 
     memcpy (zmp, prev_zmp, h_dynamic_size);
+    all_dirty = DIRTY_BOTH;
     SET_PC (pc);
     sp = stack + STACK_SIZE - curr_undo->stack_size;
     fp = stack + curr_undo->frame_offset;
-    frame_count = curr_undo->frame_count;
+    frame_count = curr_undo->frame_cnt;
     mem_undiff ((zbyte *) (curr_undo + 1), curr_undo->diff_size, prev_zmp);
     memcpy (sp, (zbyte *)(curr_undo + 1) + curr_undo->diff_size,
 	    curr_undo->stack_size * sizeof (*sp));
@@ -1077,7 +1423,7 @@ int save_undo (void)
     pc = p->pc;
     GET_PC (pc);	/* Turbo C doesn't like seeing p->pc here */
     p->pc = pc;
-    p->frame_count = frame_count;
+    p->frame_cnt = frame_count;
     p->diff_size = diff_size;
     p->stack_size = stack_size;
     p->frame_offset = fp - stack;
@@ -41,11 +41,12 @@ extern bool read_yes_or_no (const char *);
 extern char latin1_to_ibm[];
 #endif
 
-static int script_width = 0;
+#define script_width	(zctx->script_width)
+#define script_valid	(zctx->script_valid)
 
-static FILE *sfp = NULL;
-static FILE *rfp = NULL;
-static FILE *pfp = NULL;
+#define sfp		(zctx->sfp)
+#define rfp		(zctx->rfp)
+#define pfp		(zctx->pfp)
 
 /*
  * script_open
@@ -63,8 +64,6 @@ static FILE *pfp = NULL;
 
 void script_open (void)
 {
-    static bool script_valid = FALSE;
-
     char new_name[MAX_FILE_NAME + 1];
 
     h_flags &= ~SCRIPTING_FLAG;
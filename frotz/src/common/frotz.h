@@ -18,6 +18,7 @@ typedef int bool;
 #endif /* __UNIX_PORT_FILE */
 
 #include <stdio.h>
+#include <setjmp.h>
 
 #ifndef TRUE
 #define TRUE 1
@@ -352,15 +353,36 @@ typedef struct {
 
 /*** Data access macros ***/
 
-#define SET_BYTE(addr,v)  { zmp[addr] = v; }
+/* Writes to dynamic memory are tracked in pages of 64 bytes, so that
+ * rolling back to a checkpoint only copies what was written since. The
+ * undo stack keeps its own set of the pages written since its last
+ * push, in the second bit of dirty */
+
+#define DIRTY_PAGE_SHIFT 6
+#define DIRTY_PAGE_SIZE (1 << DIRTY_PAGE_SHIFT)
+#define DIRTY_PAGES (0x10000 >> DIRTY_PAGE_SHIFT)
+
+#define DIRTY_CHECKPOINT 1
+#define DIRTY_UNDO 2
+#define DIRTY_BOTH (DIRTY_CHECKPOINT | DIRTY_UNDO)
+
+#define MARK_DIRTY(addr) { \
+    zword page_ = (zword) (addr) >> DIRTY_PAGE_SHIFT; \
+    if (zctx->dirty[page_] != DIRTY_BOTH) { \
+	if (!(zctx->dirty[page_] & DIRTY_CHECKPOINT)) \
+	    zctx->dirty_pages[zctx->dirty_count++] = page_; \
+	if (!(zctx->dirty[page_] & DIRTY_UNDO)) \
+	    zctx->undo_dirty_pages[zctx->undo_dirty_count++] = page_; \
+	zctx->dirty[page_] = DIRTY_BOTH; \
+    } \
+}
+
+#define SET_BYTE(addr,v)  { zmp[addr] = v; MARK_DIRTY (addr) }
 #define LOW_BYTE(addr,v)  { v = zmp[addr]; }
 #define CODE_BYTE(v)	  { v = *pcp++;    }
 
 #if defined (AMIGA)
 
-extern zbyte *pcp;
-extern zbyte *zmp;
-
 #define lo(v)	((zbyte *)&v)[1]
 #define hi(v)	((zbyte *)&v)[0]
 
@@ -374,9 +396,6 @@ extern zbyte *zmp;
 #endif
 
 #if defined (MSDOS_16BIT)
-extern zbyte *pcp;
-extern zbyte *zmp;
-
 #define lo(v)   ((zbyte *)&v)[0]
 #define hi(v)   ((zbyte *)&v)[1]
 
@@ -449,13 +468,11 @@ extern zbyte *zmp;
 
 #if !defined (AMIGA) && !defined (MSDOS_16BIT)
 
-extern zbyte *pcp;
-extern zbyte *zmp;
-
 #define lo(v)	(v & 0xff)
 #define hi(v)	(v >> 8)
 
-#define SET_WORD(addr,v)  { zmp[addr] = hi(v); zmp[addr+1] = lo(v); }
+#define SET_WORD(addr,v)  { zmp[addr] = hi(v); zmp[addr+1] = lo(v); \
+			    MARK_DIRTY (addr) MARK_DIRTY (addr+1) }
 #define LOW_WORD(addr,v)  { v = ((zword) zmp[addr] << 8) | zmp[addr+1]; }
 #define HIGH_WORD(addr,v) { v = ((zword) zmp[addr] << 8) | zmp[addr+1]; }
 #define CODE_WORD(v)      { v = ((zword) pcp[0] << 8) | pcp[1]; pcp += 2; }
@@ -463,116 +480,11 @@ extern zbyte *zmp;
 #define SET_PC(v)         { pcp = zmp + v; }
 
 #endif
-extern zbyte *undo_mem, *prev_zmp, *undo_diff;
-
-/*** Story file header data ***/
-extern FILE *story_fp;
-extern zbyte h_version;
-extern zbyte h_config;
-extern zword h_release;
-extern zword h_resident_size;
-extern zword h_start_pc;
-extern zword h_dictionary;
-extern zword h_objects;
-extern zword h_globals;
-extern zword h_dynamic_size;
-extern zword h_flags;
-extern zbyte h_serial[6];
-extern zword h_abbreviations;
-extern zword h_file_size;
-extern zword h_checksum;
-extern zbyte h_interpreter_number;
-extern zbyte h_interpreter_version;
-extern zbyte h_screen_rows;
-extern zbyte h_screen_cols;
-extern zword h_screen_width;
-extern zword h_screen_height;
-extern zbyte h_font_height;
-extern zbyte h_font_width;
-extern zword h_functions_offset;
-extern zword h_strings_offset;
-extern zbyte h_default_background;
-extern zbyte h_default_foreground;
-extern zword h_terminating_keys;
-extern zword h_line_width;
-extern zbyte h_standard_high;
-extern zbyte h_standard_low;
-extern zword h_alphabet;
-extern zword h_extension_table;
-extern zbyte h_user_name[8];
-
-extern zword hx_table_size;
-extern zword hx_mouse_x;
-extern zword hx_mouse_y;
-extern zword hx_unicode_table;
-extern zword hx_flags;
-extern zword hx_fore_colour;
-extern zword hx_back_colour;
-
-/*** Various data ***/
-
-extern enum story story_id;
-extern long story_size;
-
-extern zword stack[STACK_SIZE];
-extern zword *sp;
-extern zword *fp;
-extern zword frame_count;
-
-extern zword zargs[8];
-extern int zargc;
-
-extern bool ostream_screen;
-extern bool ostream_script;
-extern bool ostream_memory;
-extern bool ostream_record;
-extern bool istream_replay;
-extern bool message;
-
-extern int cwin;
-extern int mwin;
-
-extern int mouse_x;
-extern int mouse_y;
-extern int menu_selected;
-extern int mouse_button;
-
-extern bool enable_wrapping;
-extern bool enable_scripting;
-extern bool enable_scrolling;
-extern bool enable_buffering;
-
-extern bool use_squetzal;
-extern zword quetzal_success;
-extern unsigned char* save_buff;
 
 extern char *option_zcode_path;	/* dg */
 
 extern long reserve_mem;
 
-// Keep track of the last n=16 changes to object tree
-extern int move_diff_cnt;
-extern zword move_diff_objs[16];
-extern zword move_diff_dest[16];
-
-// Keep track of the last n=16 changes to obj attributes
-extern int attr_diff_cnt;
-extern zword attr_diff_objs[16];
-extern zword attr_diff_nb[16];
-
-// Keep track of the last n=16 clears of obj attributes
-extern int attr_clr_cnt;
-extern zword attr_clr_objs[16];
-extern zword attr_clr_nb[16];
-
-// Keep track of up to n=16 changes to special ram locations defined by the game
-extern int ram_diff_cnt;
-extern zword ram_diff_addr[16];
-extern zword ram_diff_value[16];
-
-// Set to True when the game has encountered a fatal error
-extern int emulator_halted;
-
 /*** Z-machine opcodes ***/
 
 void 	z_add (void);
@@ -748,9 +660,408 @@ void	runtime_error (int);
 
 #define ERR_DEFAULT_REPORT_MODE ERR_REPORT_NEVER
 
+/*** Z-machine context ***/
+
+/* Everything that used to be a mutable global lives in a zmachine_ctx,
+   so that one copy of the library can host any number of machines.
+   The exported entry points select a context by pointing zctx at it;
+   the rest of the interpreter reaches its state through the macros
+   below, which read exactly like the old globals. */
+
+#include "../blorb/blorb.h"
+
+#define MAX_NESTING 16
+#define SCREEN_BUFF_SIZE 8192
+
+struct undo_struct;
+struct pict_info_struct;
+
+typedef struct redirect_struct {
+    zword xsize;
+    zword table;
+    zword width;
+    zword total;
+} redirect_t;
+
+typedef struct zmachine_ctx {
+
+    /* main.c */
+    enum story story_id;
+    long story_size;
+
+    zbyte h_version;
+    zbyte h_config;
+    zword h_release;
+    zword h_resident_size;
+    zword h_start_pc;
+    zword h_dictionary;
+    zword h_objects;
+    zword h_globals;
+    zword h_dynamic_size;
+    zword h_flags;
+    zbyte h_serial[6];
+    zword h_abbreviations;
+    zword h_file_size;
+    zword h_checksum;
+    zbyte h_interpreter_number;
+    zbyte h_interpreter_version;
+    zbyte h_screen_rows;
+    zbyte h_screen_cols;
+    zword h_screen_width;
+    zword h_screen_height;
+    zbyte h_font_height;
+    zbyte h_font_width;
+    zword h_functions_offset;
+    zword h_strings_offset;
+    zbyte h_default_background;
+    zbyte h_default_foreground;
+    zword h_terminating_keys;
+    zword h_line_width;
+    zbyte h_standard_high;
+    zbyte h_standard_low;
+    zword h_alphabet;
+    zword h_extension_table;
+    zbyte h_user_name[8];
+
+    zword hx_table_size;
+    zword hx_mouse_x;
+    zword hx_mouse_y;
+    zword hx_unicode_table;
+
+    zword stack[STACK_SIZE];
+    zword *sp;
+    zword *fp;
+    zword frame_count;
+
+    bool ostream_screen;
+    bool ostream_script;
+    bool ostream_memory;
+    bool ostream_record;
+    bool istream_replay;
+    bool message;
+
+    int cwin;
+    int mwin;
+
+    int mouse_x;
+    int mouse_y;
+
+    bool enable_wrapping;
+    bool enable_scripting;
+    bool enable_scrolling;
+    bool enable_buffering;
+
+    /* process.c */
+    zword zargs[8];
+    int zargc;
+    int finished;
+    bool decode_cache;			/* Run from pre-decoded instructions */
+    bool insn_fusion;			/* Fuse pairs of decoded instructions */
+    struct insn_blocks *insn_cache;	/* Decoded instructions, shared by */
+					/* the clones of the machine */
+    struct profile *profile;		/* NULL unless profiling */
+    long max_instructions;		/* Per run_until_input, 0 for no limit */
+    long insn_count;			/* Instructions run since it started */
+    bool timed_out;			/* Set when max_instructions is hit */
+    jmp_buf *fatal_jmp;			/* Where os_fatal returns, or NULL */
+
+    /* object.c */
+    bool object_index;			/* Index objects and properties */
+    struct prop_entry *prop_index;	/* NULL until the first lookup */
+    zword *obj_addrs;			/* Address of each object */
+    int max_object;
+
+    /* fastmem.c */
+    zbyte *zmp;
+    zbyte *pcp;
+    FILE *story_fp;
+    struct undo_struct *first_undo, *last_undo, *curr_undo;
+    zbyte *undo_mem, *prev_zmp, *undo_diff;
+    int undo_count;
+    bool auto_undo;			/* save_undo on each read in V1-V4 */
+    bool first_restart;
+    bool use_squetzal;
+    unsigned char *stf_buff;
+    unsigned char *save_buff;
+    zword quetzal_success;
+    zbyte dirty[DIRTY_PAGES];		/* DIRTY_CHECKPOINT and DIRTY_UNDO bits */
+    zword dirty_pages[DIRTY_PAGES];	/* Pages written since the checkpoint */
+    int dirty_count;
+    zword undo_dirty_pages[DIRTY_PAGES];	/* ...and since the last undo_push */
+    int undo_dirty_count;
+    zbyte all_dirty;			/* Same bits, for memory overwritten */
+					/* as a whole */
+    zbyte *checkpoint_mem;
+    zword checkpoint_stack[STACK_SIZE];
+    long checkpoint_pc;
+    int checkpoint_sp;
+    int checkpoint_fp;
+    zword checkpoint_frame_count;
+    struct snapshot *snap_base;		/* Last snapshot taken or restored */
+    struct level_stack *undo_stack;	/* NULL until undo_push */
+    int undo_max_depth;			/* 0 for no limit */
+    long undo_max_bytes;		/* 0 for no limit */
+
+    /* files.c */
+    int script_width;
+    bool script_valid;
+    FILE *sfp;
+    FILE *rfp;
+    FILE *pfp;
+
+    /* object.c: the last n=16 changes to the object tree and attributes */
+    int move_diff_cnt;
+    zword move_diff_objs[16];
+    zword move_diff_dest[16];
+    int attr_diff_cnt;
+    zword attr_diff_objs[16];
+    zword attr_diff_nb[16];
+    int attr_clr_cnt;
+    zword attr_clr_objs[16];
+    zword attr_clr_nb[16];
+
+    /* random.c */
+    long rng_A;
+    int rng_interval;
+    int rng_counter;
+
+    /* redirect.c */
+    int redirect_depth;
+    redirect_t redirect[MAX_NESTING];
+
+    /* stream.c */
+    bool headless;			/* Screen output skips the screen model */
+    bool headless_probing;		/* Candidate actions run headless */
+
+    /* screen.c */
+    int font_height;
+    int font_width;
+    bool input_redraw;
+    bool more_prompts;
+    bool discarding;
+    bool cursor;
+    int input_window;
+    Zwindow wp[8];
+    Zwindow *cwp;
+
+    /* sound.c */
+    zword sound_routine;
+    int next_sample;
+    int next_volume;
+    bool sound_locked;
+    bool sound_playing;
+
+    /* text.c */
+    zchar decoded[10];
+    zword encoded[3];
+    struct dict_index *dict_indexes;	/* Indexed dictionaries */
+    struct string_cache *text_cache;	/* Output of static strings */
+
+    /* buffer.c */
+    zchar buffer[TEXT_BUFFER_SIZE];
+    int bufpos;
+    zchar prev_c;
+    bool buffer_locked;
+    bool buffer_flag;
+
+    /* err.c */
+    int error_count[ERR_NUM_ERRORS];
+
+    /* dumb port */
+    f_setup_t f_setup;
+    int user_screen_width;
+    int user_screen_height;
+    int user_interpreter_number;
+    int user_random_seed;
+    int user_tandy_bit;
+    bool do_more_prompts;
+
+    float input_speed;
+    char next_action[INPUT_BUFFER_SIZE];
+    int time_ahead;
+    char read_key_buffer[INPUT_BUFFER_SIZE];
+    char read_line_buffer[INPUT_BUFFER_SIZE];
+    bool timed_out_last_time;
+
+    bool show_line_numbers;
+    bool show_line_types;
+    bool show_pictures;
+    bool visual_bell;
+    bool plain_ascii;
+    int screen_cells;
+    unsigned short *screen_data;
+    char screen_buffer[SCREEN_BUFF_SIZE];
+    char *screen_buffer_ptr;
+    int current_style;
+    char *screen_changes;
+    int cursor_row, cursor_col;
+    int compression_mode;
+    int hide_lines;
+    int rv_mode;
+    char rv_blank_char;
+
+    struct pict_info_struct *pict_info;
+    int num_pictures;
+
+    FILE *blorb_fp;
+    bb_result_t blorb_res;
+    bb_map_t *blorb_map;
+
+    /* Jericho interface */
+    zbyte next_opcode;
+    zbyte checkpoint_opcode;
+    long checkpoint_rng_A;
+    int checkpoint_rng_interval;
+    int checkpoint_rng_counter;
+    int desired_seed;
+    int rom_idx;
+    char world[8192];
+    int emulator_halted;	/* Set when the game hits a fatal error */
+
+    /* Special per-game ram locations and the last n=16 changes to them */
+    int num_special_addrs;
+    zword *special_ram_addrs;
+    zbyte *special_ram_values;
+    int ram_diff_cnt;
+    zword ram_diff_addr[16];
+    zword ram_diff_value[16];
+
+    /* Clones of this machine used by filter_candidate_actions_parallel */
+    struct zmachine_ctx **workers;
+    int num_workers;
+
+    /* Per-game bookkeeping */
+    int tw_num_world_objs;
+    int tw_player_obj_num;
+    int tw_move_count;
+    int tw_score;
+    int tw_max_score;
+    int afflicted_score;
+
+} zmachine_ctx;
+
+/* The machine the interpreter is currently running on this thread. It
+ * is read by nearly every instruction. The default TLS model of a shared
+ * library looks it up with a call to __tls_get_addr on each use; the
+ * initial-exec model reads it at a fixed offset from the thread pointer,
+ * using a few bytes of the static TLS that glibc keeps for libraries
+ * loaded with dlopen. */
+extern __thread zmachine_ctx *zctx __attribute__ ((tls_model ("initial-exec")));
+
+/* Moves ptr, a pointer into machine src, to the same place in zctx */
+#define REBASE(ptr, src) \
+	((void *) ((char *) zctx + ((char *) (ptr) - (char *) (src))))
+
+zmachine_ctx *create_ctx (void);
+zmachine_ctx *clone_ctx (zmachine_ctx *);
+void	free_ctx (zmachine_ctx *);
+
+#define story_id		(zctx->story_id)
+#define story_size		(zctx->story_size)
+
+#define h_version		(zctx->h_version)
+#define h_config		(zctx->h_config)
+#define h_release		(zctx->h_release)
+#define h_resident_size		(zctx->h_resident_size)
+#define h_start_pc		(zctx->h_start_pc)
+#define h_dictionary		(zctx->h_dictionary)
+#define h_objects		(zctx->h_objects)
+#define h_globals		(zctx->h_globals)
+#define h_dynamic_size		(zctx->h_dynamic_size)
+#define h_flags			(zctx->h_flags)
+#define h_serial		(zctx->h_serial)
+#define h_abbreviations		(zctx->h_abbreviations)
+#define h_file_size		(zctx->h_file_size)
+#define h_checksum		(zctx->h_checksum)
+#define h_interpreter_number	(zctx->h_interpreter_number)
+#define h_interpreter_version	(zctx->h_interpreter_version)
+#define h_screen_rows		(zctx->h_screen_rows)
+#define h_screen_cols		(zctx->h_screen_cols)
+#define h_screen_width		(zctx->h_screen_width)
+#define h_screen_height		(zctx->h_screen_height)
+#define h_font_height		(zctx->h_font_height)
+#define h_font_width		(zctx->h_font_width)
+#define h_functions_offset	(zctx->h_functions_offset)
+#define h_strings_offset	(zctx->h_strings_offset)
+#define h_default_background	(zctx->h_default_background)
+#define h_default_foreground	(zctx->h_default_foreground)
+#define h_terminating_keys	(zctx->h_terminating_keys)
+#define h_line_width		(zctx->h_line_width)
+#define h_standard_high		(zctx->h_standard_high)
+#define h_standard_low		(zctx->h_standard_low)
+#define h_alphabet		(zctx->h_alphabet)
+#define h_extension_table	(zctx->h_extension_table)
+#define h_user_name		(zctx->h_user_name)
+
+#define hx_table_size		(zctx->hx_table_size)
+#define hx_mouse_x		(zctx->hx_mouse_x)
+#define hx_mouse_y		(zctx->hx_mouse_y)
+#define hx_unicode_table	(zctx->hx_unicode_table)
+
+#define stack			(zctx->stack)
+#define sp			(zctx->sp)
+#define fp			(zctx->fp)
+#define frame_count		(zctx->frame_count)
+
+#define zargs			(zctx->zargs)
+#define zargc			(zctx->zargc)
+
+#define ostream_screen		(zctx->ostream_screen)
+#define ostream_script		(zctx->ostream_script)
+#define ostream_memory		(zctx->ostream_memory)
+#define ostream_record		(zctx->ostream_record)
+#define istream_replay		(zctx->istream_replay)
+#define message			(zctx->message)
+
+#define cwin			(zctx->cwin)
+#define mwin			(zctx->mwin)
+
+#define mouse_x			(zctx->mouse_x)
+#define mouse_y			(zctx->mouse_y)
+
+#define enable_wrapping		(zctx->enable_wrapping)
+#define enable_scripting	(zctx->enable_scripting)
+#define enable_scrolling	(zctx->enable_scrolling)
+#define enable_buffering	(zctx->enable_buffering)
+
+#define zmp			(zctx->zmp)
+#define pcp			(zctx->pcp)
+#define story_fp		(zctx->story_fp)
+#define undo_mem		(zctx->undo_mem)
+#define prev_zmp		(zctx->prev_zmp)
+#define undo_diff		(zctx->undo_diff)
+#define use_squetzal		(zctx->use_squetzal)
+#define save_buff		(zctx->save_buff)
+#define quetzal_success		(zctx->quetzal_success)
+
+#define move_diff_cnt		(zctx->move_diff_cnt)
+#define move_diff_objs		(zctx->move_diff_objs)
+#define move_diff_dest		(zctx->move_diff_dest)
+#define attr_diff_cnt		(zctx->attr_diff_cnt)
+#define attr_diff_objs		(zctx->attr_diff_objs)
+#define attr_diff_nb		(zctx->attr_diff_nb)
+#define attr_clr_cnt		(zctx->attr_clr_cnt)
+#define attr_clr_objs		(zctx->attr_clr_objs)
+#define attr_clr_nb		(zctx->attr_clr_nb)
+
+#define f_setup			(zctx->f_setup)
+
+#define world			(zctx->world)
+#define emulator_halted		(zctx->emulator_halted)
+#define ram_diff_cnt		(zctx->ram_diff_cnt)
+#define ram_diff_addr		(zctx->ram_diff_addr)
+#define ram_diff_value		(zctx->ram_diff_value)
+
 /*** Assorted initialization functions ***/
 void   init_buffer (void);
 void   init_process (void);
+void   init_objects (void);
+void   reset_text (void);
+void   reset_objects (void);
+void   reset_process (void);
+void   reset_redirect (void);
+void   clone_process (void);
+void   run_until_input (void);
 void   init_sound (void);
 
 /*** Various global functions ***/
@@ -227,7 +227,7 @@ void z_read (void)
 
     /* Perform save_undo for V1 to V4 games */
 
-    if (h_version <= V4)
+    if (h_version <= V4 && zctx->auto_undo)
 	save_undo ();
 
     /* Copy local buffer back to dynamic memory */
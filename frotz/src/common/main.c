@@ -34,87 +34,17 @@ extern void interpret (void);
 extern void init_memory (void);
 extern void init_undo (void);
 extern void reset_memory (void);
-extern void shutdown (void);
 
 
-/* Story file name, id number and size */
+/* Story file name */
 
 char *story_name = 0;
 
-enum story story_id = UNKNOWN;
-long story_size = 0;
-
-/* Story file header data */
-
-zbyte h_version = 0;
-zbyte h_config = 0;
-zword h_release = 0;
-zword h_resident_size = 0;
-zword h_start_pc = 0;
-zword h_dictionary = 0;
-zword h_objects = 0;
-zword h_globals = 0;
-zword h_dynamic_size = 0;
-zword h_flags = 0;
-zbyte h_serial[6] = { 0, 0, 0, 0, 0, 0 };
-zword h_abbreviations = 0;
-zword h_file_size = 0;
-zword h_checksum = 0;
-zbyte h_interpreter_number = 0;
-zbyte h_interpreter_version = 0;
-zbyte h_screen_rows = 0;
-zbyte h_screen_cols = 0;
-zword h_screen_width = 0;
-zword h_screen_height = 0;
-zbyte h_font_height = 1;
-zbyte h_font_width = 1;
-zword h_functions_offset = 0;
-zword h_strings_offset = 0;
-zbyte h_default_background = 0;
-zbyte h_default_foreground = 0;
-zword h_terminating_keys = 0;
-zword h_line_width = 0;
-zbyte h_standard_high = 1;
-zbyte h_standard_low = 0;
-zword h_alphabet = 0;
-zword h_extension_table = 0;
-zbyte h_user_name[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
-
-zword hx_table_size = 0;
-zword hx_mouse_x = 0;
-zword hx_mouse_y = 0;
-zword hx_unicode_table = 0;
-
-/* Stack data */
-
-zword stack[STACK_SIZE];
-zword *sp = 0;
-zword *fp = 0;
-zword frame_count = 0;
-
-/* IO streams */
-
-bool ostream_screen = TRUE;
-bool ostream_script = FALSE;
-bool ostream_memory = FALSE;
-bool ostream_record = FALSE;
-bool istream_replay = FALSE;
-bool message = FALSE;
-
-/* Current window and mouse data */
-
-int cwin = 0;
-int mwin = 0;
-
-int mouse_y = 0;
-int mouse_x = 0;
-
-/* Window attributes */
-
-bool enable_wrapping = FALSE;
-bool enable_scripting = FALSE;
-bool enable_scrolling = FALSE;
-bool enable_buffering = FALSE;
+/* The machine being run by this thread; see zmachine_ctx in frotz.h.
+ * Thread-local so that different threads can drive different machines
+ * at the same time. */
+
+__thread zmachine_ctx *zctx = NULL;
 
 int option_sound = 1;
 char *option_zcode_path;
@@ -205,6 +135,6 @@ int cdecl main (int argc, char *argv[])
   /*   printf("%s\n", step("score\n")); */
   /*   shutdown(); */
   /* } */
-  shutdown();
+  free_ctx(create_ctx());
   return 0;
 }/* main */
@@ -18,6 +18,7 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#include <stdlib.h>
 #include "frotz.h"
 
 #define MAX_OBJECT 2000
@@ -34,20 +35,107 @@
 #define O4_PROPERTY_OFFSET 12
 #define O4_SIZE 14
 
-int move_diff_cnt;
-zword move_diff_objs[16];
-zword move_diff_dest[16];
-int attr_diff_cnt;
-zword attr_diff_objs[16];
-zword attr_diff_nb[16];
-int attr_clr_cnt;
-zword attr_clr_objs[16];
-zword attr_clr_nb[16];
+/*
+ * Index of property lookups, filled in as objects and properties are
+ * looked up: (object, property) -> address found by the scan of the
+ * property list. Direct mapped; a colliding lookup replaces the entry.
+ *
+ */
+
+#define PROP_INDEX_SIZE 4096
+
+struct prop_entry {
+    unsigned key;		/* object << 6 | property, 0 for none */
+    zword table;		/* Property table of the object */
+    zword addr;			/* Header of the property, or the one */
+				/* where the scan stopped */
+};
+
+#define prop_index (zctx->prop_index)
+
+/*
+ * Fields of the object entry at address a, in V1-3 and in V4+ stories
+ *
+ */
+
+#define WORD_AT(a) ((zword) (zmp[a] << 8 | zmp[(a) + 1]))
+
+#define PARENT_V3(a) (zmp[(a) + O1_PARENT])
+#define SIBLING_V3(a) (zmp[(a) + O1_SIBLING])
+#define CHILD_V3(a) (zmp[(a) + O1_CHILD])
+#define PROPERTIES_V3(a) WORD_AT ((a) + O1_PROPERTY_OFFSET)
+
+#define PARENT_V4(a) WORD_AT ((a) + O4_PARENT)
+#define SIBLING_V4(a) WORD_AT ((a) + O4_SIBLING)
+#define CHILD_V4(a) WORD_AT ((a) + O4_CHILD)
+#define PROPERTIES_V4(a) WORD_AT ((a) + O4_PROPERTY_OFFSET)
+
+#define obj_addrs (zctx->obj_addrs)
+#define max_object (zctx->max_object)
+
+/*
+ * entry_address
+ *
+ * Calculate the address of an object from its number.
+ *
+ */
+static zword entry_address (zword obj)
+{
+    if (h_version <= V3)
+	return h_objects + ((obj - 1) * O1_SIZE + 62);
+    else
+	return h_objects + ((obj - 1) * O4_SIZE + 126);
+
+}/* entry_address */
+
+
+/*
+ * init_objects
+ *
+ * Build the table of object addresses of the story just loaded, and
+ * start a new property index, unless they are turned off.
+ *
+ */
+void init_objects (void)
+{
+    int i;
+
+    reset_objects ();
+
+    max_object = (h_version <= V3) ? 255 : MAX_OBJECT;
+
+    if (!zctx->object_index)
+	return;
+
+    if ((obj_addrs = malloc ((max_object + 1) * sizeof (zword))) == NULL)
+	os_fatal ("Out of memory");
+
+    for (i = 0; i <= max_object; i++)
+	obj_addrs[i] = entry_address (i);
+
+}/* init_objects */
+
+
+/*
+ * reset_objects
+ *
+ * Free the object tables of the story.
+ *
+ */
+void reset_objects (void)
+{
+    free (obj_addrs);
+    obj_addrs = NULL;
+    free (prop_index);
+    prop_index = NULL;
+
+}/* reset_objects */
+
 
 /*
  * object_address
  *
- * Calculate the address of an object.
+ * Return the address of an object.
  *
  */
 zword object_address (zword obj)
@@ -56,20 +144,20 @@ zword object_address (zword obj)
 
     /* Check object number */
 
-    if (obj > ((h_version <= V3) ? 255 : MAX_OBJECT)) {
-	print_string("@Attempt to address illegal object ");
-	print_num(obj);
-	print_string(".  This is normally fatal.");
-	new_line();
-	runtime_error (ERR_ILL_OBJ);
+    if (obj > max_object || obj_addrs == NULL) {
+	if (obj > ((h_version <= V3) ? 255 : MAX_OBJECT)) {
+	    print_string("@Attempt to address illegal object ");
+	    print_num(obj);
+	    print_string(".  This is normally fatal.");
+	    new_line();
+	    runtime_error (ERR_ILL_OBJ);
+	}
+	return entry_address (obj);
     }
 
     /* Return object address */
 
-    if (h_version <= V3)
-	return h_objects + ((obj - 1) * O1_SIZE + 62);
-    else
-	return h_objects + ((obj - 1) * O4_SIZE + 126);
+    return obj_addrs[obj];
 
 }/* object_address */
 
@@ -83,20 +171,15 @@ zword object_address (zword obj)
 zword object_name (zword object)
 {
     zword obj_addr;
-    zword name_addr;
 
     obj_addr = object_address (object);
 
     /* The object name address is found at the start of the properties */
 
     if (h_version <= V3)
-	obj_addr += O1_PROPERTY_OFFSET;
+	return PROPERTIES_V3 (obj_addr);
     else
-	obj_addr += O4_PROPERTY_OFFSET;
-
-    LOW_WORD (obj_addr, name_addr)
-
-    return name_addr;
+	return PROPERTIES_V4 (obj_addr);
 
 }/* object_name */
 
@@ -108,19 +191,8 @@ zword object_name (zword object)
  *
  */
 zword get_parent (zword object) {
-  zword obj_addr;
-  obj_addr = object_address (object);
-  if (h_version <= V3) {
-    zbyte parent;
-    obj_addr += O1_PARENT;
-    LOW_BYTE(obj_addr, parent);
-    return parent;
-  } else {
-    zword parent;
-    obj_addr += O4_PARENT;
-    LOW_WORD (obj_addr, parent);
-    return parent;
-  }
+  zword obj_addr = object_address(object);
+  return (h_version <= V3) ? PARENT_V3(obj_addr) : PARENT_V4(obj_addr);
 }/* get_parent */
 
 
@@ -132,17 +204,7 @@ zword get_parent (zword object) {
  */
 zword get_sibling (zword object) {
   zword obj_addr = object_address(object);
-  if (h_version <= V3) {
-    zbyte sibling;
-    obj_addr += O1_SIBLING;
-    LOW_BYTE(obj_addr, sibling);
-    return sibling;
-  } else {
-    zword sibling;
-    obj_addr += O4_SIBLING;
-    LOW_WORD(obj_addr, sibling);
-    return sibling;
-  }
+  return (h_version <= V3) ? SIBLING_V3(obj_addr) : SIBLING_V4(obj_addr);
 }/* get_older_sibling */
 
 /*
@@ -153,17 +215,7 @@ zword get_sibling (zword object) {
  */
 zword get_child (zword object) {
   zword obj_addr = object_address(object);
-  if (h_version <= V3) {
-    zbyte child;
-    obj_addr += O1_CHILD;
-    LOW_BYTE(obj_addr, child);
-    return child;
-  } else {
-    zword child;
-    obj_addr += O4_CHILD;
-    LOW_WORD(obj_addr, child);
-    return child;
-  }
+  return (h_version <= V3) ? CHILD_V3(obj_addr) : CHILD_V4(obj_addr);
 }/* get_younger_sibling */
 
 
@@ -232,6 +284,71 @@ zword next_property (zword prop_addr)
 }/* next_property */
 
 
+/*
+ * find_property
+ *
+ * Return the address of the header of property prop in the property
+ * list of obj. If there is no such property, return the address of the
+ * header where the list (sorted by decreasing property number) goes
+ * past it. Results come from the property index when the object still
+ * has the same property table and the header still matches.
+ *
+ */
+static zword find_property (zword obj, zword prop)
+{
+    struct prop_entry *entry;
+    zword table;
+    zword prop_addr;
+    zbyte value;
+    zbyte mask;
+    unsigned key;
+
+    mask = (h_version <= V3) ? 0x1f : 0x3f;
+
+    table = object_name (obj);
+    key = (unsigned) obj << 6 | prop;
+    entry = NULL;
+
+    if (prop <= mask && zctx->object_index) {
+
+	if (prop_index == NULL)
+	    prop_index = calloc (PROP_INDEX_SIZE, sizeof (struct prop_entry));
+
+	if (prop_index != NULL) {
+
+	    entry = &prop_index[(key * 2654435761u) >> 20 & (PROP_INDEX_SIZE - 1)];
+
+	    if (entry->key == key && entry->table == table) {
+		LOW_BYTE (entry->addr, value)
+		if ((value & mask) <= prop)
+		    return entry->addr;
+	    }
+	}
+    }
+
+    /* Scan down the property list */
+
+    LOW_BYTE (table, value)
+    prop_addr = table + 1 + 2 * value;
+
+    for (;;) {
+	LOW_BYTE (prop_addr, value)
+	if ((value & mask) <= prop)
+	    break;
+	prop_addr = next_property (prop_addr);
+    }
+
+    if (entry != NULL) {
+	entry->key = key;
+	entry->table = table;
+	entry->addr = prop_addr;
+    }
+
+    return prop_addr;
+
+}/* find_property */
+
+
 /*
  * unlink_object
  *
@@ -516,33 +633,12 @@ void z_jin (void)
 
     obj_addr = object_address (zargs[0]);
 
-    if (h_version <= V3) {
-
-	zbyte parent;
-
-	/* Get parent id from object */
-
-	obj_addr += O1_PARENT;
-	LOW_BYTE (obj_addr, parent)
-
-	/* Branch if the parent is obj2 */
+    /* Branch if the parent is obj2 */
 
-	branch (parent == zargs[1]);
-
-    } else {
-
-	zword parent;
-
-	/* Get parent id from object */
-
-	obj_addr += O4_PARENT;
-	LOW_WORD (obj_addr, parent)
-
-	/* Branch if the parent is obj2 */
-
-	branch (parent == zargs[1]);
-
-    }
+    if (h_version <= V3)
+	branch (PARENT_V3 (obj_addr) == zargs[1]);
+    else
+	branch (PARENT_V4 (obj_addr) == zargs[1]);
 
 }/* z_jin */
 
@@ -556,6 +652,7 @@ void z_jin (void)
 void z_get_child (void)
 {
     zword obj_addr;
+    zword child;
 
     /* If we are monitoring object locating display a short note */
 
@@ -575,35 +672,17 @@ void z_get_child (void)
 
     obj_addr = object_address (zargs[0]);
 
-    if (h_version <= V3) {
-
-	zbyte child;
-
-	/* Get child id from object */
-
-	obj_addr += O1_CHILD;
-	LOW_BYTE (obj_addr, child)
-
-	/* Store child id and branch */
-
-	store (child);
-	branch (child);
-
-    } else {
-
-	zword child;
-
-	/* Get child id from object */
+    /* Get child id from object */
 
-	obj_addr += O4_CHILD;
-	LOW_WORD (obj_addr, child)
-
-	/* Store child id and branch */
+    if (h_version <= V3)
+	child = CHILD_V3 (obj_addr);
+    else
+	child = CHILD_V4 (obj_addr);
 
-	store (child);
-	branch (child);
+    /* Store child id and branch */
 
-    }
+    store (child);
+    branch (child);
 
 }/* z_get_child */
 
@@ -631,18 +710,19 @@ void z_get_next_prop (void)
 
     mask = (h_version <= V3) ? 0x1f : 0x3f;
 
-    /* Load address of first property */
+    if (zargs[1] == 0)
 
-    prop_addr = first_property (zargs[0]);
+	/* Load address of first property */
 
-    if (zargs[1] != 0) {
+	prop_addr = first_property (zargs[0]);
 
-	/* Scan down the property list */
+    else {
 
-	do {
-	    LOW_BYTE (prop_addr, value)
-	    prop_addr = next_property (prop_addr);
-	} while ((value & mask) > zargs[1]);
+	/* Find the property and skip it */
+
+	prop_addr = find_property (zargs[0], zargs[1]);
+	LOW_BYTE (prop_addr, value)
+	prop_addr = next_property (prop_addr);
 
 	/* Exit if the property does not exist */
 
@@ -686,33 +766,12 @@ void z_get_parent (void)
 
     obj_addr = object_address (zargs[0]);
 
-    if (h_version <= V3) {
-
-	zbyte parent;
+    /* Get parent id from object and store it */
 
-	/* Get parent id from object */
-
-	obj_addr += O1_PARENT;
-	LOW_BYTE (obj_addr, parent)
-
-	/* Store parent */
-
-	store (parent);
-
-    } else {
-
-	zword parent;
-
-	/* Get parent id from object */
-
-	obj_addr += O4_PARENT;
-	LOW_WORD (obj_addr, parent)
-
-	/* Store parent */
-
-	store (parent);
-
-    }
+    if (h_version <= V3)
+	store (PARENT_V3 (obj_addr));
+    else
+	store (PARENT_V4 (obj_addr));
 
 }/* z_get_parent */
 
@@ -742,18 +801,10 @@ void z_get_prop (void)
 
     mask = (h_version <= V3) ? 0x1f : 0x3f;
 
-    /* Load address of first property */
+    /* Find the property in the property list */
 
-    prop_addr = first_property (zargs[0]);
-
-    /* Scan down the property list */
-
-    for (;;) {
-	LOW_BYTE (prop_addr, value)
-	if ((value & mask) <= zargs[1])
-	    break;
-	prop_addr = next_property (prop_addr);
-    }
+    prop_addr = find_property (zargs[0], zargs[1]);
+    LOW_BYTE (prop_addr, value)
 
     if ((value & mask) == zargs[1]) {	/* property found */
 
@@ -811,18 +862,10 @@ void z_get_prop_addr (void)
 
     mask = (h_version <= V3) ? 0x1f : 0x3f;
 
-    /* Load address of first property */
-
-    prop_addr = first_property (zargs[0]);
-
-    /* Scan down the property list */
+    /* Find the property in the property list */
 
-    for (;;) {
-	LOW_BYTE (prop_addr, value)
-	if ((value & mask) <= zargs[1])
-	    break;
-	prop_addr = next_property (prop_addr);
-    }
+    prop_addr = find_property (zargs[0], zargs[1]);
+    LOW_BYTE (prop_addr, value)
 
     /* Calculate the property address or return zero */
 
@@ -883,6 +926,7 @@ void z_get_prop_len (void)
 void z_get_sibling (void)
 {
     zword obj_addr;
+    zword sibling;
 
     if (zargs[0] == 0) {
 	runtime_error (ERR_GET_SIBLING_0);
@@ -893,35 +937,17 @@ void z_get_sibling (void)
 
     obj_addr = object_address (zargs[0]);
 
-    if (h_version <= V3) {
-
-	zbyte sibling;
-
-	/* Get sibling id from object */
-
-	obj_addr += O1_SIBLING;
-	LOW_BYTE (obj_addr, sibling)
-
-	/* Store sibling and branch */
-
-	store (sibling);
-	branch (sibling);
-
-    } else {
-
-	zword sibling;
-
-	/* Get sibling id from object */
-
-	obj_addr += O4_SIBLING;
-	LOW_WORD (obj_addr, sibling)
+    /* Get sibling from object */
 
-	/* Store sibling and branch */
+    if (h_version <= V3)
+	sibling = SIBLING_V3 (obj_addr);
+    else
+	sibling = SIBLING_V4 (obj_addr);
 
-	store (sibling);
-	branch (sibling);
+    /* Store sibling and branch */
 
-    }
+    store (sibling);
+    branch (sibling);
 
 }/* z_get_sibling */
 
@@ -1153,18 +1179,10 @@ void z_put_prop (void)
 
     mask = (h_version <= V3) ? 0x1f : 0x3f;
 
-    /* Load address of first property */
-
-    prop_addr = first_property (zargs[0]);
-
-    /* Scan down the property list */
+    /* Find the property in the property list */
 
-    for (;;) {
-	LOW_BYTE (prop_addr, value)
-	if ((value & mask) <= zargs[1])
-	    break;
-	prop_addr = next_property (prop_addr);
-    }
+    prop_addr = find_property (zargs[0], zargs[1]);
+    LOW_BYTE (prop_addr, value)
 
     /* Exit if the property does not exist */
 
@@ -18,20 +18,205 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#include <stdlib.h>
+#include <string.h>
 #include "frotz.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define read_tsc() __rdtsc ()
+#else
+#define read_tsc() 0
+#endif
+
 #ifdef DJGPP
 #include "djfrotz.h"
 #endif
 
 
-zword zargs[8];
-int zargc;
+#define finished (zctx->finished)
+#define insn_cache (zctx->insn_cache)
+
+/*
+ * Instructions in static memory never change, so each one is decoded
+ * once into a decoded_insn holding its handler, its operands and where
+ * its result and branch go. The cache is indexed by the address of the
+ * opcode byte, in blocks allocated as code is reached, and is shared by
+ * a machine and its clones: entries are only written once, by the first
+ * thread to claim them, and are read-only when marked ready.
+ *
+ */
+
+#define INSN_BLOCK_SHIFT 8
+#define INSN_BLOCK_SIZE (1 << INSN_BLOCK_SHIFT)
+
+#define INSN_EMPTY 0		/* States of a decoded_insn */
+#define INSN_DECODING 1
+#define INSN_READY 2
 
-static int finished = 0;
+/*
+ * Instructions that run_until_input executes inline, without going
+ * through their handler. All others are run by the handler. Those from
+ * RUN_JE to RUN_DEC_CHK are followed by branch data, those from RUN_LOAD
+ * to RUN_OR by a store byte.
+ *
+ * The kinds from RUN_LOADW_JE on are pairs fused by fuse_insn, which run
+ * as one: a loadw whose result je compares to a constant, a get_prop
+ * whose result jz tests, and a jump to the inc_chk heading a loop. The
+ * branch of the pair is the one of its second instruction.
+ *
+ */
+
+#define RUN_HANDLER 0
+#define RUN_READ 1		/* read or read_char: stop before them */
+#define RUN_JE 2
+#define RUN_JL 3
+#define RUN_JG 4
+#define RUN_JZ 5
+#define RUN_TEST 6
+#define RUN_TEST_ATTR 7
+#define RUN_INC_CHK 8
+#define RUN_DEC_CHK 9
+#define RUN_JUMP 10
+#define RUN_STORE 11
+#define RUN_INC 12
+#define RUN_DEC 13
+#define RUN_PUSH 14
+#define RUN_LOAD 15
+#define RUN_LOADW 16
+#define RUN_LOADB 17
+#define RUN_ADD 18
+#define RUN_SUB 19
+#define RUN_MUL 20
+#define RUN_AND 21
+#define RUN_OR 22
+#define RUN_LOADW_JE 23
+#define RUN_GET_PROP_JZ 24
+#define RUN_JUMP_INC_CHK 25
+
+static const zbyte run_2op[0x20] = {
+    0,
+    RUN_JE,
+    RUN_JL,
+    RUN_JG,
+    RUN_DEC_CHK,
+    RUN_INC_CHK,
+    0,
+    RUN_TEST,
+    RUN_OR,
+    RUN_AND,
+    RUN_TEST_ATTR,
+    0, 0,
+    RUN_STORE,
+    0,
+    RUN_LOADW,
+    RUN_LOADB,
+    0, 0, 0,
+    RUN_ADD,
+    RUN_SUB,
+    RUN_MUL,
+    0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+static const zbyte run_1op[0x10] = {
+    RUN_JZ,
+    0, 0, 0, 0,
+    RUN_INC,
+    RUN_DEC,
+    0, 0, 0, 0, 0,
+    RUN_JUMP,
+    0,
+    RUN_LOAD,
+    0
+};
+
+struct decoded_insn {
+    void (*handler) (void);
+    zword args[8];		/* Constants, or variable numbers */
+    zbyte vars;			/* Bit n set if operand n is a variable */
+    zbyte argc;
+    zbyte length;		/* Bytes between the opcode and the store */
+				/* or branch data, if any */
+    zbyte state;		/* INSN_EMPTY, INSN_DECODING or INSN_READY */
+    zbyte run;			/* How run_until_input runs it, see RUN_JE */
+    zbyte store_var;		/* Variable the result goes to, if inline, */
+				/* or that a fused pair passes on */
+    zbyte branch_on;		/* Whether to branch on true or on false */
+    zword op_id;		/* Index in the profile, see profile_insn */
+    zword fused_op_id;		/* Same for the second of a fused pair */
+    zword fused_arg;		/* Constant operand of the second */
+    short fused_offset;		/* Address of the second, from this one */
+    long next_pc;		/* Next instruction, if run inline */
+    long branch_pc;		/* Branch target, or 0 or 1 to return */
+};
+
+struct insn_blocks {
+    int refs;			/* Machines sharing the cache */
+    bool fuse;			/* Fuse pairs of instructions */
+    long num_blocks;
+    struct decoded_insn *blocks[];
+};
+
+extern zword object_address (zword);
 
 static void __extended__ (void);
 static void __illegal__ (void);
+static void __pop_catch__ (void);
+static void __not_call_n__ (void);
+static void alloc_insn_cache (void);
+
+/*
+ * Profiler, enabled per machine by set_profiling. It counts executions
+ * (and optionally TSC cycles) per opcode, indexed by opcode byte and by
+ * 0x100 + opcode for extended opcodes, and calls and instructions run
+ * per routine, including the routines it calls.
+ *
+ */
+
+#define PROFILE_OPS 0x120
+#define PROFILE_FRAMES (STACK_SIZE / 4 + 2)
+#define PROFILE_NONE -1
+
+struct profile_routine {
+    long addr;			/* Byte address, 0 for an empty slot */
+    unsigned long long calls;
+    unsigned long long instructions;
+};
+
+struct profile {
+    bool cycles;
+    unsigned long long instructions;
+    unsigned long long op_counts[PROFILE_OPS];
+    unsigned long long op_cycles[PROFILE_OPS];
+    int last_op;
+    unsigned long long last_tsc;
+    struct {
+	long addr;		/* Routine of the frame, or 0 if unknown */
+	unsigned long long start;
+    } frames[PROFILE_FRAMES];
+    struct profile_routine *routines;
+    long routines_mask;
+    long num_routines;
+};
+
+#define prof (zctx->profile)
+
+/*
+ * Every instruction is counted with COUNT_INSN before it runs: in the
+ * profile, and against the budget of max_instructions per step (see
+ * zstep). Past the budget the machine halts and is flagged as timed out.
+ *
+ */
+
+#define COUNT_INSN(op) {						\
+    if (prof != NULL)							\
+	profile_insn (op);						\
+    if (zctx->max_instructions > 0					\
+	&& ++zctx->insn_count > zctx->max_instructions) {		\
+	zctx->timed_out = TRUE;						\
+	emulator_halted = 1;						\
+    }									\
+}
 
 void (*op0_opcodes[0x10]) (void) = {
     z_rtrue,
@@ -43,7 +228,7 @@ void (*op0_opcodes[0x10]) (void) = {
     z_restore,
     z_restart,
     z_ret_popped,
-    z_catch,
+    __pop_catch__,
     z_quit,
     z_new_line,
     z_show_status,
@@ -68,7 +253,7 @@ void (*op1_opcodes[0x10]) (void) = {
     z_jump,
     z_print_paddr,
     z_load,
-    z_call_n
+    __not_call_n__
 };
 
 void (*var_opcodes[0x40]) (void) = {
@@ -286,9 +471,297 @@ void (*ext_opcodes[0x1d]) (void) = {
 void init_process (void)
 {
     finished = 0;
+
+    reset_process ();
+    alloc_insn_cache ();
+
 } /* init_process */
 
 
+/*
+ * alloc_insn_cache
+ *
+ * Allocate an empty instruction cache, if enabled. Without one, every
+ * instruction is decoded as it runs.
+ *
+ */
+static void alloc_insn_cache (void)
+{
+    long num_blocks = (story_size >> INSN_BLOCK_SHIFT) + 1;
+
+    insn_cache = NULL;
+
+    if (zctx->decode_cache) {
+	insn_cache = calloc (1, sizeof (struct insn_blocks)
+			     + num_blocks * sizeof (struct decoded_insn *));
+	if (insn_cache != NULL) {
+	    insn_cache->refs = 1;
+	    insn_cache->fuse = zctx->insn_fusion;
+	    insn_cache->num_blocks = num_blocks;
+	}
+    }
+
+} /* alloc_insn_cache */
+
+
+/*
+ * clone_process
+ *
+ * Called on a bitwise copy of another machine: share its decoded
+ * instructions, as the clone runs the same story.
+ *
+ */
+void clone_process (void)
+{
+
+    if (insn_cache != NULL)
+	__sync_add_and_fetch (&insn_cache->refs, 1);
+
+} /* clone_process */
+
+
+/*
+ * reset_process
+ *
+ * Let go of the decoded instructions, freeing them with the last
+ * machine that shares them.
+ *
+ */
+void reset_process (void)
+{
+    long i;
+
+    if (insn_cache != NULL && __sync_sub_and_fetch (&insn_cache->refs, 1) == 0) {
+	for (i = 0; i < insn_cache->num_blocks; i++)
+	    free (insn_cache->blocks[i]);
+	free (insn_cache);
+    }
+    insn_cache = NULL;
+
+} /* reset_process */
+
+
+/*
+ * profile_insn
+ *
+ * Count an instruction about to run. With cycles enabled, the cycles
+ * since the previous instruction are charged to that one.
+ *
+ */
+static void profile_insn (int op)
+{
+    unsigned long long now;
+
+    prof->instructions++;
+    prof->op_counts[op]++;
+
+    if (prof->cycles) {
+	now = read_tsc ();
+	if (prof->last_op != PROFILE_NONE)
+	    prof->op_cycles[prof->last_op] += now - prof->last_tsc;
+	prof->last_op = op;
+	prof->last_tsc = now;
+    }
+
+}/* profile_insn */
+
+
+/*
+ * profile_routine
+ *
+ * Return the profile entry of the routine at addr, adding it if new.
+ *
+ */
+static struct profile_routine *profile_routine (long addr)
+{
+    struct profile_routine *table;
+    long mask;
+    long i, j;
+
+    if (prof->num_routines * 2 > prof->routines_mask) {
+
+	mask = prof->routines_mask * 2 + 1;
+	if ((table = calloc (mask + 1, sizeof (struct profile_routine))) == NULL)
+	    return NULL;
+
+	for (i = 0; i <= prof->routines_mask; i++)
+	    if (prof->routines[i].addr != 0) {
+		for (j = prof->routines[i].addr & mask; table[j].addr != 0; j = (j + 1) & mask);
+		table[j] = prof->routines[i];
+	    }
+
+	free (prof->routines);
+	prof->routines = table;
+	prof->routines_mask = mask;
+    }
+
+    for (j = addr & prof->routines_mask;
+	 prof->routines[j].addr != 0;
+	 j = (j + 1) & prof->routines_mask)
+	if (prof->routines[j].addr == addr)
+	    return &prof->routines[j];
+
+    prof->routines[j].addr = addr;
+    prof->num_routines++;
+    return &prof->routines[j];
+
+}/* profile_routine */
+
+
+/*
+ * profile_call
+ *
+ * Note the entry into the routine at addr, the new frame being pushed.
+ *
+ */
+static void profile_call (long addr)
+{
+    struct profile_routine *routine = profile_routine (addr);
+
+    if (routine != NULL)
+	routine->calls++;
+
+    if (frame_count < PROFILE_FRAMES) {
+	prof->frames[frame_count].addr = addr;
+	prof->frames[frame_count].start = prof->instructions;
+    }
+
+}/* profile_call */
+
+
+/*
+ * profile_ret
+ *
+ * Charge the instructions run in the current frame, about to be
+ * popped, to its routine.
+ *
+ */
+static void profile_ret (void)
+{
+    struct profile_routine *routine;
+
+    if (frame_count <= 0 || frame_count >= PROFILE_FRAMES
+	|| prof->frames[frame_count].addr == 0)
+	return;
+
+    routine = profile_routine (prof->frames[frame_count].addr);
+    if (routine != NULL)
+	routine->instructions += prof->instructions - prof->frames[frame_count].start;
+    prof->frames[frame_count].addr = 0;
+
+}/* profile_ret */
+
+
+/*
+ * set_profiling
+ *
+ * Turn the profiler off (mode 0), on (1) or on with cycle counts (2).
+ * The profile is cleared in any case.
+ *
+ */
+void set_profiling (zmachine_ctx *ctx, int mode)
+{
+    zctx = ctx;
+
+    if (prof != NULL) {
+	free (prof->routines);
+	free (prof);
+	prof = NULL;
+    }
+
+    if (mode == 0)
+	return;
+
+    if ((prof = calloc (1, sizeof (struct profile))) == NULL)
+	return;
+    prof->routines_mask = 255;
+    if ((prof->routines = calloc (256, sizeof (struct profile_routine))) == NULL) {
+	free (prof);
+	prof = NULL;
+	return;
+    }
+    prof->cycles = (mode == 2);
+    prof->last_op = PROFILE_NONE;
+
+}/* set_profiling */
+
+
+/*
+ * get_profile_opcodes
+ *
+ * Copy the execution and cycle counts of each opcode, PROFILE_OPS
+ * entries each. Returns the number of instructions counted, or -1 if
+ * the profiler is off.
+ *
+ */
+long long get_profile_opcodes (zmachine_ctx *ctx, unsigned long long *counts, unsigned long long *cycles)
+{
+    zctx = ctx;
+
+    if (prof == NULL)
+	return -1;
+
+    memcpy (counts, prof->op_counts, sizeof (prof->op_counts));
+    memcpy (cycles, prof->op_cycles, sizeof (prof->op_cycles));
+    return prof->instructions;
+
+}/* get_profile_opcodes */
+
+
+static int compare_routines (const void *a, const void *b)
+{
+    const struct profile_routine *ra = a;
+    const struct profile_routine *rb = b;
+
+    if (ra->instructions != rb->instructions)
+	return (ra->instructions < rb->instructions) ? 1 : -1;
+    return (ra->addr > rb->addr) - (ra->addr < rb->addr);
+
+}/* compare_routines */
+
+
+/*
+ * get_profile_routines
+ *
+ * Copy the max routines with the most instructions run (including the
+ * routines they call) in decreasing order. Returns how many were copied,
+ * or -1 if the profiler is off.
+ *
+ */
+int get_profile_routines (zmachine_ctx *ctx, long *addrs, unsigned long long *calls,
+			  unsigned long long *instructions, int max)
+{
+    struct profile_routine *sorted;
+    long i, n;
+
+    zctx = ctx;
+
+    if (prof == NULL)
+	return -1;
+
+    if ((sorted = malloc ((prof->num_routines + 1) * sizeof (struct profile_routine))) == NULL)
+	return -1;
+
+    for (i = 0, n = 0; i <= prof->routines_mask; i++)
+	if (prof->routines[i].addr != 0)
+	    sorted[n++] = prof->routines[i];
+
+    qsort (sorted, n, sizeof (struct profile_routine), compare_routines);
+
+    if (n > max)
+	n = max;
+    for (i = 0; i < n; i++) {
+	addrs[i] = sorted[i].addr;
+	calls[i] = sorted[i].calls;
+	instructions[i] = sorted[i].instructions;
+    }
+
+    free (sorted);
+    return n;
+
+}/* get_profile_routines */
+
+
 /*
  * load_operand
  *
@@ -373,6 +846,9 @@ void interpret (void)
 
 	CODE_BYTE (opcode)
 
+	if (opcode != 0xbe)
+	    COUNT_INSN (opcode)
+
 	zargc = 0;
 
 	if (opcode < 0x80) {			/* 2OP opcodes */
@@ -416,13 +892,348 @@ void interpret (void)
 	end_of_sound ();
 #endif
 
-    } while (finished == 0);
+    } while (finished == 0 && !zctx->timed_out);
 
-    finished--;
+    if (finished > 0)
+	finished--;
 
 }/* interpret */
 
 
+/*
+ * decode_operand
+ *
+ * Decode an operand of an instruction being cached.
+ *
+ */
+static void decode_operand (zbyte **p, zbyte type, struct decoded_insn *insn)
+{
+    zbyte *q = *p;
+
+    if (type & 2) {			/* variable */
+	insn->vars |= 1 << insn->argc;
+	insn->args[insn->argc++] = *q++;
+    } else if (type & 1) {		/* small constant */
+	insn->args[insn->argc++] = *q++;
+    } else {				/* large constant */
+	insn->args[insn->argc++] = ((zword) q[0] << 8) | q[1];
+	q += 2;
+    }
+    *p = q;
+
+}/* decode_operand */
+
+
+/*
+ * decode_all_operands
+ *
+ * Same as load_all_operands for an instruction being cached.
+ *
+ */
+static void decode_all_operands (zbyte **p, zbyte specifier, struct decoded_insn *insn)
+{
+    int i;
+
+    for (i = 6; i >= 0; i -= 2) {
+
+	zbyte type = (specifier >> i) & 0x03;
+
+	if (type == 3)
+	    break;
+
+	decode_operand (p, type, insn);
+
+    }
+
+}/* decode_all_operands */
+
+
+/*
+ * decode_insn
+ *
+ * Decode the instruction at pc, whose opcode byte has been read already.
+ * The version dependent opcodes are resolved for good, as the version
+ * does not change during the life of the story.
+ *
+ */
+static void decode_insn (long pc, zbyte opcode, struct decoded_insn *insn)
+{
+    zbyte *p = zmp + pc + 1;
+
+    insn->vars = 0;
+    insn->argc = 0;
+
+    if (opcode < 0x80) {			/* 2OP opcodes */
+
+	decode_operand (&p, (zbyte) (opcode & 0x40) ? 2 : 1, insn);
+	decode_operand (&p, (zbyte) (opcode & 0x20) ? 2 : 1, insn);
+	insn->handler = var_opcodes[opcode & 0x1f];
+
+    } else if (opcode < 0xb0) {		/* 1OP opcodes */
+
+	decode_operand (&p, (zbyte) (opcode >> 4), insn);
+	if ((opcode & 0x0f) == 0x0f)
+	    insn->handler = (h_version <= V4) ? z_not : z_call_n;
+	else
+	    insn->handler = op1_opcodes[opcode & 0x0f];
+
+    } else if (opcode < 0xc0) {		/* 0OP opcodes */
+
+	if (opcode == 0xbe) {			/* extended opcodes */
+	    zbyte ext = *p++;
+	    zbyte specifier = *p++;
+	    decode_all_operands (&p, specifier, insn);
+	    insn->handler = (ext < 0x1d) ? ext_opcodes[ext] : z_nop;
+	} else if (opcode == 0xb9)
+	    insn->handler = (h_version <= V4) ? z_pop : z_catch;
+	else
+	    insn->handler = op0_opcodes[opcode - 0xb0];
+
+    } else {				/* VAR opcodes */
+
+	zbyte specifier1 = *p++;
+
+	if (opcode == 0xec || opcode == 0xfa) {
+	    zbyte specifier2 = *p++;
+	    decode_all_operands (&p, specifier1, insn);
+	    decode_all_operands (&p, specifier2, insn);
+	} else
+	    decode_all_operands (&p, specifier1, insn);
+	insn->handler = var_opcodes[opcode - 0xc0];
+
+    }
+
+    insn->length = p - (zmp + pc + 1);
+    insn->op_id = (opcode == 0xbe) ? 0x100 + (zmp[pc + 1] & 0x1f) : opcode;
+
+}/* decode_insn */
+
+
+/*
+ * resolve_insn
+ *
+ * Choose how run_until_input runs a decoded instruction and, when it
+ * runs inline, resolve where its result goes and where it branches to.
+ *
+ */
+static void resolve_insn (long pc, zbyte opcode, struct decoded_insn *insn)
+{
+    zbyte *p = zmp + pc + 1 + insn->length;
+    zbyte run = RUN_HANDLER;
+    zbyte specifier;
+    zword offset;
+
+    if (opcode < 0x80 || (opcode >= 0xc0 && opcode < 0xe0)) {
+	run = run_2op[opcode & 0x1f];
+	if (run != RUN_JE && insn->argc != 2)
+	    run = RUN_HANDLER;
+    } else if (opcode < 0xb0)
+	run = run_1op[opcode & 0x0f];
+    else if (opcode == 0xe8)
+	run = RUN_PUSH;
+    else if (opcode == 0xe4 || opcode == 0xf6)
+	run = RUN_READ;
+
+    if (run == RUN_JE && insn->argc < 2)
+	run = RUN_HANDLER;
+
+    if (run >= RUN_LOAD)
+	insn->store_var = *p++;
+
+    if (run >= RUN_JE && run <= RUN_DEC_CHK) {
+
+	specifier = *p++;
+	insn->branch_on = specifier >> 7;
+	offset = specifier & 0x3f;
+
+	if (!(specifier & 0x40)) {	/* long branch */
+	    if (offset & 0x20)
+		offset |= 0xffc0;
+	    offset = (offset << 8) | *p++;
+	}
+
+	if (offset > 1) {
+	    insn->branch_pc = (p - zmp) + (short) offset - 2;
+	    if (insn->branch_pc <= 1)
+		run = RUN_HANDLER;
+	} else insn->branch_pc = offset;
+
+    }
+
+    if (run == RUN_JUMP) {
+	insn->branch_pc = (p - zmp) + (short) insn->args[0] - 2;
+	if (insn->vars != 0 || insn->branch_pc < 0 || insn->branch_pc >= story_size)
+	    run = RUN_HANDLER;
+    }
+
+    insn->next_pc = p - zmp;
+    insn->run = run;
+
+}/* resolve_insn */
+
+
+/*
+ * fuse_insn
+ *
+ * Fuse a resolved instruction with the one run after it, if the pair
+ * is one that run_until_input runs as a whole (see RUN_LOADW_JE). The
+ * second instruction keeps its own entry, for when it is reached some
+ * other way.
+ *
+ */
+static void fuse_insn (long pc, zbyte opcode, struct decoded_insn *insn)
+{
+    struct decoded_insn second;
+    long second_pc;
+    zbyte run;
+
+    if (insn->run == RUN_LOADW)
+	second_pc = insn->next_pc;
+    else if (insn->run == RUN_HANDLER && insn->argc == 2
+	     && (opcode < 0x80 || (opcode >= 0xc0 && opcode < 0xe0))
+	     && (opcode & 0x1f) == 0x11)	/* get_prop, then its store */
+	second_pc = insn->next_pc + 1;
+    else if (insn->run == RUN_JUMP)
+	second_pc = insn->branch_pc;
+    else
+	return;
+
+    if (second_pc < h_dynamic_size || second_pc >= story_size
+	|| (short) (second_pc - pc) != second_pc - pc)
+	return;
+
+    decode_insn (second_pc, zmp[second_pc], &second);
+    resolve_insn (second_pc, zmp[second_pc], &second);
+
+    /* The second instruction must take the result of the first */
+
+    if (insn->run == RUN_LOADW && second.run == RUN_JE && second.argc == 2
+	&& second.vars == 1 && second.args[0] == insn->store_var)
+	run = RUN_LOADW_JE;
+    else if (insn->run == RUN_HANDLER && second.run == RUN_JZ
+	     && second.vars == 1 && second.args[0] == zmp[second_pc - 1])
+	run = RUN_GET_PROP_JZ;
+    else if (insn->run == RUN_JUMP && second.run == RUN_INC_CHK
+	     && second.vars == 0 && second.args[0] < 0x100)
+	run = RUN_JUMP_INC_CHK;
+    else
+	return;
+
+    insn->store_var = second.args[0];
+    insn->fused_op_id = second.op_id;
+    insn->fused_arg = (second.argc > 1) ? second.args[1] : 0;
+    insn->fused_offset = second_pc - pc;
+    insn->branch_on = second.branch_on;
+    insn->branch_pc = second.branch_pc;
+    insn->next_pc = second.next_pc;
+    insn->run = run;
+
+}/* fuse_insn */
+
+
+/*
+ * cached_insn
+ *
+ * Return the decoded instruction the PC points behind, decoding it if
+ * needed, or NULL if it cannot be cached or another thread is still
+ * decoding it.
+ *
+ */
+static struct decoded_insn *cached_insn (zbyte opcode)
+{
+    long pc = pcp - zmp - 1;
+    struct decoded_insn **slot;
+    struct decoded_insn *block;
+    struct decoded_insn *insn;
+
+    /* Code in dynamic memory may change */
+
+    if (pc < h_dynamic_size || pc >= story_size || zmp[pc] != opcode)
+	return NULL;
+
+    slot = &insn_cache->blocks[pc >> INSN_BLOCK_SHIFT];
+    if ((block = __atomic_load_n (slot, __ATOMIC_ACQUIRE)) == NULL) {
+	block = calloc (INSN_BLOCK_SIZE, sizeof (struct decoded_insn));
+	if (block == NULL)
+	    return NULL;
+	if (!__sync_bool_compare_and_swap (slot, NULL, block)) {
+	    free (block);
+	    block = __atomic_load_n (slot, __ATOMIC_ACQUIRE);
+	}
+    }
+
+    insn = &block[pc & (INSN_BLOCK_SIZE - 1)];
+    if (__atomic_load_n (&insn->state, __ATOMIC_ACQUIRE) == INSN_READY)
+	return insn;
+
+    if (!__sync_bool_compare_and_swap (&insn->state, INSN_EMPTY, INSN_DECODING))
+	return NULL;
+
+    decode_insn (pc, opcode, insn);
+    resolve_insn (pc, opcode, insn);
+    if (insn_cache->fuse)
+	fuse_insn (pc, opcode, insn);
+    __atomic_store_n (&insn->state, INSN_READY, __ATOMIC_RELEASE);
+
+    return insn;
+
+}/* cached_insn */
+
+
+/*
+ * load_decoded
+ *
+ * Load the operands of a decoded instruction into zargs.
+ *
+ */
+static inline void load_decoded (const struct decoded_insn *insn)
+{
+    int i;
+
+    zargc = insn->argc;
+
+    if (insn->vars == 0)
+	memcpy (zargs, insn->args, insn->argc * sizeof (zword));
+    else for (i = 0; i < insn->argc; i++) {
+
+	zword value = insn->args[i];
+
+	if (insn->vars & (1 << i)) {
+	    if (value == 0)
+		value = *sp++;
+	    else if (value < 16)
+		value = *(fp - value);
+	    else {
+		zword addr = h_globals + 2 * (value - 16);
+		LOW_WORD (addr, value)
+	    }
+	}
+	zargs[i] = value;
+
+    }
+
+}/* load_decoded */
+
+
+/*
+ * run_decoded
+ *
+ * Load the operands of a decoded instruction and execute it.
+ *
+ */
+static void run_decoded (const struct decoded_insn *insn)
+{
+
+    COUNT_INSN (insn->op_id)
+
+    load_decoded (insn);
+
+    pcp += insn->length;
+    insn->handler ();
+
+}/* run_decoded */
+
+
 zbyte get_next_opcode(void)
 {
 	zbyte opcode;
@@ -434,6 +1245,16 @@ zbyte get_next_opcode(void)
 void run_opcode (zbyte opcode)
 {
   // printf("Opcode: %d\n", opcode);
+	struct decoded_insn *insn;
+
+	if (insn_cache != NULL && (insn = cached_insn (opcode)) != NULL) {
+	    run_decoded (insn);
+	    return;
+	}
+
+	if (opcode != 0xbe)
+	    COUNT_INSN (opcode)
+
 	zargc = 0;
 
 	if (opcode < 0x80) {			/* 2OP opcodes */
@@ -482,6 +1303,276 @@ void run_opcode (zbyte opcode)
 #endif
 }
 
+/*
+ * Helpers of run_until_input for the instructions it runs inline, which
+ * have their operands in zargs. They set pc to the next instruction and
+ * go on to fetch it.
+ *
+ */
+
+#define RUN_BRANCH(flag) {						\
+    if ((flag) == insn->branch_on) {					\
+	if (insn->branch_pc > 1)					\
+	    pc = insn->branch_pc;					\
+	else {								\
+	    pcp = zmp + insn->next_pc;					\
+	    ret ((zword) insn->branch_pc);				\
+	    pc = pcp - zmp;						\
+	}								\
+    } else								\
+	pc = insn->next_pc;						\
+    goto fetch;								\
+}
+
+#define RUN_PUT_RESULT {							\
+    if (insn->store_var == 0)						\
+	*--sp = value;							\
+    else if (insn->store_var < 16)					\
+	*(fp - insn->store_var) = value;				\
+    else {								\
+	addr = h_globals + 2 * (insn->store_var - 16);			\
+	SET_WORD (addr, value)						\
+    }									\
+}
+
+#define RUN_STORE_RESULT(v) {						\
+    value = (v);							\
+    RUN_PUT_RESULT							\
+    pc = insn->next_pc;							\
+    goto fetch;								\
+}
+
+#define RUN_SET_VAR(v) {						\
+    if (zargs[0] == 0)							\
+	*sp = (v);							\
+    else if (zargs[0] < 16)						\
+	*(fp - zargs[0]) = (v);						\
+    else {								\
+	addr = h_globals + 2 * (zargs[0] - 16);				\
+	SET_WORD (addr, (v))						\
+    }									\
+}
+
+#define RUN_GET_VAR(v) {						\
+    if (zargs[0] == 0)							\
+	v = *sp;							\
+    else if (zargs[0] < 16)						\
+	v = *(fp - zargs[0]);						\
+    else {								\
+	addr = h_globals + 2 * (zargs[0] - 16);				\
+	LOW_WORD (addr, v)						\
+    }									\
+}
+
+/*
+ * Between the two instructions of a fused pair: count the second one,
+ * or stop before it if the first one used up the instructions allowed.
+ *
+ */
+
+#define RUN_FUSED_NEXT {						\
+    if (emulator_halted > 0) {						\
+	pc += insn->fused_offset;					\
+	goto fetch;							\
+    }									\
+    COUNT_INSN (insn->fused_op_id)					\
+}
+
+/*
+ * run_until_input
+ *
+ * Run instructions until the next one reads input (read or read_char)
+ * or the game halts. As when stepping with run_opcode, the opcode of
+ * the next instruction is left fetched in next_opcode, so states saved
+ * between steps are unchanged.
+ *
+ * Cached instructions are run threaded: each one jumps through the
+ * run_label table straight to the code for the next one, and the most
+ * frequent ones run inline with their store and branch resolved at
+ * decode time, some of them fused in pairs. Anything else goes back to
+ * run_opcode.
+ *
+ */
+void run_until_input (void)
+{
+    static void *const run_label[] = {
+	&&run_handler, &&run_handler, &&run_je, &&run_jl, &&run_jg,
+	&&run_jz, &&run_test, &&run_test_attr, &&run_inc_chk,
+	&&run_dec_chk, &&run_jump, &&run_store, &&run_inc, &&run_dec,
+	&&run_push, &&run_load, &&run_loadw, &&run_loadb, &&run_add,
+	&&run_sub, &&run_mul, &&run_and, &&run_or, &&run_loadw_je,
+	&&run_get_prop_jz, &&run_jump_inc_chk
+    };
+    const struct decoded_insn *insn;
+    struct decoded_insn *block;
+    zbyte opcode = zctx->next_opcode;
+    zword value;
+    zword addr;
+    long pc;
+
+    while (opcode != 0xe4 && opcode != 0xf6 && emulator_halted <= 0) {
+
+	if (insn_cache == NULL || (insn = cached_insn (opcode)) == NULL) {
+	    run_opcode (opcode);
+	    CODE_BYTE (opcode)
+	    continue;
+	}
+
+	pc = pcp - zmp - 1;
+
+    next:
+
+	COUNT_INSN (insn->op_id)
+
+	load_decoded (insn);
+
+	goto *run_label[insn->run];
+
+    run_handler:
+	pcp = zmp + pc + 1 + insn->length;
+	insn->handler ();
+	pc = pcp - zmp;
+	goto fetch;
+
+    run_je:
+	RUN_BRANCH (zargs[0] == zargs[1] || (
+		    zargc > 2 && (zargs[0] == zargs[2] || (
+		    zargc > 3 && zargs[0] == zargs[3]))))
+    run_jl:
+	RUN_BRANCH ((short) zargs[0] < (short) zargs[1])
+    run_jg:
+	RUN_BRANCH ((short) zargs[0] > (short) zargs[1])
+    run_jz:
+	RUN_BRANCH ((short) zargs[0] == 0)
+    run_test:
+	RUN_BRANCH ((zargs[0] & zargs[1]) == zargs[1])
+    run_test_attr:
+	if (zargs[0] == 0 || zargs[1] > ((h_version <= V3) ? 31 : 47)
+	    || f_setup.attribute_testing)
+	    goto run_handler;
+	addr = object_address (zargs[0]) + zargs[1] / 8;
+	LOW_BYTE (addr, value)
+	RUN_BRANCH ((value & (0x80 >> (zargs[1] & 7))) != 0)
+    run_inc_chk:
+	RUN_GET_VAR (value)
+	value++;
+	RUN_SET_VAR (value)
+	RUN_BRANCH ((short) value > (short) zargs[1])
+    run_dec_chk:
+	RUN_GET_VAR (value)
+	value--;
+	RUN_SET_VAR (value)
+	RUN_BRANCH ((short) value < (short) zargs[1])
+    run_jump:
+	pc = insn->branch_pc;
+	goto fetch;
+    run_store:
+	RUN_SET_VAR (zargs[1])
+	pc = insn->next_pc;
+	goto fetch;
+    run_inc:
+	RUN_GET_VAR (value)
+	value++;
+	RUN_SET_VAR (value)
+	pc = insn->next_pc;
+	goto fetch;
+    run_dec:
+	RUN_GET_VAR (value)
+	value--;
+	RUN_SET_VAR (value)
+	pc = insn->next_pc;
+	goto fetch;
+    run_push:
+	*--sp = zargs[0];
+	pc = insn->next_pc;
+	goto fetch;
+    run_load:
+	RUN_GET_VAR (value)
+	RUN_STORE_RESULT (value)
+    run_loadw:
+	addr = zargs[0] + 2 * zargs[1];
+	LOW_WORD (addr, value)
+	RUN_STORE_RESULT (value)
+    run_loadb:
+	addr = zargs[0] + zargs[1];
+	LOW_BYTE (addr, value)
+	RUN_STORE_RESULT (value)
+    run_add:
+	RUN_STORE_RESULT ((zword) ((short) zargs[0] + (short) zargs[1]))
+    run_sub:
+	RUN_STORE_RESULT ((zword) ((short) zargs[0] - (short) zargs[1]))
+    run_mul:
+	RUN_STORE_RESULT ((zword) ((short) zargs[0] * (short) zargs[1]))
+    run_and:
+	RUN_STORE_RESULT ((zword) (zargs[0] & zargs[1]))
+    run_or:
+	RUN_STORE_RESULT ((zword) (zargs[0] | zargs[1]))
+
+	/* Fused pairs go on to the code of their second instruction */
+
+    run_loadw_je:
+	addr = zargs[0] + 2 * zargs[1];
+	LOW_WORD (addr, value)
+	/* A result pushed would be popped right away by the je */
+	if (insn->store_var != 0 || emulator_halted > 0)
+	    RUN_PUT_RESULT
+	RUN_FUSED_NEXT
+	zargs[0] = value;
+	zargs[1] = insn->fused_arg;
+	goto run_je;
+    run_get_prop_jz:
+	pcp = zmp + pc + 1 + insn->length;
+	insn->handler ();
+	RUN_FUSED_NEXT
+	if (insn->store_var == 0)
+	    value = *sp++;
+	else if (insn->store_var < 16)
+	    value = *(fp - insn->store_var);
+	else {
+	    addr = h_globals + 2 * (insn->store_var - 16);
+	    LOW_WORD (addr, value)
+	}
+	zargs[0] = value;
+	zargc = 1;
+	goto run_jz;
+    run_jump_inc_chk:
+	RUN_FUSED_NEXT
+	zargs[0] = insn->store_var;
+	zargs[1] = insn->fused_arg;
+	zargc = 2;
+	goto run_inc_chk;
+
+    fetch:
+
+	/* Stay threaded while the next instruction is decoded already */
+
+	if (pc >= h_dynamic_size && pc < story_size && emulator_halted <= 0
+	    && (block = __atomic_load_n (&insn_cache->blocks[pc >> INSN_BLOCK_SHIFT],
+					 __ATOMIC_ACQUIRE)) != NULL) {
+	    insn = &block[pc & (INSN_BLOCK_SIZE - 1)];
+	    if (__atomic_load_n (&insn->state, __ATOMIC_ACQUIRE) == INSN_READY
+		&& insn->run != RUN_READ)
+		goto next;
+	}
+
+	pcp = zmp + pc;
+	CODE_BYTE (opcode)
+
+    }
+
+    zctx->next_opcode = opcode;
+
+    /* Time spent outside the interpreter is not charged to any opcode */
+
+    if (prof != NULL && prof->cycles) {
+	if (prof->last_op != PROFILE_NONE)
+	    prof->op_cycles[prof->last_op] += read_tsc () - prof->last_tsc;
+	prof->last_op = PROFILE_NONE;
+    }
+
+}/* run_until_input */
+
+
 /*
  * call
  *
@@ -525,6 +1616,9 @@ void call (zword routine, int argc, zword *args, int ct)
     if (pc >= story_size)
 	runtime_error (ERR_ILL_CALL_ADDR);
 
+    if (prof != NULL)
+	profile_call (pc);
+
     SET_PC (pc)
 
     /* Initialise local variables */
@@ -576,6 +1670,9 @@ void ret (zword value)
 
     sp = fp;
 
+    if (prof != NULL)
+	profile_ret ();
+
     ct = *sp++ >> 12;
     frame_count--;
     fp = stack + 1 + *sp++;
@@ -739,6 +1836,8 @@ static void __extended__ (void)
     CODE_BYTE (opcode)
     CODE_BYTE (specifier)
 
+    COUNT_INSN (0x100 + (opcode & 0x1f))
+
     load_all_operands (specifier);
 
     if (opcode < 0x1d)			/* extended opcodes from 0x1d on */
@@ -760,6 +1859,40 @@ static void __illegal__ (void)
 }/* __illegal__ */
 
 
+/*
+ * __pop_catch__
+ *
+ * 0OP opcode 0x09 is pop in V1 to V4 and catch in V5+. The choice is
+ * made per call rather than by patching the table, which is shared by
+ * every machine.
+ *
+ */
+static void __pop_catch__ (void)
+{
+    if (h_version <= V4)
+	z_pop ();
+    else
+	z_catch ();
+
+}/* __pop_catch__ */
+
+
+/*
+ * __not_call_n__
+ *
+ * 1OP opcode 0x0f is not in V1 to V4 and call_1n in V5+.
+ *
+ */
+static void __not_call_n__ (void)
+{
+    if (h_version <= V4)
+	z_not ();
+    else
+	z_call_n ();
+
+}/* __not_call_n__ */
+
+
 /*
  * z_catch, store the current stack frame for later use with z_throw.
  *
@@ -786,8 +1919,11 @@ void z_throw (void)
 	runtime_error (ERR_BAD_FRAME);
 
     /* Unwind the stack a frame at a time. */
-    for (; frame_count > zargs[1]; --frame_count)
+    for (; frame_count > zargs[1]; --frame_count) {
+	if (prof != NULL)
+	    profile_ret ();
 	fp = stack + 1 + fp[1];
+    }
 
     ret (zargs[0]);
 
@@ -52,17 +52,10 @@
  * externs
  */
 
-extern int os_storyfile_seek(FILE * fp, long offset, int whence);
+extern int os_storyfile_seek(FILE *, long offset, int whence);
 
 typedef unsigned long zlong;
 
-/*
- * This is used only by save_quetzal. It probably should be allocated
- * dynamically rather than statically.
- */
-
-static zword frames[STACK_SIZE/4+1];
-
 /*
  * ID types.
  */
@@ -428,6 +421,7 @@ zword save_quetzal (FILE *svf, FILE *stf)
     zlong pc;
     zword i, j, n;
     zword nvars, nargs, nstk, *p;
+    zword frames[STACK_SIZE/4+1];
     zbyte var;
     long cmempos, stkspos;
     int c;
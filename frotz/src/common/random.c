@@ -20,10 +20,9 @@
 
 #include "frotz.h"
 
-static long A = 1;
-
-static int interval = 0;
-static int counter = 0;
+#define A		(zctx->rng_A)
+#define interval	(zctx->rng_interval)
+#define counter		(zctx->rng_counter)
 
 
 /*
@@ -31,15 +30,18 @@ static int counter = 0;
  *
  */
 
-long getRngA() {
+long getRngA(zmachine_ctx *ctx) {
+  zctx = ctx;
   return A;
 }
 
-int getRngInterval() {
+int getRngInterval(zmachine_ctx *ctx) {
+  zctx = ctx;
   return interval;
 }
 
-int getRngCounter() {
+int getRngCounter(zmachine_ctx *ctx) {
+  zctx = ctx;
   return counter;
 }
 
@@ -50,7 +52,8 @@ int getRngCounter() {
  * Set the state of the random number generator.
  *
  */
-void setRng(long p_A, int p_interval, int p_counter) {
+void setRng(zmachine_ctx *ctx, long p_A, int p_interval, int p_counter) {
+    zctx = ctx;
     A = p_A;
     interval = p_interval;
     counter = p_counter;
@@ -20,18 +20,10 @@
 
 #include "frotz.h"
 
-#define MAX_NESTING 16
-
 extern zword get_max_width (zword);
 
-static int depth = -1;
-
-static struct {
-    zword xsize;
-    zword table;
-    zword width;
-    zword total;
-} redirect[MAX_NESTING];
+#define depth		(zctx->redirect_depth)
+#define redirect	(zctx->redirect)
 
 
 /*
@@ -172,3 +164,19 @@ void memory_close (void)
     }
 
 }/* memory_close */
+
+
+/*
+ * reset_redirect
+ *
+ * Drop every output redirection still open, as after an instruction
+ * cut short by a halt.
+ *
+ */
+void reset_redirect (void)
+{
+
+    depth = -1;
+    ostream_memory = FALSE;
+
+}/* reset_redirect */
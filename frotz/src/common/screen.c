@@ -25,7 +25,7 @@ extern void set_header_extension (int, zword);
 extern int direct_call (zword);
 
 static struct {
-    enum story story_id;
+    enum story story;
     int pic;
     int pic1;
     int pic2;
@@ -39,17 +39,18 @@ static struct {
     {   UNKNOWN,  0,   0,   0 }
 };
 
-static int font_height = 1;
-static int font_width = 1;
+#define font_height	(zctx->font_height)
+#define font_width	(zctx->font_width)
 
-static bool input_redraw = FALSE;
-static bool more_prompts = FALSE;
-static bool discarding = FALSE;
-static bool cursor = TRUE;
+#define input_redraw	(zctx->input_redraw)
+#define more_prompts	(zctx->more_prompts)
+#define discarding	(zctx->discarding)
+#define cursor		(zctx->cursor)
 
-static int input_window = 0;
+#define input_window	(zctx->input_window)
 
-static Zwindow wp[8], *cwp = wp;
+#define wp		(zctx->wp)
+#define cwp		(zctx->cwp)
 
 Zwindow * curwinrec() { return cwp;}
 
@@ -917,9 +918,9 @@ void z_draw_picture (void)
        Zork Zero were split into several MCGA pictures (left, right
        and top borders).  We pretend this has not happened. */
 
-    for (i = 0; mapper[i].story_id != UNKNOWN; i++)
+    for (i = 0; mapper[i].story != UNKNOWN; i++)
 
-	if (story_id == mapper[i].story_id && pic == mapper[i].pic) {
+	if (story_id == mapper[i].story && pic == mapper[i].pic) {
 
 	    int height1, width1;
 	    int height2, width2;
@@ -1129,9 +1130,9 @@ void z_picture_data (void)
 
     bool avail = os_picture_data (pic, &height, &width);
 
-    for (i = 0; mapper[i].story_id != UNKNOWN; i++)
+    for (i = 0; mapper[i].story != UNKNOWN; i++)
 
-	if (story_id == mapper[i].story_id) {
+	if (story_id == mapper[i].story) {
 
 	    if (pic == mapper[i].pic) {
 
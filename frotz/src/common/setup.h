@@ -39,8 +39,6 @@ typedef struct frotz_setup_struct {
 	bool exec_in_blorb;
 } f_setup_t;
 
-extern f_setup_t f_setup;
-
 /*** Story file header data ***/
 /*
 typedef struct zcode_header_struct {
@@ -31,13 +31,13 @@
 
 extern int direct_call (zword);
 
-static zword routine = 0;
+#define routine		(zctx->sound_routine)
 
-static int next_sample = 0;
-static int next_volume = 0;
+#define next_sample	(zctx->next_sample)
+#define next_volume	(zctx->next_volume)
 
-static bool locked = FALSE;
-static bool playing = FALSE;
+#define locked		(zctx->sound_locked)
+#define playing		(zctx->sound_playing)
 
 
 /*
@@ -51,17 +51,11 @@
  * externs
  */
 
-extern int os_storyfile_seek(FILE * fp, long offset, int whence);
+extern int os_storyfile_seek(FILE *, long offset, int whence);
+extern long mem_equal_prefix (const zbyte *a, const zbyte *b, long size);
 
 typedef unsigned long zlong;
 
-/*
- * This is used only by save_quetzal. It probably should be allocated
- * dynamically rather than statically.
- */
-
-static zword frames[STACK_SIZE/4+1];
-
 /*
  * ID types.
  */
@@ -160,6 +154,7 @@ zword restore_squetzal (unsigned char *svf, unsigned char *stf)
     zword i, tmpw;
     zword fatal = 0;	/* Set to -1 when errors must be fatal. */
     zbyte skip, progress = GOT_NONE;
+    long run;
     int x, y;
     unsigned char *stf_start = stf;
 
@@ -250,6 +245,10 @@ zword restore_squetzal (unsigned char *svf, unsigned char *stf)
           pc |= (zlong) x << 8;
           x = (int) *svf; svf++;
           pc |= (zlong) x;
+          if (pc >= (zlong) story_size) {
+            printf ("Save-file has a PC outside the story!\n");
+            return fatal;
+          }
           fatal = -1;	/* Setting PC means errors must be fatal. */
           SET_PC (pc);
           // printf("PC %ld\n",pc);
@@ -327,6 +326,11 @@ zword restore_squetzal (unsigned char *svf, unsigned char *stf)
 		    /* Read PC, procedure flag and formal param count. */
             read_long (svf, &tmpl); svf += 4;
 		    /* if (!read_long (svf, &tmpl))		return fatal; */
+		    if ((tmpl >> 8) == 0 || (tmpl >> 8) >= (zlong) story_size)
+		    {
+			printf ("Save-file has a return PC outside the story!\n");
+			return fatal;
+		    }
 		    y = (int) (tmpl & 0x0F);	/* Number of formals. */
 		    tmpw = y << 8;
 
@@ -423,10 +427,12 @@ zword restore_squetzal (unsigned char *svf, unsigned char *stf)
 			    --currlen;
                 x = (int) *svf; svf++;
 			    /* if ((x = get_c (svf)) == EOF)	return fatal; */
-			    for (; x >= 0 && i<h_dynamic_size; --x, ++i) {
-            y = (int) *stf; stf++;
-            zmp[i] = (zbyte) y;
-          }
+			    run = i < h_dynamic_size ? h_dynamic_size - i : 0;
+			    if (x + 1 < run)
+				run = x + 1;
+			    memcpy (zmp + i, stf, run);
+			    stf += run;
+			    i += run;
 			}
 			else	/* Not a run. */
 			{
@@ -449,10 +455,8 @@ zword restore_squetzal (unsigned char *svf, unsigned char *stf)
 			}
 		    }
 		    /* If chunk is short, assume a run. */
-		    for (; i<h_dynamic_size; ++i) {
-          y = (int) *stf; stf++;
-          zmp[i] = (zbyte) y;
-        }
+		    if (i < h_dynamic_size)
+			memcpy (zmp + i, stf, h_dynamic_size - i);
 		    if (currlen == 0)
 			progress |= GOT_MEMORY;	/* Only if succeeded. */
 		    break;
@@ -510,8 +514,10 @@ zword save_squetzal (unsigned char *svf, unsigned char *stf)
     zlong pc;
     zword i, j, n;
     zword nvars, nargs, nstk, *p;
+    zword frames[STACK_SIZE/4+1];
     zbyte var;
     long start, cmempos, stkspos;
+    long run;
     int c;
 
     if (svf == NULL || stf == NULL) {
@@ -540,29 +546,29 @@ zword save_squetzal (unsigned char *svf, unsigned char *stf)
     /* j holds current run length. */
     for (i=0, j=0, cmemlen=0; i < h_dynamic_size; ++i)
     {
-      c = (int) *stf; stf++;
-	// if ((c = get_c (stf)) == EOF)			return 0;
-	c ^= (int) zmp[i];
-	if (c == 0)
-	    ++j;	/* It's a run of equal bytes. */
-	else
+	/* Skip the run of equal bytes at once. */
+	run = mem_equal_prefix (stf + i, zmp + i, h_dynamic_size - i);
+	j += run;
+	i += run;
+	if (i == h_dynamic_size)
+	    break;
+	c = (int) stf[i] ^ (int) zmp[i];
+
+	/* Write out any run there may be. */
+	if (j > 0)
 	{
-	    /* Write out any run there may be. */
-	    if (j > 0)
+	    for (; j > 0x100; j -= 0x100)
 	    {
-		for (; j > 0x100; j -= 0x100)
-		{
-          write_run (svf, 0xFF); svf += 2;
-		    cmemlen += 2;
-		}
-		write_run (svf, j-1); svf += 2;
+		write_run (svf, 0xFF); svf += 2;
 		cmemlen += 2;
-		j = 0;
 	    }
-	    /* Any runs are now written. Write this (nonzero) byte. */
-	    write_byte (svf, (zbyte) c); svf++;
-	    ++cmemlen;
+	    write_run (svf, j-1); svf += 2;
+	    cmemlen += 2;
+	    j = 0;
 	}
+	/* Any runs are now written. Write this (nonzero) byte. */
+	write_byte (svf, (zbyte) c); svf++;
+	++cmemlen;
     }
 
     /*
@@ -141,11 +141,20 @@ void z_output_stream (void)
  *
  * Send a single character to the output stream.
  *
+ * In headless mode, text sent to the screen goes straight to the text
+ * captured by the interface, without the cursor, window and more prompt
+ * bookkeeping of screen.c. This is used where only the text matters,
+ * such as when trying candidate actions.
+ *
  */
 void stream_char (zchar c)
 {
-    if (ostream_screen)
-	screen_char (c);
+    if (ostream_screen) {
+	if (zctx->headless)
+	    os_display_char (c);
+	else
+	    screen_char (c);
+    }
     if (ostream_script && enable_scripting)
 	script_char (c);
 
@@ -166,8 +175,12 @@ void stream_word (const zchar *s)
 
     else {
 
-	if (ostream_screen)
-	    screen_word (s);
+	if (ostream_screen) {
+	    if (zctx->headless)
+		os_display_string (s);
+	    else
+		screen_word (s);
+	}
 	if (ostream_script && enable_scripting)
 	    script_word (s);
 
@@ -189,8 +202,12 @@ void stream_new_line (void)
 
     else {
 
-	if (ostream_screen)
-	    screen_new_line ();
+	if (ostream_screen) {
+	    if (zctx->headless)
+		os_scroll_area (0, 0, 0, 0, 0);	/* Ends the line of text */
+	    else
+		screen_new_line ();
+	}
 	if (ostream_script && enable_scripting)
 	    script_new_line ();
 
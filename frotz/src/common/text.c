@@ -18,6 +18,8 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#include <stdlib.h>
+#include <string.h>
 #include "frotz.h"
 
 enum string_type {
@@ -32,8 +34,85 @@ extern zword get_sibling (zword);
 extern zword first_property (zword);
 extern zword next_property (zword);
 
-static zchar decoded[10];
-static zword encoded[3];
+#define decoded (zctx->decoded)
+#define encoded (zctx->encoded)
+
+/*
+ * Hash indexes of dictionaries, from encoded words to entry addresses,
+ * built by dict_index the first time a dictionary is used to tokenise.
+ * A dictionary in dynamic memory is compared to a copy kept with its
+ * index and indexed again if the game changed it.
+ *
+ */
+
+#define MAX_DICT_INDEXES 16
+#define AMBIGUOUS_ENTRY 1	/* Word with several entries */
+
+struct dict_slot {
+    zword words[3];		/* Encoded word */
+    zword entry;		/* Address of its entry, 0 for an empty slot */
+};
+
+struct dict_index {
+    zword dct;			/* Address of the dictionary */
+    long size;			/* Bytes of the dictionary */
+    zbyte *copy;		/* Dictionary contents if in dynamic memory */
+    zword mask;
+    struct dict_slot *slots;
+    struct dict_index *next;
+};
+
+#define dict_indexes (zctx->dict_indexes)
+
+/*
+ * Cache of the output of decode_text for strings in static or high
+ * memory. The output of a string is recorded the first time it is
+ * printed, then replayed. The arena holds the output of all cached
+ * strings; when full, the cache starts over. A new line is recorded as
+ * TEXT_ESCAPE, TEXT_NEW_LINE and a null character as TEXT_ESCAPE, 0.
+ *
+ * The encoded text cannot change, but the abbreviations it uses are
+ * looked up in a table that is usually in dynamic memory, and which
+ * Inform's dynamic strings rewrite. Each entry keeps the table entries
+ * its output depends on, with the values they held, and is replayed
+ * only while they still hold them. Strings are not cached at all if
+ * the alphabet or Unicode table is in dynamic memory, nor if they use
+ * an abbreviation whose own text is.
+ *
+ */
+
+#define TEXT_CACHE_SLOTS 1024
+#define TEXT_ARENA_SIZE 0x10000
+#define TEXT_ABBRS_SIZE 0x1000
+#define TEXT_ESCAPE 0
+#define TEXT_NEW_LINE 1
+
+struct text_entry {
+    long addr;			/* Byte address of the string, 0 for none */
+    long start;			/* Offset of its output in the arena */
+    int length;			/* Number of zchars of output */
+    int size;			/* Bytes of encoded text */
+    long abbrs;			/* Offset of its abbreviations in abbrs */
+    int num_abbrs;
+};
+
+struct text_abbr {
+    zword ptr_addr;		/* Entry of the abbreviation table */
+    zword abbr_addr;		/* and the word address it held */
+};
+
+struct string_cache {
+    struct text_entry slots[TEXT_CACHE_SLOTS];
+    zchar arena[TEXT_ARENA_SIZE];
+    struct text_abbr abbrs[TEXT_ABBRS_SIZE];
+    long used;			/* zchars of the arena in use */
+    long recorded;		/* zchars recorded for the current string */
+    long abbrs_used;		/* Entries of abbrs in use */
+    int abbrs_recorded;		/* Entries recorded for the current string */
+    bool recording;
+};
+
+#define text_cache (zctx->text_cache)
 
 /*
  * According to Matteo De Luigi <matteo.de.luigi@libero.it>,
@@ -359,6 +438,232 @@ void z_encode_text (void)
 }/* z_encode_text */
 
 
+/*
+ * record_char
+ *
+ * Append a zchar to the output of the string being recorded. Give up
+ * recording if the arena is full.
+ *
+ */
+static void record_char (zchar c)
+{
+    if (text_cache->used + text_cache->recorded < TEXT_ARENA_SIZE)
+	text_cache->arena[text_cache->used + text_cache->recorded++] = c;
+    else
+	text_cache->recording = FALSE;
+
+}/* record_char */
+
+
+/*
+ * record_abbr
+ *
+ * Note that the string being recorded uses the abbreviation whose
+ * table entry at ptr_addr holds abbr_addr. Give up recording if the
+ * abbreviation may change under the recording.
+ *
+ */
+static void record_abbr (zword ptr_addr, zword abbr_addr)
+{
+    struct text_abbr *abbr;
+
+    if (((long) abbr_addr << 1) < h_dynamic_size)
+	text_cache->recording = FALSE;
+    else if (ptr_addr >= h_dynamic_size)
+	return;
+    else if (text_cache->abbrs_used + text_cache->abbrs_recorded < TEXT_ABBRS_SIZE) {
+	abbr = &text_cache->abbrs[text_cache->abbrs_used + text_cache->abbrs_recorded++];
+	abbr->ptr_addr = ptr_addr;
+	abbr->abbr_addr = abbr_addr;
+    } else
+	text_cache->recording = FALSE;
+
+}/* record_abbr */
+
+
+/*
+ * text_tables_static
+ *
+ * Return TRUE if the alphabet and Unicode tables, which decode_text
+ * reads on every character, are not in dynamic memory.
+ *
+ */
+static bool text_tables_static (void)
+{
+
+    return (h_alphabet == 0 || h_alphabet >= h_dynamic_size)
+	&& (hx_unicode_table == 0 || hx_unicode_table >= h_dynamic_size);
+
+}/* text_tables_static */
+
+
+/*
+ * decoded_char
+ *
+ * Print a character decoded from a string.
+ *
+ */
+static void decoded_char (zchar c)
+{
+    if (text_cache != NULL && text_cache->recording) {
+	if (c == TEXT_ESCAPE)
+	    record_char (TEXT_ESCAPE);
+	record_char (c);
+    }
+
+    print_char (c);
+
+}/* decoded_char */
+
+
+/*
+ * decoded_new_line
+ *
+ * Start a new line as asked by a string.
+ *
+ */
+static void decoded_new_line (void)
+{
+    if (text_cache != NULL && text_cache->recording) {
+	record_char (TEXT_ESCAPE);
+	record_char (TEXT_NEW_LINE);
+    }
+
+    new_line ();
+
+}/* decoded_new_line */
+
+
+/*
+ * replay_text
+ *
+ * Print the string at byte_addr from the cache, if there. Returns the
+ * number of bytes of encoded text, or 0 if the string is not cached.
+ *
+ */
+static int replay_text (long byte_addr)
+{
+    struct text_entry *entry;
+    struct text_abbr *abbr;
+    zchar *p, *end;
+    zword value;
+    int i;
+
+    if (text_cache == NULL)
+	return 0;
+
+    entry = &text_cache->slots[(byte_addr >> 1) & (TEXT_CACHE_SLOTS - 1)];
+    if (entry->addr != byte_addr)
+	return 0;
+
+    /* The abbreviations used must not have changed */
+
+    for (i = 0; i < entry->num_abbrs; i++) {
+	abbr = &text_cache->abbrs[entry->abbrs + i];
+	LOW_WORD (abbr->ptr_addr, value)
+	if (value != abbr->abbr_addr)
+	    return 0;
+    }
+
+    p = text_cache->arena + entry->start;
+    end = p + entry->length;
+
+    while (p < end)
+	if (*p != TEXT_ESCAPE)
+	    print_char (*p++);
+	else if (p[1] == TEXT_NEW_LINE) {
+	    new_line ();
+	    p += 2;
+	} else {
+	    print_char (p[1]);
+	    p += 2;
+	}
+
+    return entry->size;
+
+}/* replay_text */
+
+
+/*
+ * start_recording
+ *
+ * Start recording the output of the string at byte_addr. Returns FALSE
+ * if that is not possible.
+ *
+ */
+static bool start_recording (void)
+{
+    int i;
+
+    if (text_cache == NULL && (text_cache = malloc (sizeof (struct string_cache))) != NULL) {
+	text_cache->used = TEXT_ARENA_SIZE;
+	text_cache->abbrs_used = 0;
+	text_cache->recording = FALSE;
+    }
+
+    if (text_cache == NULL || text_cache->recording)
+	return FALSE;
+
+    /* Start over when the arena is nearly full */
+
+    if (text_cache->used > TEXT_ARENA_SIZE - TEXT_ARENA_SIZE / 16
+	|| text_cache->abbrs_used > TEXT_ABBRS_SIZE - TEXT_ABBRS_SIZE / 16) {
+	for (i = 0; i < TEXT_CACHE_SLOTS; i++)
+	    text_cache->slots[i].addr = 0;
+	text_cache->used = 0;
+	text_cache->abbrs_used = 0;
+    }
+
+    text_cache->recorded = 0;
+    text_cache->abbrs_recorded = 0;
+    text_cache->recording = TRUE;
+    return TRUE;
+
+}/* start_recording */
+
+
+/*
+ * stop_recording
+ *
+ * Add the string recorded to the cache, unless recording was given up.
+ *
+ */
+static void stop_recording (long byte_addr, int size)
+{
+    struct text_entry *entry;
+
+    if (!text_cache->recording)
+	return;
+
+    entry = &text_cache->slots[(byte_addr >> 1) & (TEXT_CACHE_SLOTS - 1)];
+    entry->addr = byte_addr;
+    entry->start = text_cache->used;
+    entry->length = text_cache->recorded;
+    entry->size = size;
+    entry->abbrs = text_cache->abbrs_used;
+    entry->num_abbrs = text_cache->abbrs_recorded;
+
+    text_cache->used += text_cache->recorded;
+    text_cache->abbrs_used += text_cache->abbrs_recorded;
+    text_cache->recording = FALSE;
+
+}/* stop_recording */
+
+
+/*
+ * reset_text_cache
+ *
+ * Forget the decoded strings of the story.
+ *
+ */
+static void reset_text_cache (void)
+{
+    free (text_cache);
+    text_cache = NULL;
+
+}/* reset_text_cache */
+
+
 /*
  * decode_text
  *
@@ -379,11 +684,14 @@ void z_encode_text (void)
  * The last type is only used for word completion.
  *
  */
-#define outchar(c)	if (st==VOCABULARY) *ptr++=c; else print_char(c)
+#define outchar(c)	if (st==VOCABULARY) *ptr++=c; else decoded_char(c)
 static void decode_text (enum string_type st, zword addr)
 {
     zchar *ptr;
     long byte_addr;
+    long start_addr;
+    bool recording;
+    int size;
     zchar c2;
     zword code;
     zbyte c, prev_c = 0;
@@ -416,6 +724,30 @@ static void decode_text (enum string_type st, zword addr)
 
     }
 
+    /* Strings outside dynamic memory are printed from the cache */
+
+    if (st == EMBEDDED_STRING)
+	GET_PC (start_addr)
+    else if (st == LOW_STRING)
+	start_addr = addr;
+    else if (st == HIGH_STRING && byte_addr < story_size)
+	start_addr = byte_addr;
+    else
+	start_addr = 0;
+
+    recording = FALSE;
+
+    if (start_addr >= h_dynamic_size && text_tables_static ()) {
+
+	if ((size = replay_text (start_addr)) != 0) {
+	    if (st == EMBEDDED_STRING)
+		SET_PC (start_addr + size)
+	    return;
+	}
+
+	recording = start_recording ();
+    }
+
     /* Loop until a 16bit word has the highest bit set */
 
     if (st == VOCABULARY)
@@ -453,10 +785,10 @@ static void decode_text (enum string_type st, zword addr)
 		    status = 2;
 
 		else if (h_version == V1 && c == 1)
-		    new_line ();
+		    decoded_new_line ();
 
 		else if (h_version >= V2 && shift_state == 2 && c == 7)
-		    new_line ();
+		    decoded_new_line ();
 
 		else if (c >= 6)
 		    outchar (alphabet (shift_state, c - 6));
@@ -490,6 +822,8 @@ static void decode_text (enum string_type st, zword addr)
 		ptr_addr = h_abbreviations + 64 * (prev_c - 1) + 2 * c;
 
 		LOW_WORD (ptr_addr, abbr_addr)
+		if (recording && text_cache->recording)
+		    record_abbr (ptr_addr, abbr_addr);
 		decode_text (ABBREVIATION, abbr_addr);
 
 		status = 0;
@@ -519,6 +853,16 @@ static void decode_text (enum string_type st, zword addr)
     if (st == VOCABULARY)
 	*ptr = 0;
 
+    if (recording) {
+	if (st == EMBEDDED_STRING)
+	    GET_PC (size)
+	else if (st == LOW_STRING)
+	    size = addr;
+	else
+	    size = byte_addr;
+	stop_recording (start_addr, size - start_addr);
+    }
+
 }/* decode_text */
 #undef outchar
 
@@ -960,6 +1304,196 @@ void z_print_unicode (void)
 }/* z_print_unicode */
 
 
+/*
+ * hash_words
+ *
+ * Hash an encoded word of a dictionary.
+ *
+ */
+static unsigned hash_words (const zword *words)
+{
+    unsigned h;
+
+    h = words[0] * 0x9e3779b1u ^ words[1] * 0x85ebca6bu ^ words[2] * 0xc2b2ae35u;
+    return h ^ (h >> 15);
+
+}/* hash_words */
+
+
+/*
+ * free_dict_index
+ *
+ * Free the index of a dictionary.
+ *
+ */
+static void free_dict_index (struct dict_index *index)
+{
+    free (index->copy);
+    free (index->slots);
+    free (index);
+
+}/* free_dict_index */
+
+
+/*
+ * build_dict_index
+ *
+ * Index the entries of the dictionary at dct, or return NULL if it
+ * cannot be indexed.
+ *
+ */
+static struct dict_index *build_dict_index (zword dct)
+{
+    struct dict_index *index;
+    struct dict_slot *slot;
+    zword words[3];
+    zword last[3];
+    zword entry_addr;
+    zword entry_count;
+    zbyte entry_len;
+    zbyte sep_count;
+    int resolution = (h_version <= V3) ? 2 : 3;
+    bool sorted;
+    long size;
+    zword mask;
+    int i, j;
+
+    entry_addr = dct;
+    LOW_BYTE (entry_addr, sep_count)
+    entry_addr += 1 + sep_count;
+    LOW_BYTE (entry_addr, entry_len)
+    entry_addr += 1;
+    LOW_WORD (entry_addr, entry_count)
+    entry_addr += 2;
+
+    sorted = (short) entry_count >= 0;
+    if (!sorted)
+	entry_count = - (short) entry_count;
+
+    size = (entry_addr - dct) + (long) entry_count * entry_len;
+
+    if (entry_len < 2 * resolution || dct + size > story_size)
+	return NULL;
+
+    for (mask = 15; mask < 2 * entry_count && mask < 0x7fff; mask = 2 * mask + 1);
+
+    if ((index = calloc (1, sizeof (struct dict_index))) == NULL)
+	return NULL;
+    index->dct = dct;
+    index->size = size;
+    index->mask = mask;
+
+    if ((index->slots = calloc (mask + 1, sizeof (struct dict_slot))) == NULL
+	|| (dct < h_dynamic_size && (index->copy = malloc (size)) == NULL)) {
+	free_dict_index (index);
+	return NULL;
+    }
+
+    if (index->copy != NULL)
+	memcpy (index->copy, zmp + dct, size);
+
+    for (i = 0; i < entry_count; i++, entry_addr += entry_len) {
+
+	words[2] = 0;
+	for (j = 0; j < resolution; j++)
+	    LOW_WORD (entry_addr + 2 * j, words[j])
+
+	/* Binary search in a badly sorted dictionary would miss words */
+
+	if (sorted && i > 0) {
+	    for (j = 0; j < 2 && words[j] == last[j]; j++);
+	    if (words[j] < last[j]) {
+		free_dict_index (index);
+		return NULL;
+	    }
+	}
+	memcpy (last, words, sizeof (words));
+
+	for (slot = &index->slots[hash_words (words) & mask];
+	     slot->entry != 0;
+	     slot = &index->slots[(slot - index->slots + 1) & mask])
+	    if (memcmp (slot->words, words, sizeof (words)) == 0)
+		break;
+
+	if (slot->entry == 0) {
+	    memcpy (slot->words, words, sizeof (words));
+	    slot->entry = entry_addr;
+	} else if (sorted)
+
+	    /* Binary search may find either entry; leave it to lookup_text */
+
+	    slot->entry = AMBIGUOUS_ENTRY;
+
+	/* Linear search finds the first entry, already in place */
+
+    }
+
+    return index;
+
+}/* build_dict_index */
+
+
+/*
+ * dict_index
+ *
+ * Return the index of the dictionary at dct, building it if needed,
+ * or NULL if there is none.
+ *
+ */
+static struct dict_index *dict_index (zword dct)
+{
+    struct dict_index **link;
+    struct dict_index *index;
+    int count = 0;
+
+    for (link = &dict_indexes; *link != NULL; link = &(*link)->next, count++) {
+
+	index = *link;
+
+	if (index->dct != dct)
+	    continue;
+
+	if (index->copy == NULL || memcmp (index->copy, zmp + dct, index->size) == 0)
+	    return index;
+
+	/* The game changed the dictionary */
+
+	*link = index->next;
+	free_dict_index (index);
+	count--;
+	break;
+    }
+
+    if (count >= MAX_DICT_INDEXES || (index = build_dict_index (dct)) == NULL)
+	return NULL;
+
+    index->next = dict_indexes;
+    dict_indexes = index;
+    return index;
+
+}/* dict_index */
+
+
+/*
+ * reset_text
+ *
+ * Forget the dictionary indexes and decoded strings of the story.
+ *
+ */
+void reset_text (void)
+{
+    struct dict_index *index;
+
+    while ((index = dict_indexes) != NULL) {
+	dict_indexes = index->next;
+	free_dict_index (index);
+    }
+
+    reset_text_cache ();
+
+}/* reset_text */
+
+
 /*
  * lookup_text
  *
@@ -973,8 +1507,9 @@ void z_print_unicode (void)
  * The return value is 0 if the search fails.
  *
  */
-static zword lookup_text (int padding, zword dct)
+static zword lookup_text (int padding, zword dct, struct dict_index *index)
 {
+    struct dict_slot *slot;
     zword entry_addr;
     zword entry_count;
     zword entry;
@@ -989,6 +1524,23 @@ static zword lookup_text (int padding, zword dct)
 
     encode_text (padding);
 
+    /* Exact matches can be found in the index, if any */
+
+    if (index != NULL && padding == 0x05) {
+
+	if (resolution == 2)
+	    encoded[2] = 0;
+
+	for (slot = &index->slots[hash_words (encoded) & index->mask];
+	     slot->entry != 0;
+	     slot = &index->slots[(slot - index->slots + 1) & index->mask])
+	    if (memcmp (slot->words, encoded, sizeof (slot->words)) == 0)
+		break;
+
+	if (slot->entry != AMBIGUOUS_ENTRY)
+	    return slot->entry;
+    }
+
     LOW_BYTE (dct, sep_count)		/* skip word separators */
     dct += 1 + sep_count;
     LOW_BYTE (dct, entry_len)		/* get length of entries */
@@ -1067,7 +1619,8 @@ static zword lookup_text (int padding, zword dct)
  * times with different dictionaries); otherwise they are zero.
  *
  */
-static void tokenise_text (zword text, zword length, zword from, zword parse, zword dct, bool flag)
+static void tokenise_text (zword text, zword length, zword from, zword parse, zword dct,
+			   struct dict_index *index, bool flag)
 {
     zword addr;
     zbyte token_max, token_count;
@@ -1082,7 +1635,7 @@ static void tokenise_text (zword text, zword length, zword from, zword parse, zw
 
 	load_string ((zword) (text + from), length);
 
-	addr = lookup_text (0x05, dct);
+	addr = lookup_text (0x05, dct, index);
 
 	if (addr != 0 || !flag) {
 
@@ -1107,6 +1660,7 @@ static void tokenise_text (zword text, zword length, zword from, zword parse, zw
  */
 void tokenise_line (zword text, zword token, zword dct, bool flag)
 {
+    struct dict_index *index;
     zword addr1;
     zword addr2;
     zbyte length;
@@ -1119,6 +1673,8 @@ void tokenise_line (zword text, zword token, zword dct, bool flag)
     if (dct == 0)
 	dct = h_dictionary;
 
+    index = dict_index (dct);
+
     /* Remove all tokens before inserting new ones */
 
     storeb ((zword) (token + 1), 0);
@@ -1179,7 +1735,7 @@ void tokenise_line (zword text, zword token, zword dct, bool flag)
 		text,
 		(zword) (addr1 - addr2),
 		(zword) (addr2 - text),
-		token, dct, flag );
+		token, dct, index, flag );
 
 	    addr2 = 0;
 
@@ -1193,7 +1749,7 @@ void tokenise_line (zword text, zword token, zword dct, bool flag)
 		text,
 		(zword) (1),
 		(zword) (addr1 - text),
-		token, dct, flag );
+		token, dct, index, flag );
 
     } while (c != 0);
 
@@ -1272,8 +1828,8 @@ int completion (const zchar *buffer, zchar *result)
 
     /* Search the dictionary for first and last possible extensions */
 
-    minaddr = lookup_text (0x00, h_dictionary);
-    maxaddr = lookup_text (0x1f, h_dictionary);
+    minaddr = lookup_text (0x00, h_dictionary, NULL);
+    maxaddr = lookup_text (0x1f, h_dictionary, NULL);
 
     if (minaddr == 0 || maxaddr == 0 || minaddr > maxaddr)
 	return 2;
@@ -30,12 +30,6 @@
 #include "dumb_frotz.h"
 #include "dumb_blorb.h"
 
-extern f_setup_t f_setup;
-
-FILE *blorb_fp;
-bb_result_t blorb_res;
-bb_map_t *blorb_map;
-
 static int isblorb(FILE *);
 
 #define UnsignedToFloat(u) (((double)((long)(u - 2147483647L - 1))) + 2147483648.0)
@@ -54,7 +48,7 @@ static int isblorb(FILE *);
  */
 bb_err_t dumb_blorb_init(char *filename)
 {
-    FILE *fp;
+    FILE *f;
     char *p;
     char *mystring;
     int  len1;
@@ -64,13 +58,13 @@ bb_err_t dumb_blorb_init(char *filename)
 
     blorb_map = NULL;
 
-    if ((fp = fopen(filename, "rb")) == NULL)
+    if ((f = fopen(filename, "rb")) == NULL)
 	return bb_err_Read;
 
     /* Is this really a Blorb file?  If not, maybe we're loading a naked
      * zcode file and our resources are in a seperate blorb file.
      */
-    if (isblorb(fp)) {			/* Now we know to look */
+    if (isblorb(f)) {			/* Now we know to look */
 	f_setup.exec_in_blorb = 1;	/* for zcode in the blorb */
         blorb_fp = fopen(filename, "rb");
     } else {
@@ -86,8 +80,8 @@ bb_err_t dumb_blorb_init(char *filename)
         strncat(mystring, EXT_BLORB, len1 * sizeof(char));
 
 	/* Done monkeying with the initial file. */
-	fclose(fp);
-	fp = NULL;
+	fclose(f);
+	f = NULL;
 
 	/* Check if foo.blb is there. */
         if ((blorb_fp = fopen(mystring, "rb")) == NULL) {
@@ -99,7 +93,7 @@ bb_err_t dumb_blorb_init(char *filename)
 	}
     free(mystring);
 
-	if (blorb_fp == NULL || !isblorb(fp))	/* No matching blorbs found. */
+	if (blorb_fp == NULL || !isblorb(f))	/* No matching blorbs found. */
 	    return bb_err_NoBlorb;
 
 	/* At this point we know that we're using a naked zcode file */
@@ -111,7 +105,7 @@ bb_err_t dumb_blorb_init(char *filename)
      * This will fail if the file is not a valid Blorb file.
      * From this map, we can now pick out any resource we need.
      */
-    blorb_err = bb_create_map(fp, &blorb_map);
+    blorb_err = bb_create_map(f, &blorb_map);
     if (blorb_err != bb_err_None)
 	return bb_err_Format;
 
@@ -124,7 +118,7 @@ bb_err_t dumb_blorb_init(char *filename)
 	f_setup.exec_in_blorb = 1;
     }
 
-    fclose(fp);
+    fclose(f);
     return blorb_err;
 }
 
@@ -156,19 +150,19 @@ void ux_blorb_stop(void)
  *
  * FIXME Is there a potential endian problem here?
  */
-static int isblorb(FILE *fp)
+static int isblorb(FILE *f)
 {
     char mybuf[4];
 
-    if (fp == NULL)
+    if (f == NULL)
 	return 0;
 
-    fread(mybuf, 1, 4, fp);
+    fread(mybuf, 1, 4, f);
     if (strncmp(mybuf, "FORM", 4))
 	return 0;
 
-    fseek(fp, 4, SEEK_CUR);
-    fread(mybuf, 1, 4, fp);
+    fseek(f, 4, SEEK_CUR);
+    fread(mybuf, 1, 4, f);
 
     if (strncmp(mybuf, "IFRS", 4))
 	return 0;
@@ -21,13 +21,13 @@ typedef struct sampledata_struct {
 typedef struct {
     bb_result_t bbres;
     unsigned long type;
-    FILE *fp;
+    FILE *file;
 } myresource;
 
 extern bb_err_t         blorb_err;
-extern bb_map_t         *blorb_map;
-extern bb_result_t      blorb_res;
-extern FILE *blorb_fp;
+#define blorb_map	(zctx->blorb_map)
+#define blorb_res	(zctx->blorb_res)
+#define blorb_fp	(zctx->blorb_fp)
 
 bb_err_t dumb_blorb_init(char *);
 void dumb_blorb_stop(void);
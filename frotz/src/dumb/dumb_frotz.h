@@ -17,10 +17,17 @@
 #include <ctype.h>
 #include <time.h>
 
-/* from ../common/setup.h */
-extern f_setup_t f_setup;
+#define do_more_prompts (zctx->do_more_prompts)
 
-extern bool do_more_prompts;
+/* Compression styles.  */
+enum {
+  COMPRESSION_NONE, COMPRESSION_SPANS, COMPRESSION_MAX,
+};
+
+/* Reverse-video display styles.  */
+enum {
+  RV_NONE, RV_DOUBLESTRIKE, RV_UNDERLINE, RV_CAPS,
+};
 
 /* From input.c.  */
 bool is_terminator (zchar);
@@ -46,6 +53,9 @@ void dumb_clear_output(void);
 char* dumb_get_screen(void);
 void dumb_clear_screen(void);
 
+/* dumb-init.c */
+void dumb_init_ctx(void);
+
 /* dumb-pic.c */
 void dumb_init_pictures(char *graphics_filename);
 
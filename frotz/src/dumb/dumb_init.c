@@ -23,8 +23,6 @@
 #include "dumb_frotz.h"
 #include "dumb_blorb.h"
 
-f_setup_t f_setup;
-
 static char *my_strdup(char *);
 static void print_version(void);
 
@@ -79,11 +77,11 @@ error:
     return '?';
 }/* zgetopt */
 
-static int user_screen_width = 128;
-static int user_screen_height = 1000;
-static int user_interpreter_number = -1;
-static int user_random_seed = -1;
-static int user_tandy_bit = 0;
+#define user_screen_width	(zctx->user_screen_width)
+#define user_screen_height	(zctx->user_screen_height)
+#define user_interpreter_number	(zctx->user_interpreter_number)
+#define user_random_seed	(zctx->user_random_seed)
+#define user_tandy_bit		(zctx->user_tandy_bit)
 static char *graphics_filename = NULL;
 static bool plain_ascii = FALSE;
 
@@ -91,7 +89,29 @@ void set_random_seed(int seed) {
   user_random_seed = seed;
 }
 
-bool do_more_prompts;
+/*
+ * dumb_init_ctx
+ *
+ * Give the dumb port's part of a freshly zeroed context its defaults.
+ *
+ */
+void dumb_init_ctx(void)
+{
+    user_screen_width = 128;
+    user_screen_height = 1000;
+    user_interpreter_number = -1;
+    user_random_seed = -1;
+
+    zctx->input_speed = 1;
+    strcpy(zctx->next_action, "n\n");
+
+    zctx->show_line_types = -1;
+    zctx->show_pictures = TRUE;
+    zctx->screen_buffer_ptr = zctx->screen_buffer;
+    zctx->compression_mode = COMPRESSION_SPANS;
+    zctx->rv_mode = RV_NONE;
+    zctx->rv_blank_char = ' ';
+}
 
 void os_process_arguments(int argc, char *argv[])
 {
@@ -213,6 +233,34 @@ void free_setup()
     f_setup.restricted_path = NULL;
 }
 
+/* Called on a bitwise copy of another machine: make our own copies of
+ * the file names */
+void clone_setup(void)
+{
+    if (f_setup.story_file != NULL)
+        f_setup.story_file = my_strdup(f_setup.story_file);
+    if (f_setup.story_name != NULL)
+        f_setup.story_name = my_strdup(f_setup.story_name);
+    if (f_setup.story_base != NULL)
+        f_setup.story_base = my_strdup(f_setup.story_base);
+    if (f_setup.script_name != NULL)
+        f_setup.script_name = my_strdup(f_setup.script_name);
+    if (f_setup.command_name != NULL)
+        f_setup.command_name = my_strdup(f_setup.command_name);
+    if (f_setup.save_name != NULL)
+        f_setup.save_name = my_strdup(f_setup.save_name);
+    if (f_setup.tmp_save_name != NULL)
+        f_setup.tmp_save_name = my_strdup(f_setup.tmp_save_name);
+    if (f_setup.aux_name != NULL)
+        f_setup.aux_name = my_strdup(f_setup.aux_name);
+    if (f_setup.story_path != NULL)
+        f_setup.story_path = my_strdup(f_setup.story_path);
+    if (f_setup.zcode_path != NULL)
+        f_setup.zcode_path = my_strdup(f_setup.zcode_path);
+    if (f_setup.restricted_path != NULL)
+        f_setup.restricted_path = my_strdup(f_setup.restricted_path);
+}
+
 void load_story(char *s)
 {
     char *p = NULL;
@@ -285,18 +333,29 @@ int os_random_seed (void)
 
 void os_restart_game (int UNUSED (stage)) {}
 
+/*
+ * os_fatal
+ *
+ * Halt the machine and return to the library call running it, if any
+ * (see run_action). Exit otherwise.
+ *
+ */
 void os_fatal (const char *s, ...)
 {
     fprintf(stderr, "\nFatal error: %s\n", s);
+    if (zctx != NULL && zctx->fatal_jmp != NULL) {
+	emulator_halted = 1;
+	longjmp(*zctx->fatal_jmp, 1);
+    }
     exit(1);
 }
 
 FILE *os_load_story(void)
 {
-    FILE *fp;
+    FILE *story;
 
     if (f_setup.story_rom) {
-        fp = fmemopen(f_setup.story_rom, f_setup.story_rom_size, "rb");
+        story = fmemopen(f_setup.story_rom, f_setup.story_rom_size, "rb");
     }
     else {
 
@@ -315,14 +374,14 @@ FILE *os_load_story(void)
         break;
         }
 
-        fp = fopen(f_setup.story_file, "rb");
+        story = fopen(f_setup.story_file, "rb");
     }
 
     /* Is this a Blorb file containing Zcode? */
     if (f_setup.exec_in_blorb)
-	 fseek(fp, blorb_res.data.startpos, SEEK_SET);
+	 fseek(story, blorb_res.data.startpos, SEEK_SET);
 
-    return fp;
+    return story;
 }
 
 /*
@@ -330,9 +389,9 @@ FILE *os_load_story(void)
  * ZCODE chunk of a blorb file (dumb does not support blorb
  * so this is just a wrapper for fseek)
  */
-int os_storyfile_seek(FILE * fp, long offset, int whence)
+int os_storyfile_seek(FILE * story, long offset, int whence)
 {
-    return fseek(fp, offset, whence);
+    return fseek(story, offset, whence);
 }
 
 /*
@@ -340,9 +399,9 @@ int os_storyfile_seek(FILE * fp, long offset, int whence)
  * or the ZCODE chunk of a blorb file (dumb does not support
  * blorb so this is just a wrapper for fseek)
  */
-int os_storyfile_tell(FILE * fp)
+int os_storyfile_tell(FILE * story)
 {
-    return ftell(fp);
+    return ftell(story);
 }
 
 void os_init_setup(void)
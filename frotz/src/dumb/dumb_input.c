@@ -21,8 +21,6 @@
 
 #include "dumb_frotz.h"
 
-extern f_setup_t f_setup;
-
 static char runtime_usage[] =
   "DUMB-FROTZ runtime help:\n"
   "  General Commands:\n"
@@ -69,7 +67,7 @@ static char runtime_usage[] =
   "            (blank) Any other output line.\n"
 ;
 
-static float speed = 1;
+#define speed (zctx->input_speed)
 
 enum input_type {
     INPUT_CHAR,
@@ -77,7 +75,7 @@ enum input_type {
     INPUT_LINE_CONTINUED,
 };
 
-char next_action[INPUT_BUFFER_SIZE] = "n\n";
+#define next_action (zctx->next_action)
 
 void dumb_set_next_action(char *s)
 {
@@ -160,7 +158,7 @@ static void translate_special_chars(char *s)
 
 
 /* The time in tenths of seconds that the user is ahead of z time.  */
-static int time_ahead = 0;
+#define time_ahead (zctx->time_ahead)
 
 /* Called from os_read_key and os_read_line if they have input from
  * a previous call to dumb_read_line.
@@ -323,10 +321,13 @@ static void dumb_read_misc_line(char *s, char *prompt)
 /* For allowing the user to input in a single line keys to be returned
  * for several consecutive calls to read_char, with no screen update
  * in between.  Useful for traversing menus.  */
-static char read_key_buffer[INPUT_BUFFER_SIZE];
+#define read_key_buffer (zctx->read_key_buffer)
 
 /* Similar.  Useful for using function key abbreviations.  */
-static char read_line_buffer[INPUT_BUFFER_SIZE];
+#define read_line_buffer (zctx->read_line_buffer)
+
+/* Whether the last os_read_line timed out.  */
+#define timed_out_last_time (zctx->timed_out_last_time)
 
 zchar os_read_key (int timeout, bool show_cursor)
 {
@@ -362,7 +363,6 @@ zchar os_read_line (int UNUSED (max), zchar *buf, int timeout, int UNUSED(width)
 {
   char *p;
   int terminator;
-  static bool timed_out_last_time;
   int timed_out;
 
   /* Discard any keys read for single key input.  */
@@ -415,7 +415,7 @@ zchar os_read_line (int UNUSED (max), zchar *buf, int timeout, int UNUSED(width)
 int os_read_file_name (char *file_name, const char *default_name, int flag)
 {
   char buf[INPUT_BUFFER_SIZE], prompt[INPUT_BUFFER_SIZE];
-  FILE *fp;
+  FILE *f;
   char *tempname;
   int i;
 
@@ -454,8 +454,8 @@ int os_read_file_name (char *file_name, const char *default_name, int flag)
 
   /* Warn if overwriting a file.  */
   if ((flag == FILE_SAVE || flag == FILE_SAVE_AUX || flag == FILE_RECORD)
-      && ((fp = fopen(file_name, "rb")) != NULL)) {
-    fclose (fp);
+      && ((f = fopen(file_name, "rb")) != NULL)) {
+    fclose (f);
     dumb_read_misc_line(buf, "Overwrite existing file? ");
     return(tolower(buf[0]) == 'y');
   }
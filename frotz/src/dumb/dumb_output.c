@@ -21,13 +21,11 @@
 
 #include "dumb_frotz.h"
 
-extern f_setup_t f_setup;
-
-static bool show_line_numbers = FALSE;
-static bool show_line_types = -1;
-static bool show_pictures = TRUE;
-static bool visual_bell = FALSE;
-static bool plain_ascii = FALSE;
+#define show_line_numbers	(zctx->show_line_numbers)
+#define show_line_types		(zctx->show_line_types)
+#define show_pictures		(zctx->show_pictures)
+#define visual_bell		(zctx->visual_bell)
+#define plain_ascii		(zctx->plain_ascii)
 
 static char latin1_to_ascii[] =
   "    !   c   L   >o< Y   |   S   ''  C   a   <<  not -   R   _   "
@@ -39,20 +37,19 @@ static char latin1_to_ascii[] =
 ;
 
 /* h_screen_rows * h_screen_cols */
-static int screen_cells;
+#define screen_cells (zctx->screen_cells)
 
 /* The in-memory state of the screen.  */
 /* Each cell contains a style in the upper byte and a char in the lower. */
 typedef unsigned short cell;
-static cell *screen_data;
+#define screen_data (zctx->screen_data)
 
 static cell make_cell(int style, char c) {return (style << 8) | (0xff & c);}
 static char cell_char(cell c) {return c & 0xff;}
 static int cell_style(cell c) {return c >> 8;}
 
-#define SCREEN_BUFF_SIZE 8192
-static char screen_buffer[SCREEN_BUFF_SIZE];
-char* screen_buffer_ptr = screen_buffer;
+#define screen_buffer (zctx->screen_buffer)
+#define screen_buffer_ptr (zctx->screen_buffer_ptr)
 
 /* A cell's style is REVERSE_STYLE, normal (0), or PICTURE_STYLE.
  * PICTURE_STYLE means the character is part of an ascii image outline
@@ -61,26 +58,23 @@ char* screen_buffer_ptr = screen_buffer;
  * the rv bit some company in that huge byte I allocated for it.)  */
 #define PICTURE_STYLE 16
 
-static int current_style = 0;
+#define current_style (zctx->current_style)
 
 /* Which cells have changed (1 byte per cell).  */
-static char *screen_changes;
+#define screen_changes (zctx->screen_changes)
 
-static int cursor_row = 0, cursor_col = 0;
+#define cursor_row (zctx->cursor_row)
+#define cursor_col (zctx->cursor_col)
 
 /* Compression styles.  */
-static enum {
-  COMPRESSION_NONE, COMPRESSION_SPANS, COMPRESSION_MAX,
-} compression_mode = COMPRESSION_SPANS;
+#define compression_mode (zctx->compression_mode)
 static char *compression_names[] = {"NONE", "SPANS", "MAX"};
-static int hide_lines = 0;
+#define hide_lines (zctx->hide_lines)
 
 /* Reverse-video display styles.  */
-static enum {
-  RV_NONE, RV_DOUBLESTRIKE, RV_UNDERLINE, RV_CAPS,
-} rv_mode = RV_NONE;
+#define rv_mode (zctx->rv_mode)
 static char *rv_names[] = {"NONE", "DOUBLESTRIKE", "UNDERLINE", "CAPS"};
-static char rv_blank_char = ' ';
+#define rv_blank_char (zctx->rv_blank_char)
 
 static cell *dumb_row(int r) {return screen_data + r * h_screen_cols;}
 
@@ -566,3 +560,17 @@ void dumb_free(void) {
 	  screen_changes = NULL;
     }
 }
+
+/* Called on a bitwise copy of machine src: allocate our own screen */
+void dumb_clone_output(const zmachine_ctx *src) {
+  cell *src_data = screen_data;
+  char *src_changes = screen_changes;
+
+  screen_data = malloc(screen_cells * sizeof(cell));
+  screen_changes = malloc(screen_cells * sizeof(char));
+  if (screen_data == NULL || screen_changes == NULL)
+    os_fatal("Out of memory");
+  memcpy(screen_data, src_data, screen_cells * sizeof(cell));
+  memcpy(screen_changes, src_changes, screen_cells * sizeof(char));
+  screen_buffer_ptr = REBASE(screen_buffer_ptr, src);
+}
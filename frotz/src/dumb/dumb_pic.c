@@ -21,8 +21,6 @@
 
 #include "dumb_frotz.h"
 
-extern f_setup_t f_setup;
-
 #define PIC_FILE_HEADER_FLAGS 1
 #define PIC_FILE_HEADER_NUM_IMAGES 4
 #define PIC_FILE_HEADER_ENTRY_SIZE 8
@@ -32,14 +30,15 @@ extern f_setup_t f_setup;
 #define PIC_HEADER_WIDTH 2
 #define PIC_HEADER_HEIGHT 4
 
-static struct {
+struct pict_info_struct {
     int z_num;
     int width;
     int height;
     int orig_width;
     int orig_height;
-} *pict_info;
-static int num_pictures = 0;
+};
+#define pict_info (zctx->pict_info)
+#define num_pictures (zctx->num_pictures)
 
 static unsigned char lookupb(unsigned char *p, int n) {return p[n];}
 static unsigned short lookupw(unsigned char *p, int n)
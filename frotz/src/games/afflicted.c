@@ -24,7 +24,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 // Afflicted: http://ifdb.tads.org/viewgame?id=epl4q2933rczoo9x
 
-int score = 0;
+#define score (zctx->afflicted_score)
 
 zword* afflicted_ram_addrs(int *n) {
     *n = 0;
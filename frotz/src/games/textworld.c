@@ -25,11 +25,8 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 // Games generated with TextWorld: https://github.com/Microsoft/TextWorld
 
-int tw_num_world_objs = 0;
-int tw_player_obj_num = 0;
-int move_count = 0;
-int tw_score = 0;
-int tw_max_score = 0;
+#define move_count (zctx->tw_move_count)
+#define tw_score (zctx->tw_score)
 
 // Reverse search a given char in a string.
 char* strchr_rev(char* start, char* end, char c) {
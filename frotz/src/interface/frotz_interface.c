@@ -20,6 +20,8 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
 #include "frotz.h"
 #include "frotz_interface.h"
 #include "games.h"
@@ -41,6 +43,8 @@ extern void load_story(char *s);
 extern void load_story_rom(char *s, void* rom, size_t rom_size);
 extern zword save_quetzal (FILE *, FILE *);
 extern zword restore_quetzal (FILE *, FILE *);
+extern zword save_squetzal (unsigned char *svf, unsigned char *stf);
+extern zword restore_squetzal (unsigned char *svf, unsigned char *stf);
 extern int restore_undo (void);
 extern void split_window (zword);
 extern void erase_window (zword);
@@ -62,38 +66,61 @@ extern zword next_property (zword prop_addr);
 extern void get_text(int, zword, char*);
 extern void free_setup();
 
-extern long getRngA();
-extern int getRngInterval();
-extern int getRngCounter();
-extern void setRng(long, int, int);
-
-zbyte next_opcode;
-int desired_seed = 0;
-int ROM_IDX = 0;
-char world[8192] = "";
-int emulator_halted = 0;
+extern void dumb_init_ctx(void);
+extern void clone_setup(void);
+extern void clone_memory(void);
+extern void dumb_clone_output(const zmachine_ctx *src);
+extern void checkpoint_memory(void);
+extern int rollback_memory(void);
+
+extern long getRngA(zmachine_ctx *ctx);
+extern int getRngInterval(zmachine_ctx *ctx);
+extern int getRngCounter(zmachine_ctx *ctx);
+extern void setRng(zmachine_ctx *ctx, long, int, int);
+
+#define next_opcode (zctx->next_opcode)
+#define desired_seed (zctx->desired_seed)
+#define ROM_IDX (zctx->rom_idx)
 char halted_message[] = "Emulator halted due to runtime error.\n";
+char timed_out_message[] = "Emulator timed out: too many instructions.\n";
 // Track the addresses and values of special per-game ram locations.
-int num_special_addrs = 0;
-zword *special_ram_addrs = NULL;
-zbyte *special_ram_values = NULL;
-int ram_diff_cnt;
-zword ram_diff_addr[16];
-zword ram_diff_value[16];
+#define num_special_addrs (zctx->num_special_addrs)
+#define special_ram_addrs (zctx->special_ram_addrs)
+#define special_ram_values (zctx->special_ram_values)
 
 
-// Runs a single opcode on the Z-Machine
+// Runs a single opcode on the Z-Machine, starting a new step: the
+// instruction budget set by set_max_instructions counts from here.
 void zstep() {
+  zctx->insn_count = 0;
+  zctx->timed_out = FALSE;
   run_opcode(next_opcode);
   next_opcode = get_next_opcode();
 }
 
-// Run the Z-Machine until it requires user input
+// Run the Z-Machine until it requires user input, that is until the next
+// opcode is 228 (z_read) or 246 (z_read_char)
 void run_free() {
-  // Opcode 228 (z_read) and 246 (z_read_char) indicate need for user input
-  while (next_opcode != 228 && next_opcode != 246 && emulator_halted <= 0) {
-    zstep();
+  run_until_input();
+}
+
+// Feeds action to the Z-Machine and runs it until it requires input again.
+// A fatal error (os_fatal) on the way returns here with the machine halted
+// instead of exiting the process; -1 is then returned, 0 otherwise.
+static int run_action(char *action) {
+  jmp_buf fatal;
+  jmp_buf *outer = zctx->fatal_jmp;
+
+  if (setjmp(fatal)) {
+    zctx->fatal_jmp = outer;
+    return -1;
   }
+  zctx->fatal_jmp = &fatal;
+  dumb_set_next_action(action);
+  zstep();
+  run_free();
+  zctx->fatal_jmp = outer;
+  return 0;
 }
 
 void replace_newlines_with_spaces(char *s) {
@@ -310,7 +337,132 @@ void load_rom_bindings(char *story_file) {
   }
 }
 
-void shutdown() {
+// Allocates a new Z-Machine context. Each context is an independent
+// machine: all of the interpreter's state lives inside it.
+zmachine_ctx *create_ctx() {
+  zmachine_ctx *ctx = calloc(1, sizeof(zmachine_ctx));
+  if (ctx == NULL) {
+    return NULL;
+  }
+  zctx = ctx;
+
+  // Defaults that used to be the initializers of the globals
+  story_id = UNKNOWN;
+  h_font_height = 1;
+  h_font_width = 1;
+  h_standard_high = 1;
+  ostream_screen = TRUE;
+  ctx->first_restart = TRUE;
+  ctx->rng_A = 1;
+  ctx->redirect_depth = -1;
+  ctx->font_height = 1;
+  ctx->font_width = 1;
+  ctx->cursor = TRUE;
+  ctx->cwp = ctx->wp;
+  ctx->decode_cache = TRUE;
+  ctx->insn_fusion = TRUE;
+  ctx->object_index = TRUE;
+  ctx->auto_undo = TRUE;
+  dumb_init_ctx();
+  return ctx;
+}
+
+// Creates an independent copy of a machine, e.g. to try several actions
+// from the same state in parallel. The copy starts with an empty undo
+// history. Returns NULL if out of memory.
+zmachine_ctx *clone_ctx(zmachine_ctx *src) {
+  zmachine_ctx *ctx = malloc(sizeof(zmachine_ctx));
+  zbyte *src_values;
+  if (ctx == NULL) {
+    return NULL;
+  }
+  memcpy(ctx, src, sizeof(zmachine_ctx));
+  zctx = ctx;
+
+  // Pointers into the machine itself
+  sp = REBASE(sp, src);
+  fp = REBASE(fp, src);
+  ctx->cwp = REBASE(ctx->cwp, src);
+
+  // Transcripts, command files and blorb resources stay with src
+  ctx->sfp = NULL;
+  ctx->rfp = NULL;
+  ctx->pfp = NULL;
+  ostream_script = FALSE;
+  ostream_record = FALSE;
+  istream_replay = FALSE;
+  ctx->blorb_fp = NULL;
+  ctx->blorb_map = NULL;
+  save_buff = NULL;
+  ctx->workers = NULL;
+  ctx->num_workers = 0;
+  ctx->snap_base = NULL;
+  ctx->undo_stack = NULL;
+  ctx->profile = NULL;
+  ctx->prop_index = NULL;
+  ctx->obj_addrs = NULL;
+  ctx->dict_indexes = NULL;
+  ctx->text_cache = NULL;
+  clone_process();
+
+  clone_setup();
+  clone_memory();
+  init_objects();
+  dumb_clone_output(src);
+  if (num_special_addrs > 0) {
+    src_values = special_ram_values;
+    special_ram_values = (zbyte*) malloc(num_special_addrs * sizeof(zbyte));
+    memcpy(special_ram_values, src_values, num_special_addrs * sizeof(zbyte));
+  }
+  return ctx;
+}
+
+// Exported names like step() and shutdown() also exist in libc, and calls
+// made from within this library may bind to those instead. Code shared
+// between entry points is therefore kept in static helpers.
+static void free_story();
+static void free_workers();
+static char* run_step(char *next_action);
+
+// Releases a context created with create_ctx.
+void free_ctx(zmachine_ctx *ctx) {
+  if (ctx == NULL) {
+    return;
+  }
+  zctx = ctx;
+  free_story();
+  set_profiling(ctx, 0);
+  zctx = NULL;
+  free(ctx);
+}
+
+void shutdown(zmachine_ctx *ctx) {
+  zctx = ctx;
+  free_story();
+}
+
+// Frees the clones made by filter_candidate_actions_parallel.
+static void free_workers() {
+  zmachine_ctx *ctx = zctx;
+  int i;
+
+  for (i=0; i<ctx->num_workers; ++i) {
+    free_ctx(ctx->workers[i]);
+  }
+  free(ctx->workers);
+  ctx->workers = NULL;
+  ctx->num_workers = 0;
+  zctx = ctx;
+}
+
+// Frees the memory held for the loaded story.
+static void free_story() {
+  free_workers();
+  snap_forget(zctx);
+  undo_clear(zctx);
+  reset_process();
+  reset_objects();
+  reset_text();
   reset_memory();
   dumb_free();
   free_setup();
@@ -321,13 +473,12 @@ void shutdown() {
 }
 
 // Save the state of the game into a string buffer
-int save_str(unsigned char *s) {
+int save_str(zmachine_ctx *ctx, unsigned char *s) {
+  zctx = ctx;
   quetzal_success = 0;
   use_squetzal = 1;
   save_buff = s;
-  dumb_set_next_action("save\n");
-  zstep();
-  run_free();
+  run_action("save\n");
   if (!quetzal_success) {
       printf("Error During Save: %s\n", dumb_get_screen());
   }
@@ -337,52 +488,119 @@ int save_str(unsigned char *s) {
 }
 
 // Restore a saved game from a string buffer
-int restore_str(unsigned char *s) {
+int restore_str(zmachine_ctx *ctx, unsigned char *s) {
+  zctx = ctx;
   quetzal_success = 0;
   use_squetzal = 1;
   save_buff = s;
-  dumb_set_next_action("restore\n");
-  zstep();
-  run_free();
+  run_action("restore\n");
   dumb_clear_screen();
   save_buff = NULL;
   return quetzal_success;
 }
 
 // Save the state of the game into a file
-int save(char *filename) {
+int save(zmachine_ctx *ctx, char *filename) {
+  zctx = ctx;
   quetzal_success = 0;
   use_squetzal = 0;
   strcpy(f_setup.save_name, filename);
-  dumb_set_next_action("save\n");
-  zstep();
-  run_free();
+  run_action("save\n");
   dumb_clear_screen();
   return quetzal_success;
 }
 
 // Restore a saved file
-int restore(char *filename) {
+int restore(zmachine_ctx *ctx, char *filename) {
+  zctx = ctx;
   quetzal_success = 0;
   use_squetzal = 0;
   strcpy(f_setup.save_name, filename);
-  dumb_set_next_action("restore\n");
-  zstep();
-  run_free();
+  run_action("restore\n");
   dumb_clear_screen();
   return quetzal_success;
 }
 
-int getRAMSize() {
+// Returns an upper bound on the size of the save written by quetzal_export.
+int quetzal_bound(zmachine_ctx *ctx) {
+  zctx = ctx;
+  // The FORM header and IFhd chunk, then CMem, which takes at most 3 bytes
+  // for every 2 bytes of memory, then Stks, which holds at most the whole
+  // stack and a header for every frame of at least 4 words.
+  return 12 + 22 + 8 + (h_dynamic_size * 3 + 1) / 2 + 2
+    + 8 + STACK_SIZE * sizeof(zword) + (STACK_SIZE / 4 + 1) * 8;
+}
+
+// Returns the size of the Quetzal save in buf, from its FORM header.
+static long quetzal_length(unsigned char *buf) {
+  return 8 + (((long) buf[4] << 24) | (buf[5] << 16) | (buf[6] << 8) | buf[7]);
+}
+
+// Writes the machine's state into buf as a Quetzal save, without running
+// any game code. Unlike saves made by the game, which resume after its
+// save instruction, these resume at the instruction the machine is about
+// to run, and can only be restored with quetzal_import. Returns the number
+// of bytes written, or -1 if size is smaller than quetzal_bound().
+int quetzal_export(zmachine_ctx *ctx, unsigned char *buf, int size) {
+  long pc;
+  int success;
+
+  zctx = ctx;
+  if (size < quetzal_bound(ctx)) {
+    return -1;
+  }
+  // The opcode of the next instruction is already fetched
+  GET_PC(pc);
+  SET_PC(pc - 1);
+  success = save_squetzal(buf, zctx->stf_buff);
+  SET_PC(pc);
+  return success ? quetzal_length(buf) : -1;
+}
+
+// Restores the machine's state from a Quetzal save of size bytes written
+// by quetzal_export, without running any game code. Returns 0 on success,
+// or -1 if the save is invalid or not one of this story, in which case the
+// machine is left as it was.
+int quetzal_import(zmachine_ctx *ctx, unsigned char *buf, int size) {
+  unsigned char *state;
+  int state_len;
+  zword success;
+
+  zctx = ctx;
+  if (size < 12 || quetzal_length(buf) > size) {
+    return -1;
+  }
+  state_len = state_size(ctx);
+  if ((state = malloc(state_len)) == NULL) {
+    return -1;
+  }
+  state_pack(ctx, state);
+  success = restore_squetzal(buf, zctx->stf_buff);
+  if (success != 2) {
+    state_unpack(ctx, state, state_len);
+    free(state);
+    return -1;
+  }
+  free(state);
+  zctx->all_dirty = DIRTY_BOTH;
+  next_opcode = get_next_opcode();
+  return 0;
+}
+
+int getRAMSize(zmachine_ctx *ctx) {
+  zctx = ctx;
   return h_dynamic_size;
 }
 
-void getRAM(unsigned char *ram) {
+void getRAM(zmachine_ctx *ctx, unsigned char *ram) {
+  zctx = ctx;
   memcpy(ram, zmp, h_dynamic_size);
 }
 
-void setRAM(unsigned char *ram) {
+void setRAM(zmachine_ctx *ctx, unsigned char *ram) {
+  zctx = ctx;
   memcpy(zmp, ram, h_dynamic_size);
+  zctx->all_dirty = DIRTY_BOTH;
 }
 
 int zmp_diff(int addr) {
@@ -402,63 +620,185 @@ int zmp_diff_range(int start, int end) {
   return 0;
 }
 
-int getPC() {
+int getPC(zmachine_ctx *ctx) {
+  zctx = ctx;
   return pcp - zmp;
 }
 
-void setPC(int v) {
+void setPC(zmachine_ctx *ctx, int v) {
+  zctx = ctx;
   pcp = zmp + v;
 }
 
-int getSP() {
+int getSP(zmachine_ctx *ctx) {
+  zctx = ctx;
   return sp - stack;
 }
 
-void setSP(int v) {
+void setSP(zmachine_ctx *ctx, int v) {
+  zctx = ctx;
   sp = stack + v;
 }
 
-int getFP() {
+int getFP(zmachine_ctx *ctx) {
+  zctx = ctx;
   return fp - stack;
 }
 
-void setFP(int v) {
+void setFP(zmachine_ctx *ctx, int v) {
+  zctx = ctx;
   fp = stack + v;
 }
 
-int get_opcode() {
+int get_opcode(zmachine_ctx *ctx) {
+  zctx = ctx;
   return next_opcode;
 }
 
-int set_opcode(int opcode) {
+int set_opcode(zmachine_ctx *ctx, int opcode) {
+  zctx = ctx;
   next_opcode = opcode;
 }
 
-int getFrameCount() {
+int getFrameCount(zmachine_ctx *ctx) {
+  zctx = ctx;
   return frame_count;
 }
 
-void setFrameCount(int count) {
+void setFrameCount(zmachine_ctx *ctx, int count) {
+  zctx = ctx;
   frame_count = count;
 }
 
-int getStackSize() {
+int getStackSize(zmachine_ctx *ctx) {
+  zctx = ctx;
   return STACK_SIZE*sizeof(zword);
 }
 
-void getStack(unsigned char *s) {
+void getStack(zmachine_ctx *ctx, unsigned char *s) {
+  zctx = ctx;
   memcpy(s, stack, STACK_SIZE*sizeof(zword));
 }
 
-void setStack(unsigned char *s) {
+void setStack(zmachine_ctx *ctx, unsigned char *s) {
+  zctx = ctx;
   memcpy(stack, s, STACK_SIZE*sizeof(zword));
 }
 
-void getZArgs(unsigned char *s) {
+// Returns the size in bytes of the live part of the stack, from sp to the bottom.
+int getLiveStackSize(zmachine_ctx *ctx) {
+  zctx = ctx;
+  return (stack + STACK_SIZE - sp) * sizeof(zword);
+}
+
+void getLiveStack(zmachine_ctx *ctx, unsigned char *s) {
+  zctx = ctx;
+  memcpy(s, sp, (stack + STACK_SIZE - sp) * sizeof(zword));
+}
+
+// Sets the live part of the stack. sp is moved to match its size.
+void setLiveStack(zmachine_ctx *ctx, unsigned char *s, int size) {
+  zctx = ctx;
+  sp = stack + STACK_SIZE - size / sizeof(zword);
+  memcpy(sp, s, size);
+}
+
+// Turns running from pre-decoded instructions on or off. Takes effect
+// from the next story loaded into the machine.
+void set_decode_cache(zmachine_ctx *ctx, int enabled) {
+  zctx = ctx;
+  ctx->decode_cache = enabled;
+}
+
+// Turns the fusion of frequent pairs of pre-decoded instructions, run as
+// one, on or off. Takes effect from the next story loaded into the machine.
+void set_insn_fusion(zmachine_ctx *ctx, int enabled) {
+  zctx = ctx;
+  ctx->insn_fusion = enabled;
+}
+
+// Turns the table of object addresses and the index of property lookups
+// on or off. Takes effect from the next story loaded into the machine.
+void set_object_index(zmachine_ctx *ctx, int enabled) {
+  zctx = ctx;
+  ctx->object_index = enabled;
+}
+
+// Sets whether V1-V4 games save an undo state before reading each line of
+// input, as the standard interpreters do. Only the undo hotkey uses these
+// states, so turning this off saves a memory diff per turn. Undo then only
+// reaches back to the last turn played with it on.
+void set_auto_undo(zmachine_ctx *ctx, int enabled) {
+  zctx = ctx;
+  ctx->auto_undo = enabled;
+}
+
+// Sets whether filter_candidate_actions runs the candidates headless, their
+// text going straight to the observation without the screen model. Only
+// the text is used to tell valid actions apart, so the results are the same.
+void set_headless_probing(zmachine_ctx *ctx, int enabled) {
+  zctx = ctx;
+  ctx->headless_probing = enabled;
+}
+
+// Limits the instructions a step may run (0 for no limit). A step going
+// over is aborted: the machine returns to its state before the step and
+// timed_out is set. With a limit, each step sets the checkpoint it may
+// return to, replacing any checkpoint already set.
+void set_max_instructions(zmachine_ctx *ctx, long max) {
+  zctx = ctx;
+  zctx->max_instructions = max;
+}
+
+// Returns whether the last step ran out of instructions.
+int timed_out(zmachine_ctx *ctx) {
+  zctx = ctx;
+  return zctx->timed_out;
+}
+
+// Lets a halted machine run again, once its state is restored. The halt
+// may have cut an instruction short, so the text it left buffered or
+// redirected to memory is dropped.
+static void clear_halt() {
+  emulator_halted = 0;
+  zctx->finished = 0;
+  init_buffer();
+  reset_redirect();
+}
+
+// Remember the current state of the machine (memory, stack, PC, rng)
+// so that restore_checkpoint can return to it.
+void set_checkpoint(zmachine_ctx *ctx) {
+  zctx = ctx;
+  checkpoint_memory();
+  zctx->checkpoint_opcode = next_opcode;
+  zctx->checkpoint_rng_A = getRngA(ctx);
+  zctx->checkpoint_rng_interval = getRngInterval(ctx);
+  zctx->checkpoint_rng_counter = getRngCounter(ctx);
+}
+
+// Return to the state saved by set_checkpoint. Only the pages of dynamic
+// memory written since are copied back. Returns the number of pages
+// copied, or -1 if no checkpoint was set.
+int restore_checkpoint(zmachine_ctx *ctx) {
+  int pages;
+
+  zctx = ctx;
+  if ((pages = rollback_memory()) < 0)
+    return pages;
+  next_opcode = zctx->checkpoint_opcode;
+  setRng(ctx, zctx->checkpoint_rng_A, zctx->checkpoint_rng_interval,
+         zctx->checkpoint_rng_counter);
+  return pages;
+}
+
+void getZArgs(zmachine_ctx *ctx, unsigned char *s) {
+  zctx = ctx;
   memcpy(s, zargs, 8*sizeof(zword));
 }
 
-void setZArgs(unsigned char *s) {
+void setZArgs(zmachine_ctx *ctx, unsigned char *s) {
+  zctx = ctx;
   memcpy(zargs, s, 8*sizeof(zword));
 }
 
@@ -1351,35 +1691,43 @@ char* clean_observation(char* obs) {
   return (*clean_observation_fns[ROM_IDX])(obs);
 }
 
-short get_score() {
+short get_score(zmachine_ctx *ctx) {
+  zctx = ctx;
   return (*get_score_fns[ROM_IDX])();
 }
 
-int get_max_score() {
+int get_max_score(zmachine_ctx *ctx) {
+  zctx = ctx;
   return (*max_score_fns[ROM_IDX])();
 }
 
-int get_moves() {
+int get_moves(zmachine_ctx *ctx) {
+  zctx = ctx;
   return (*get_moves_fns[ROM_IDX])();
 }
 
-int get_self_object_num() {
+int get_self_object_num(zmachine_ctx *ctx) {
+  zctx = ctx;
   return (*get_self_object_num_fns[ROM_IDX])();
 }
 
-int get_num_world_objs() {
+int get_num_world_objs(zmachine_ctx *ctx) {
+  zctx = ctx;
   return (*get_num_world_objs_fns[ROM_IDX])();
 }
 
-int game_over() {
+int game_over(zmachine_ctx *ctx) {
+  zctx = ctx;
   return emulator_halted > 0 || (*game_over_fns[ROM_IDX])();
 }
 
-int victory() {
+int victory(zmachine_ctx *ctx) {
+  zctx = ctx;
   return (*victory_fns[ROM_IDX])();
 }
 
-int halted() {
+int halted(zmachine_ctx *ctx) {
+  zctx = ctx;
   return emulator_halted;
 }
 
@@ -1399,7 +1747,8 @@ void clean_world_objs(zobject* objs) {
   return (*clean_world_objs_fns[ROM_IDX])(objs);
 }
 
-int is_supported(char *story_file) {
+int is_supported(zmachine_ctx *ctx, char *story_file) {
+  zctx = ctx;
   load_rom_bindings(story_file);
   return ROM_IDX != DEFAULT_;
 }
@@ -1413,20 +1762,20 @@ void take_intro_actions() {
   if (num_actions <= 0 || intro_actions == NULL)
     return;
   for (i=0; i<num_actions; ++i) {
-    dumb_set_next_action(intro_actions[i]);
-    zstep();
-    run_free();
+    run_action(intro_actions[i]);
   }
 }
 
 // Returns the number of special ram addresses
-int get_special_ram_size() {
+int get_special_ram_size(zmachine_ctx *ctx) {
+  zctx = ctx;
   return num_special_addrs;
 }
 
 // Returns the current values of the special ram addresses
-void get_special_ram(unsigned char *ram) {
+void get_special_ram(zmachine_ctx *ctx, unsigned char *ram) {
   int i;
+  zctx = ctx;
   for (i=0; i<num_special_addrs; ++i) {
     ram[i] = zmp[special_ram_addrs[i]];
   }
@@ -1468,9 +1817,19 @@ void update_ram_diff() {
   }
 }
 
-char* setup(char *story_file, int seed, void *rom, size_t rom_size) {
+char* setup(zmachine_ctx *ctx, char *story_file, int seed, void *rom, size_t rom_size) {
   char* text;
+  jmp_buf fatal;
+  zctx = ctx;
+  free_workers();
   emulator_halted = 0;
+
+  // A story that cannot be loaded leaves the machine halted
+  if (setjmp(fatal)) {
+    zctx->fatal_jmp = NULL;
+    return halted_message;
+  }
+  zctx->fatal_jmp = &fatal;
   os_init_setup();
   desired_seed = seed;
   set_random_seed(desired_seed);
@@ -1484,6 +1843,8 @@ char* setup(char *story_file, int seed, void *rom, size_t rom_size) {
   init_err();
   init_memory();
   init_process();
+  init_objects();
+  reset_text();
   init_sound();
   os_init_screen();
   init_undo();
@@ -1527,15 +1888,27 @@ char* setup(char *story_file, int seed, void *rom, size_t rom_size) {
   text = clean_observation(text);
   strcpy(world, text);
   dumb_clear_screen();
+  zctx->fatal_jmp = NULL;
   return world;
 }
 
-char* step(char *next_action) {
+char* step(zmachine_ctx *ctx, char *next_action) {
+  zctx = ctx;
+  return run_step(next_action);
+}
+
+// Runs one action on the current machine, see step().
+static char* run_step(char *next_action) {
   char* text;
 
   if (emulator_halted > 0)
     return halted_message;
 
+  // With an instruction budget, checkpoint the state to return to on a
+  // timeout: rolling back only copies the pages the step wrote
+  if (zctx->max_instructions > 0)
+    set_checkpoint(zctx);
+
   // Clear the object, attr, and ram diffs
   move_diff_cnt = 0;
   attr_diff_cnt = 0;
@@ -1543,10 +1916,19 @@ char* step(char *next_action) {
   ram_diff_cnt = 0;
   update_special_ram();
 
-  dumb_set_next_action(next_action);
+  if (run_action(next_action) < 0) {
+    return halted_message;
+  }
 
-  zstep();
-  run_free();
+  if (zctx->timed_out) {
+    clear_halt();
+    restore_checkpoint(zctx);
+    move_diff_cnt = 0;
+    attr_diff_cnt = 0;
+    attr_clr_cnt = 0;
+    dumb_clear_screen();
+    return timed_out_message;
+  }
 
   // Check for changes to special ram
   update_ram_diff();
@@ -1557,19 +1939,22 @@ char* step(char *next_action) {
   return world;
 }
 
-char* get_narrative_text() {
+char* get_narrative_text(zmachine_ctx *ctx) {
+  zctx = ctx;
   return world;
 }
 
-void set_narrative_text(char* text) {
+void set_narrative_text(zmachine_ctx *ctx, char* text) {
+  zctx = ctx;
   strcpy(world, text);
 }
 
 // Returns a world diff that ignores selected objects
 // objs and dest are a 64-length pre-zeroed arrays.
-void get_cleaned_world_diff(zword *objs, zword *dest) {
+void get_cleaned_world_diff(zmachine_ctx *ctx, zword *objs, zword *dest) {
   int i;
   int j = 0;
+  zctx = ctx;
   for (i=0; i<move_diff_cnt; ++i) {
     if (ignore_moved_obj(move_diff_objs[i], move_diff_dest[i])) {
       continue;
@@ -1605,8 +1990,9 @@ void get_cleaned_world_diff(zword *objs, zword *dest) {
 }
 
 // Returns 1 if the last action changed the state of the world.
-int world_changed() {
+int world_changed(zmachine_ctx *ctx) {
   int i;
+  zctx = ctx;
   for (i=0; i<move_diff_cnt; ++i) {
     if (ignore_moved_obj(move_diff_objs[i], move_diff_dest[i])) {
       continue;
@@ -1631,12 +2017,44 @@ int world_changed() {
   return 0;
 }
 
-void get_object(zobject *obj, zword obj_num) {
+// Steps n independent machines in one call: ctxs[i] runs actions[i].
+// Results are written to caller-provided arrays of n entries. obs holds n
+// consecutive observations of obs_size bytes each, null terminated and
+// truncated if needed. dones is set when the game is over or won, and
+// changed when the action changed the state of the world.
+void step_batch(zmachine_ctx **ctxs, char **actions, int n, char *obs, int obs_size,
+                int *rewards, int *scores, int *moves, int *dones, int *changed) {
+  int i;
+  size_t len;
+  char *text;
+  short old_score;
+
+  for (i=0; i<n; ++i) {
+    old_score = get_score(ctxs[i]);
+    zctx = ctxs[i];
+    text = run_step(actions[i]);
+
+    len = strlen(text);
+    if (len >= (size_t) obs_size)
+      len = obs_size - 1;
+    memcpy(&obs[i*obs_size], text, len);
+    obs[i*obs_size + len] = '\0';
+
+    scores[i] = get_score(ctxs[i]);
+    rewards[i] = scores[i] - old_score;
+    moves[i] = get_moves(ctxs[i]);
+    dones[i] = game_over(ctxs[i]) || victory(ctxs[i]);
+    changed[i] = world_changed(ctxs[i]);
+  }
+}
+
+void get_object(zmachine_ctx *ctx, zobject *obj, zword obj_num) {
   int i;
   zbyte prop_value;
   zbyte mask;
+  zctx = ctx;
 
-  if (obj_num < 1 || obj_num > get_num_world_objs()) {
+  if (obj_num < 1 || obj_num > get_num_world_objs(zctx)) {
     return;
   }
 
@@ -1675,10 +2093,11 @@ void get_object(zobject *obj, zword obj_num) {
   }
 }
 
-void get_world_objects(zobject *objs, int clean) {
+void get_world_objects(zmachine_ctx *ctx, zobject *objs, int clean) {
   int i;
-  for (i=1; i<=get_num_world_objs(); ++i) {
-    get_object(&objs[i], (zword) i);
+  zctx = ctx;
+  for (i=1; i<=get_num_world_objs(zctx); ++i) {
+    get_object(zctx, &objs[i], (zword) i);
   }
   if (clean > 0) {
     clean_world_objs(objs);
@@ -1686,18 +2105,21 @@ void get_world_objects(zobject *objs, int clean) {
 }
 
 // Teleports an object (and all children) to the desired destination
-void teleport_obj(zword obj, zword dest) {
+void teleport_obj(zmachine_ctx *ctx, zword obj, zword dest) {
+  zctx = ctx;
   insert_obj(obj, dest);
 }
 
 // Teleports an object (and all siblings + children + children of
 // siblings) to the last child of desired destination
-void teleport_tree(zword obj, zword dest) {
+void teleport_tree(zmachine_ctx *ctx, zword obj, zword dest) {
+  zctx = ctx;
   insert_tree(obj, dest);
 }
 
-void test() {
+void test(zmachine_ctx *ctx) {
   int i;
+  zctx = ctx;
   for (i=0; i<move_diff_cnt; ++i) {
     printf("Move Diff %d: %d --> %d\n", i, move_diff_objs[i], move_diff_dest[i]);
   }
@@ -1709,47 +2131,80 @@ void test() {
   }
 }
 
+// Runs act, a newline terminated action, on the current machine. Returns 1
+// if the action changed the world, 0 if it did not and -1 if it halted the
+// emulator. The world diff of a valid action is written to diff, a
+// 128-length pre-zeroed array.
+static int try_action(char *act, short orig_score, zword *diff) {
+  char *text;
+  int result;
+
+  move_diff_cnt = 0;
+  attr_diff_cnt = 0;
+  attr_clr_cnt = 0;
+  ram_diff_cnt = 0;
+  update_special_ram();
+  // V6 games may run newline interrupts, which need the screen model
+  zctx->headless = zctx->headless_probing && h_version != V6;
+  result = run_action(act);
+  zctx->headless = FALSE;
+  if (result < 0) {
+    return -1;
+  }
+  update_ram_diff();
+  text = dumb_get_screen();
+  text = clean_observation(text);
+  strcpy(world, text);
+  dumb_clear_screen();
+
+  // A timed out action is not valid; the caller restores the state
+  if (zctx->timed_out) {
+    clear_halt();
+    return 0;
+  }
+
+  if (emulator_halted > 0) {
+    return -1;
+  }
+
+  if (get_score(zctx) != orig_score || game_over(zctx) > 0 || victory(zctx) > 0 || world_changed(zctx) > 0) {
+    // Ignore actions with side-effect of taking items
+    if (strstr(text, "(Taken)") == NULL) {
+      get_cleaned_world_diff(zctx, diff, diff + 64);
+      return 1;
+    }
+  }
+  return 0;
+}
+
 // Given a list of action candidates, find the ones that lead to valid world changes.
 // candidate_actions contains a string with all the candidate actions, seperated by ';'
 // valid_actions will be written with each of the identified valid actions seperated by ';'
 // diff_array will be written with the world_diff for each valid_action indicating
 // which of the valid actions are equivalent to each other in terms of their world diffs.
-// Returns the number of valid actions found.
-int filter_candidate_actions(char *candidate_actions, char *valid_actions, zword *diff_array) {
+// Returns the number of valid actions found. An action that halts the
+// emulator is reported and skipped. The state is saved and restored with
+// set_checkpoint/restore_checkpoint, replacing any checkpoint already set.
+int filter_candidate_actions(zmachine_ctx *ctx, char *candidate_actions, char *valid_actions, zword *diff_array) {
+  zctx = ctx;
   char *act = NULL;
+  char *act_save = NULL;
   char *act_newline = NULL;
-  char *text;
   short orig_score;
   int valid_cnt = 0;
   int v_idx = 0;
+  int result;
 
-  // Variables used to store & reset game state
-  unsigned char ram_cpy[h_dynamic_size];
-  unsigned char stack_cpy[STACK_SIZE*sizeof(zword)];
-  int pc_cpy;
-  int sp_cpy;
-  int fp_cpy;
-  int next_opcode_cpy;
-  int frame_count_cpy;
-  long rngA_cpy;
-  int rngInterval_cpy;
-  int rngCounter_cpy;
+  if (emulator_halted > 0) {
+    return 0;
+  }
 
   // Save the game state
-  getRAM(ram_cpy);
-  getStack(stack_cpy);
-  pc_cpy = getPC();
-  sp_cpy = getSP();
-  fp_cpy = getFP();
-  next_opcode_cpy = get_opcode();
-  frame_count_cpy = getFrameCount();
-  rngA_cpy = getRngA();
-  rngInterval_cpy = getRngInterval();
-  rngCounter_cpy = getRngCounter();
-
-  orig_score = get_score();
-
-  act = strtok(candidate_actions, ";");
+  set_checkpoint(zctx);
+
+  orig_score = get_score(zctx);
+
+  act = strtok_r(candidate_actions, ";", &act_save);
   while (act != NULL)
   {
     // Add a newline and termination to act
@@ -1757,52 +2212,219 @@ int filter_candidate_actions(char *candidate_actions, char *valid_actions, zword
     strcpy(act_newline, act);
     strcat(act_newline, "\n");
 
-    // Step: Code is copied due to inexplicable segfault when calling step() directly; Ugh!
-    move_diff_cnt = 0;
-    attr_diff_cnt = 0;
-    attr_clr_cnt = 0;
-    ram_diff_cnt = 0;
-    update_special_ram();
-    dumb_set_next_action(act_newline);
-    zstep();
-    run_free();
-    update_ram_diff();
-    text = dumb_get_screen();
-    text = clean_observation(text);
-    strcpy(world, text);
-    dumb_clear_screen();
+    result = try_action(act_newline, orig_score, &diff_array[128*valid_cnt]);
+    free(act_newline);
 
-    if (emulator_halted > 0) {
+    if (result < 0) {
       printf("Emulator halted on action: %s\n", act);
-      return valid_cnt;
+      clear_halt();
     }
+    else if (result > 0) {
+      // Copy the valid action into the output array
+      strcpy(&valid_actions[v_idx], act);
+      v_idx += strlen(act);
+      valid_actions[v_idx++] = ';';
+      valid_cnt++;
+    }
+
+    // Restore the game state
+    restore_checkpoint(zctx);
+
+    act = strtok_r(NULL, ";", &act_save);
+  }
+  return valid_cnt;
+}
+
+// Work shared by the threads of filter_candidate_actions_parallel
+typedef struct {
+  // State every action starts from
+  unsigned char *ram_cpy;
+  unsigned char *stack_cpy;  // Live part of the stack only
+  int stack_size_cpy;
+  int pc_cpy;
+  int sp_cpy;
+  int fp_cpy;
+  int next_opcode_cpy;
+  int frame_count_cpy;
+  long rngA_cpy;
+  int rngInterval_cpy;
+  int rngCounter_cpy;
+
+  // Settings of the machine, which its clones may not have yet
+  long max_instructions;
+  bool auto_undo;
+  bool headless_probing;
+
+  char **actions;        // Newline terminated actions
+  int num_actions;
+  int next;              // Index of the next action to try
+  short orig_score;
+  int *results;          // Result of try_action for each action
+  zword *diffs;          // World diff of each action, 128 entries apiece
+} filter_work;
+
+typedef struct {
+  filter_work *work;
+  zmachine_ctx *machine;
+} filter_worker;
+
+static void *run_filter_worker(void *arg) {
+  filter_worker *worker = (filter_worker*) arg;
+  filter_work *work = worker->work;
+  int i;
+
+  int started = 0;
+
+  worker->machine->max_instructions = work->max_instructions;
+  worker->machine->auto_undo = work->auto_undo;
+  worker->machine->headless_probing = work->headless_probing;
+  while ((i = __sync_fetch_and_add(&work->next, 1)) < work->num_actions) {
+    if (!started) {
+      // Load the saved state once, then only roll back what each action writes
+      setRng(worker->machine, work->rngA_cpy, work->rngInterval_cpy, work->rngCounter_cpy);
+      setRAM(worker->machine, work->ram_cpy);
+      setLiveStack(worker->machine, work->stack_cpy, work->stack_size_cpy);
+      setPC(worker->machine, work->pc_cpy);
+      setSP(worker->machine, work->sp_cpy);
+      setFP(worker->machine, work->fp_cpy);
+      set_opcode(worker->machine, work->next_opcode_cpy);
+      setFrameCount(worker->machine, work->frame_count_cpy);
+      set_checkpoint(worker->machine);
+      started = 1;
+    } else {
+      restore_checkpoint(worker->machine);
+    }
+    work->results[i] = try_action(work->actions[i], work->orig_score, &work->diffs[128*i]);
+    if (work->results[i] < 0) {
+      // The machine is halted, possibly mid-instruction: reload it in full
+      clear_halt();
+      started = 0;
+    }
+  }
+  return NULL;
+}
+
+// Same as filter_candidate_actions, but the candidates are split among
+// num_workers threads (one per core if num_workers <= 0). Each thread tries
+// its actions on its own clone of the machine, kept in ctx between calls,
+// restoring the saved state before every action. The machine itself is
+// left untouched. An action that halts the emulator is reported and skipped.
+int filter_candidate_actions_parallel(zmachine_ctx *ctx, char *candidate_actions, char *valid_actions,
+                                      zword *diff_array, int num_workers) {
+  char *act = NULL;
+  char *act_save = NULL;
+  char **acts = NULL;
+  int num_acts = 0;
+  int valid_cnt = 0;
+  int v_idx = 0;
+  int i;
+  filter_work work;
+  filter_worker *workers;
+  pthread_t *threads;
+  zmachine_ctx **machines;
+
+  zctx = ctx;
+  if (emulator_halted > 0) {
+    return 0;
+  }
+
+  // Split the candidates, adding a newline to each of them
+  acts = malloc((strlen(candidate_actions) / 2 + 1) * sizeof(char*));
+  act = strtok_r(candidate_actions, ";", &act_save);
+  while (act != NULL) {
+    acts[num_acts] = malloc(strlen(act) + 2);
+    strcpy(acts[num_acts], act);
+    strcat(acts[num_acts], "\n");
+    num_acts++;
+    act = strtok_r(NULL, ";", &act_save);
+  }
+
+  if (num_workers <= 0) {
+    num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (num_workers > num_acts) {
+    num_workers = num_acts;
+  }
 
-    if (get_score() != orig_score || game_over() > 0 || victory() > 0 || world_changed() > 0) {
-      // Ignore actions with side-effect of taking items
-      if (strstr(text, "(Taken)") == NULL) {
-        // Copy the valid action into the output array
-        strcpy(&valid_actions[v_idx], act);
-        v_idx += strlen(act);
-        valid_actions[v_idx++] = ';';
-
-        // Write the world diff resulting from the last action.
-        get_cleaned_world_diff(&diff_array[128*valid_cnt], &diff_array[(128*valid_cnt) + 64]);
-        valid_cnt++;
+  // Clone the machine for any worker we don't have yet
+  if (num_workers > ctx->num_workers) {
+    machines = realloc(ctx->workers, num_workers * sizeof(zmachine_ctx*));
+    if (machines == NULL) {
+      os_fatal("Out of memory");
+    }
+    ctx->workers = machines;
+    while (ctx->num_workers < num_workers) {
+      if ((machines[ctx->num_workers] = clone_ctx(ctx)) == NULL) {
+        os_fatal("Out of memory");
       }
+      ctx->num_workers++;
     }
+    zctx = ctx;
+  }
 
-    // Restore the game state
-    setRng(rngA_cpy, rngInterval_cpy, rngCounter_cpy);
-    setRAM(ram_cpy);
-    setStack(stack_cpy);
-    setPC(pc_cpy);
-    setSP(sp_cpy);
-    setFP(fp_cpy);
-    set_opcode(next_opcode_cpy);
-    setFrameCount(frame_count_cpy);
-
-    act = strtok(NULL, ";");
-    free(act_newline);
+  work.ram_cpy = malloc(h_dynamic_size);
+  work.stack_size_cpy = getLiveStackSize(ctx);
+  work.stack_cpy = malloc(work.stack_size_cpy + 1);
+  getRAM(ctx, work.ram_cpy);
+  getLiveStack(ctx, work.stack_cpy);
+  work.pc_cpy = getPC(ctx);
+  work.sp_cpy = getSP(ctx);
+  work.fp_cpy = getFP(ctx);
+  work.next_opcode_cpy = get_opcode(ctx);
+  work.frame_count_cpy = getFrameCount(ctx);
+  work.rngA_cpy = getRngA(ctx);
+  work.rngInterval_cpy = getRngInterval(ctx);
+  work.rngCounter_cpy = getRngCounter(ctx);
+  work.max_instructions = ctx->max_instructions;
+  work.auto_undo = ctx->auto_undo;
+  work.headless_probing = ctx->headless_probing;
+  work.actions = acts;
+  work.num_actions = num_acts;
+  work.next = 0;
+  work.orig_score = get_score(ctx);
+  work.results = calloc(num_acts, sizeof(int));
+  work.diffs = calloc(128 * num_acts, sizeof(zword));
+  workers = malloc(num_workers * sizeof(filter_worker));
+  threads = malloc(num_workers * sizeof(pthread_t));
+
+  // The calling thread is the first worker
+  for (i=0; i<num_workers; ++i) {
+    workers[i].work = &work;
+    workers[i].machine = ctx->workers[i];
+  }
+  for (i=1; i<num_workers; ++i) {
+    pthread_create(&threads[i], NULL, run_filter_worker, &workers[i]);
+  }
+  if (num_workers > 0) {
+    run_filter_worker(&workers[0]);
   }
+  for (i=1; i<num_workers; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  zctx = ctx;
+
+  // Merge the results, in the order of the candidates
+  for (i=0; i<num_acts; ++i) {
+    acts[i][strlen(acts[i]) - 1] = '\0';
+    if (work.results[i] < 0) {
+      printf("Emulator halted on action: %s\n", acts[i]);
+    }
+    else if (work.results[i] > 0) {
+      strcpy(&valid_actions[v_idx], acts[i]);
+      v_idx += strlen(acts[i]);
+      valid_actions[v_idx++] = ';';
+      memcpy(&diff_array[128*valid_cnt], &work.diffs[128*i], 128 * sizeof(zword));
+      valid_cnt++;
+    }
+    free(acts[i]);
+  }
+
+  free(acts);
+  free(work.ram_cpy);
+  free(work.stack_cpy);
+  free(work.results);
+  free(work.diffs);
+  free(workers);
+  free(threads);
   return valid_cnt;
 }
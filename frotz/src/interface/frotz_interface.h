@@ -30,30 +30,123 @@ typedef struct {
   unsigned char properties[16];
 } zobject;
 
-extern char* setup(char *story_file, int seed, void* rom, size_t rom_size);
+extern char* setup(zmachine_ctx *ctx, char *story_file, int seed, void* rom, size_t rom_size);
 
-extern void shutdown();
+extern void shutdown(zmachine_ctx *ctx);
 
-extern char* step(char *next_action);
+extern char* step(zmachine_ctx *ctx, char *next_action);
 
-extern int save(char *filename);
+extern void step_batch(zmachine_ctx **ctxs, char **actions, int n, char *obs, int obs_size,
+                       int *rewards, int *scores, int *moves, int *dones, int *changed);
 
-extern int restore(char *filename);
+extern int save(zmachine_ctx *ctx, char *filename);
 
-extern int undo();
+extern int restore(zmachine_ctx *ctx, char *filename);
 
-extern int getRAMSize();
+extern int quetzal_bound(zmachine_ctx *ctx);
 
-extern void getRAM(unsigned char *ram);
+extern int quetzal_export(zmachine_ctx *ctx, unsigned char *buf, int size);
 
-int filter_candidate_actions(char *candidate_actions, char *valid_actions, zword *diff_array);
+extern int quetzal_import(zmachine_ctx *ctx, unsigned char *buf, int size);
 
-extern char world[8192];
+extern int getRAMSize(zmachine_ctx *ctx);
 
-extern int tw_max_score;
+extern void getRAM(zmachine_ctx *ctx, unsigned char *ram);
 
-extern int tw_player_obj_num;
+extern void set_decode_cache(zmachine_ctx *ctx, int enabled);
 
-extern int tw_num_world_objs;
+extern void set_insn_fusion(zmachine_ctx *ctx, int enabled);
+
+extern void set_object_index(zmachine_ctx *ctx, int enabled);
+
+extern void set_auto_undo(zmachine_ctx *ctx, int enabled);
+
+extern void set_headless_probing(zmachine_ctx *ctx, int enabled);
+
+extern void set_max_instructions(zmachine_ctx *ctx, long max);
+
+extern int timed_out(zmachine_ctx *ctx);
+
+extern void set_profiling(zmachine_ctx *ctx, int mode);
+
+extern long long get_profile_opcodes(zmachine_ctx *ctx, unsigned long long *counts, unsigned long long *cycles);
+
+extern int get_profile_routines(zmachine_ctx *ctx, long *addrs, unsigned long long *calls,
+                                unsigned long long *instructions, int max);
+
+extern int getLiveStackSize(zmachine_ctx *ctx);
+
+extern void getLiveStack(zmachine_ctx *ctx, unsigned char *s);
+
+extern void setLiveStack(zmachine_ctx *ctx, unsigned char *s, int size);
+
+extern void set_checkpoint(zmachine_ctx *ctx);
+
+extern int restore_checkpoint(zmachine_ctx *ctx);
+
+typedef struct snapshot snapshot_t;
+
+extern snapshot_t *snap_take(zmachine_ctx *ctx);
+
+extern int snap_restore(zmachine_ctx *ctx, snapshot_t *snap);
+
+extern void snap_free(snapshot_t *snap);
+
+extern long snap_private_size(snapshot_t *snap);
+
+extern void snap_forget(zmachine_ctx *ctx);
+
+extern void set_undo_limits(zmachine_ctx *ctx, int max_depth, long max_bytes);
+
+extern int undo_push(zmachine_ctx *ctx);
+
+extern int undo_pop(zmachine_ctx *ctx, int count);
+
+extern int undo_depth(zmachine_ctx *ctx);
+
+extern long undo_memory_size(zmachine_ctx *ctx);
+
+extern void undo_clear(zmachine_ctx *ctx);
+
+extern int state_size(zmachine_ctx *ctx);
+
+extern int state_pack(zmachine_ctx *ctx, unsigned char *buf);
+
+extern int state_unpack(zmachine_ctx *ctx, unsigned char *buf, int size);
+
+extern int state_delta_bound(zmachine_ctx *ctx, int base_size);
+
+extern int state_delta(zmachine_ctx *ctx, unsigned char *base, int base_size,
+                       unsigned char *out, int out_size);
+
+extern int state_apply_delta(zmachine_ctx *ctx, unsigned char *base, int base_size,
+                             unsigned char *delta, int delta_size);
+
+typedef struct state_store state_store_t;
+
+extern state_store_t *store_create(int page_size);
+
+extern void store_free(state_store_t *store);
+
+extern long store_add(state_store_t *store, zmachine_ctx *ctx, int *is_new);
+
+extern int store_restore(state_store_t *store, zmachine_ctx *ctx, long id);
+
+extern long store_num_states(state_store_t *store);
+
+extern long store_num_pages(state_store_t *store);
+
+extern long store_memory_size(state_store_t *store);
+
+int filter_candidate_actions(zmachine_ctx *ctx, char *candidate_actions, char *valid_actions, zword *diff_array);
+
+int filter_candidate_actions_parallel(zmachine_ctx *ctx, char *candidate_actions, char *valid_actions,
+                                      zword *diff_array, int num_workers);
+
+#define tw_max_score (zctx->tw_max_score)
+
+#define tw_player_obj_num (zctx->tw_player_obj_num)
+
+#define tw_num_world_objs (zctx->tw_num_world_objs)
 
 #endif
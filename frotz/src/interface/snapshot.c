@@ -0,0 +1,426 @@
+/*
+Copyright (C) 2018 Microsoft Corporation
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+// Snapshots of the state of a machine.
+//
+// Copy-on-write snapshots:
+// Dynamic memory is stored as reference-counted pages. A snapshot shares
+// every page that is unchanged since the machine's previous snapshot (the
+// last one taken or restored on it) and only copies the pages that differ.
+// Snapshots may be restored on any machine running the same story, and
+// taken, restored and freed from several threads at once.
+//
+// Packed states:
+// The whole state is serialized into a single flat buffer: a versioned
+// header followed by dynamic memory, the live part of the stack and the
+// narrative text. Values are stored in the host's byte order.
+//
+// State deltas:
+// A packed state is stored as its difference from a base packed state,
+// encoded by the Quetzal-like mem_diff used for the undo chain.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "frotz.h"
+#include "frotz_interface.h"
+
+extern long mem_diff (zbyte *a, zbyte *b, long mem_size, zbyte *diff);
+extern void mem_undiff (zbyte *diff, long diff_length, zbyte *dest);
+extern long mem_undiff_extent (zbyte *diff, long diff_length);
+
+#define SNAP_PAGE_SIZE 256
+
+typedef struct {
+  int refs;
+  zbyte data[SNAP_PAGE_SIZE];
+} snap_page;
+
+struct snapshot {
+  int refs;
+  long dynamic_size;
+  int num_pages;
+  snap_page **pages;
+  zword *stack_data;     // Live part of the stack, from sp to the bottom
+  int stack_len;
+  int pc_cpy;
+  int sp_cpy;
+  int fp_cpy;
+  int frame_count_cpy;
+  int next_opcode_cpy;
+  long rngA_cpy;
+  int rngInterval_cpy;
+  int rngCounter_cpy;
+  char *narrative;
+};
+
+static int page_len(long dynamic_size, int i) {
+  long len = dynamic_size - (long) i * SNAP_PAGE_SIZE;
+  return len < SNAP_PAGE_SIZE ? len : SNAP_PAGE_SIZE;
+}
+
+static void release_page(snap_page *page) {
+  if (__sync_sub_and_fetch(&page->refs, 1) == 0) {
+    free(page);
+  }
+}
+
+static void release_snapshot(snapshot_t *snap) {
+  int i;
+
+  if (snap == NULL || __sync_sub_and_fetch(&snap->refs, 1) > 0) {
+    return;
+  }
+  for (i=0; i<snap->num_pages; ++i) {
+    release_page(snap->pages[i]);
+  }
+  free(snap->pages);
+  free(snap->stack_data);
+  free(snap->narrative);
+  free(snap);
+}
+
+// Makes snap the snapshot the machine's memory is compared against.
+static void set_base(snapshot_t *snap) {
+  __sync_add_and_fetch(&snap->refs, 1);
+  release_snapshot(zctx->snap_base);
+  zctx->snap_base = snap;
+}
+
+// Takes a snapshot of the machine's state. Pages of dynamic memory equal to
+// the ones of the machine's previous snapshot are shared with it.
+// Returns NULL if out of memory.
+snapshot_t *snap_take(zmachine_ctx *ctx) {
+  snapshot_t *snap;
+  snapshot_t *base;
+  snap_page *page;
+  int len;
+  int i;
+
+  zctx = ctx;
+  base = zctx->snap_base;
+  if (base != NULL && base->dynamic_size != h_dynamic_size) {
+    base = NULL;
+  }
+
+  if ((snap = calloc(1, sizeof(snapshot_t))) == NULL) {
+    return NULL;
+  }
+  snap->refs = 1;
+  snap->dynamic_size = h_dynamic_size;
+  snap->num_pages = (h_dynamic_size + SNAP_PAGE_SIZE - 1) / SNAP_PAGE_SIZE;
+  snap->stack_len = stack + STACK_SIZE - sp;
+  snap->pages = malloc(snap->num_pages * sizeof(snap_page*));
+  snap->stack_data = malloc(snap->stack_len * sizeof(zword) + 1);
+  snap->narrative = strdup(world);
+  if (snap->pages == NULL || snap->stack_data == NULL || snap->narrative == NULL) {
+    snap->num_pages = 0;
+    release_snapshot(snap);
+    return NULL;
+  }
+
+  for (i=0; i<snap->num_pages; ++i) {
+    len = page_len(h_dynamic_size, i);
+    if (base != NULL && memcmp(base->pages[i]->data, zmp + i * SNAP_PAGE_SIZE, len) == 0) {
+      page = base->pages[i];
+      __sync_add_and_fetch(&page->refs, 1);
+    } else if ((page = malloc(sizeof(snap_page))) != NULL) {
+      page->refs = 1;
+      memcpy(page->data, zmp + i * SNAP_PAGE_SIZE, len);
+    } else {
+      snap->num_pages = i;
+      release_snapshot(snap);
+      return NULL;
+    }
+    snap->pages[i] = page;
+  }
+
+  memcpy(snap->stack_data, sp, snap->stack_len * sizeof(zword));
+  GET_PC(snap->pc_cpy);
+  snap->sp_cpy = sp - stack;
+  snap->fp_cpy = fp - stack;
+  snap->frame_count_cpy = frame_count;
+  snap->next_opcode_cpy = zctx->next_opcode;
+  snap->rngA_cpy = zctx->rng_A;
+  snap->rngInterval_cpy = zctx->rng_interval;
+  snap->rngCounter_cpy = zctx->rng_counter;
+
+  set_base(snap);
+  return snap;
+}
+
+// Restores the machine to the state of snap. Only the pages that differ
+// from the machine's memory are copied. Returns 0 on success, or -1 if
+// the snapshot was taken on a different story.
+int snap_restore(zmachine_ctx *ctx, snapshot_t *snap) {
+  zbyte *addr;
+  int len;
+  int i, j;
+
+  zctx = ctx;
+  if (snap->dynamic_size != h_dynamic_size) {
+    return -1;
+  }
+
+  for (i=0; i<snap->num_pages; ++i) {
+    addr = zmp + i * SNAP_PAGE_SIZE;
+    len = page_len(h_dynamic_size, i);
+    if (memcmp(addr, snap->pages[i]->data, len) != 0) {
+      memcpy(addr, snap->pages[i]->data, len);
+      for (j=0; j<len; j+=DIRTY_PAGE_SIZE) {
+        MARK_DIRTY(i * SNAP_PAGE_SIZE + j)
+      }
+    }
+  }
+
+  sp = stack + snap->sp_cpy;
+  fp = stack + snap->fp_cpy;
+  memcpy(sp, snap->stack_data, snap->stack_len * sizeof(zword));
+  SET_PC(snap->pc_cpy);
+  frame_count = snap->frame_count_cpy;
+  zctx->next_opcode = snap->next_opcode_cpy;
+  zctx->rng_A = snap->rngA_cpy;
+  zctx->rng_interval = snap->rngInterval_cpy;
+  zctx->rng_counter = snap->rngCounter_cpy;
+  strcpy(world, snap->narrative);
+
+  set_base(snap);
+  return 0;
+}
+
+// Releases a snapshot. Its pages are freed once no other snapshot shares them.
+void snap_free(snapshot_t *snap) {
+  release_snapshot(snap);
+}
+
+// Returns the number of bytes of dynamic memory held by snap that it
+// does not share with any other snapshot.
+long snap_private_size(snapshot_t *snap) {
+  long size = 0;
+  int i;
+
+  for (i=0; i<snap->num_pages; ++i) {
+    if (snap->pages[i]->refs == 1) {
+      size += page_len(snap->dynamic_size, i);
+    }
+  }
+  return size;
+}
+
+// Drops the machine's reference to its previous snapshot.
+void snap_forget(zmachine_ctx *ctx) {
+  release_snapshot(ctx->snap_base);
+  ctx->snap_base = NULL;
+}
+
+
+#define STATE_MAGIC 0x5453464a     // "JFST"
+#define STATE_VERSION 1
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t ram_size;
+  uint32_t stack_len;       // In words, from sp to the bottom of the stack
+  uint32_t narrative_len;   // Without the null terminator
+  int32_t pc_cpy;
+  int32_t sp_cpy;
+  int32_t fp_cpy;
+  int32_t frame_count_cpy;
+  int32_t next_opcode_cpy;
+  int64_t rngA_cpy;
+  int32_t rngInterval_cpy;
+  int32_t rngCounter_cpy;
+} state_header;
+
+// Returns the size in bytes of the machine's packed state.
+int state_size(zmachine_ctx *ctx) {
+  zctx = ctx;
+  return sizeof(state_header) + h_dynamic_size
+    + (stack + STACK_SIZE - sp) * sizeof(zword) + strlen(world);
+}
+
+// Serializes the machine's state into buf, which must hold state_size()
+// bytes. Returns the number of bytes written.
+int state_pack(zmachine_ctx *ctx, unsigned char *buf) {
+  state_header header;
+  unsigned char *p = buf;
+
+  zctx = ctx;
+  header.magic = STATE_MAGIC;
+  header.version = STATE_VERSION;
+  header.ram_size = h_dynamic_size;
+  header.stack_len = stack + STACK_SIZE - sp;
+  header.narrative_len = strlen(world);
+  header.pc_cpy = pcp - zmp;
+  header.sp_cpy = sp - stack;
+  header.fp_cpy = fp - stack;
+  header.frame_count_cpy = frame_count;
+  header.next_opcode_cpy = zctx->next_opcode;
+  header.rngA_cpy = zctx->rng_A;
+  header.rngInterval_cpy = zctx->rng_interval;
+  header.rngCounter_cpy = zctx->rng_counter;
+
+  memcpy(p, &header, sizeof(header));
+  p += sizeof(header);
+  memcpy(p, zmp, header.ram_size);
+  p += header.ram_size;
+  memcpy(p, sp, header.stack_len * sizeof(zword));
+  p += header.stack_len * sizeof(zword);
+  memcpy(p, world, header.narrative_len);
+  p += header.narrative_len;
+  return p - buf;
+}
+
+// Restores the machine's state from a buffer of size bytes written by
+// state_pack. Returns 0 on success, or -1 if the buffer is not a state
+// of this version and story.
+int state_unpack(zmachine_ctx *ctx, unsigned char *buf, int size) {
+  state_header header;
+  unsigned char *p = buf;
+
+  zctx = ctx;
+  if (size < (int) sizeof(header)) {
+    return -1;
+  }
+  memcpy(&header, p, sizeof(header));
+  if (header.magic != STATE_MAGIC || header.version != STATE_VERSION
+      || header.ram_size != h_dynamic_size
+      || header.stack_len > STACK_SIZE
+      || header.sp_cpy != STACK_SIZE - (int32_t) header.stack_len
+      || header.pc_cpy < 0 || header.pc_cpy >= story_size
+      || header.fp_cpy < 0 || header.fp_cpy > STACK_SIZE
+      || header.narrative_len >= sizeof(world)
+      || size != (int) (sizeof(header) + header.ram_size
+                        + header.stack_len * sizeof(zword) + header.narrative_len)) {
+    return -1;
+  }
+  p += sizeof(header);
+
+  memcpy(zmp, p, header.ram_size);
+  zctx->all_dirty = DIRTY_BOTH;
+  p += header.ram_size;
+  sp = stack + header.sp_cpy;
+  fp = stack + header.fp_cpy;
+  memcpy(sp, p, header.stack_len * sizeof(zword));
+  p += header.stack_len * sizeof(zword);
+  memcpy(world, p, header.narrative_len);
+  world[header.narrative_len] = '\0';
+
+  pcp = zmp + header.pc_cpy;
+  frame_count = header.frame_count_cpy;
+  zctx->next_opcode = header.next_opcode_cpy;
+  zctx->rng_A = header.rngA_cpy;
+  zctx->rng_interval = header.rngInterval_cpy;
+  zctx->rng_counter = header.rngCounter_cpy;
+  return 0;
+}
+
+
+#define DELTA_MAGIC 0x4453464a     // "JFSD"
+#define DELTA_VERSION 1
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t base_size;
+  uint32_t state_size;
+  uint32_t diff_size;       // Diff of the bytes common to base and state
+} delta_header;
+
+// Returns an upper bound on the size of the delta between the machine's
+// state and a base state of base_size bytes.
+int state_delta_bound(zmachine_ctx *ctx, int base_size) {
+  int size = state_size(ctx);
+  int common = size < base_size ? size : base_size;
+
+  // mem_diff writes at most 3 bytes for every 2 bytes compared, plus
+  // 3 bytes for each run of 0x8000 equal bytes.
+  return sizeof(delta_header) + common + common / 2 + 3 * (common / 0x8000 + 1)
+    + (size - common);
+}
+
+// Writes into out the difference between the machine's state and base,
+// a state written by state_pack. Returns the number of bytes written, or
+// -1 if out_size is smaller than state_delta_bound().
+int state_delta(zmachine_ctx *ctx, unsigned char *base, int base_size,
+                unsigned char *out, int out_size) {
+  delta_header header;
+  unsigned char *state;
+  int common;
+
+  if (out_size < state_delta_bound(ctx, base_size)) {
+    return -1;
+  }
+  header.magic = DELTA_MAGIC;
+  header.version = DELTA_VERSION;
+  header.base_size = base_size;
+  header.state_size = state_size(ctx);
+  common = header.state_size < header.base_size ? header.state_size : header.base_size;
+
+  if ((state = malloc(header.state_size)) == NULL) {
+    return -1;
+  }
+  state_pack(ctx, state);
+  header.diff_size = mem_diff(base, state, common, out + sizeof(header));
+  memcpy(out + sizeof(header) + header.diff_size, state + common, header.state_size - common);
+  memcpy(out, &header, sizeof(header));
+  free(state);
+
+  return sizeof(header) + header.diff_size + header.state_size - common;
+}
+
+// Restores the machine to the state made of base and a delta written by
+// state_delta. Returns 0 on success, or -1 if the delta does not apply to
+// base or the state is not one of this story.
+int state_apply_delta(zmachine_ctx *ctx, unsigned char *base, int base_size,
+                      unsigned char *delta, int delta_size) {
+  delta_header header;
+  unsigned char *state;
+  int common;
+  int result;
+
+  if (delta_size < (int) sizeof(header)) {
+    return -1;
+  }
+  memcpy(&header, delta, sizeof(header));
+  common = header.state_size < header.base_size ? header.state_size : header.base_size;
+  if (header.magic != DELTA_MAGIC || header.version != DELTA_VERSION
+      || header.base_size != (uint32_t) base_size
+      || header.diff_size > delta_size - sizeof(header)
+      || header.state_size - common > delta_size - sizeof(header) - header.diff_size
+      || delta_size != (int) (sizeof(header) + header.diff_size + header.state_size - common)) {
+    return -1;
+  }
+  // The diff comes from the caller: its runs must stay within the bytes
+  // common to base and state.
+  if (mem_undiff_extent(delta + sizeof(header), header.diff_size) > common) {
+    return -1;
+  }
+
+  if ((state = malloc(header.state_size + 1)) == NULL) {
+    return -1;
+  }
+  memcpy(state, base, common);
+  mem_undiff(delta + sizeof(header), header.diff_size, state);
+  memcpy(state + common, delta + sizeof(header) + header.diff_size, header.state_size - common);
+  result = state_unpack(ctx, state, header.state_size);
+  free(state);
+
+  return result;
+}
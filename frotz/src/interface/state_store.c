@@ -0,0 +1,328 @@
+/*
+Copyright (C) 2018 Microsoft Corporation
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+// Content-addressed store of game states.
+//
+// States are packed with state_pack and split into fixed-size pages. Each
+// distinct page is stored once, found through a hash table, so a state
+// costs one page ID per page plus the pages no other state has. Identical
+// states are stored once as well. A store may be shared by several threads.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "frotz.h"
+#include "frotz_interface.h"
+
+#define STORE_PAGE_SIZE 256
+#define EMPTY_SLOT 0xffffffff
+
+struct state_store {
+  pthread_mutex_t lock;
+  int page_size;
+
+  unsigned char *pages;     // Page data, indexed by page ID
+  uint64_t *page_hashes;
+  uint32_t num_pages;
+  uint32_t max_pages;
+  uint32_t *page_slots;     // Open addressing table of page IDs
+  uint32_t page_mask;
+
+  uint32_t *ids;            // Page IDs of all the states, one after another
+  long num_ids;
+  long max_ids;
+  long *state_first;        // Index in ids of the first page of each state
+  uint32_t *state_sizes;    // Size in bytes of each packed state
+  uint64_t *state_hashes;
+  uint32_t num_states;
+  uint32_t max_states;
+  uint32_t *state_slots;    // Open addressing table of state IDs
+  uint32_t state_mask;
+};
+
+static uint64_t hash_bytes(const void *data, long size, uint64_t h) {
+  const unsigned char *p = data;
+  long i;
+
+  // FNV-1a
+  for (i=0; i<size; ++i) {
+    h = (h ^ p[i]) * 0x100000001b3ULL;
+  }
+  return h;
+}
+
+#define HASH_SEED 0xcbf29ce484222325ULL
+
+static int grow(void **array, size_t elem_size, long count) {
+  void *p = realloc(*array, elem_size * count);
+  if (p == NULL) {
+    return -1;
+  }
+  *array = p;
+  return 0;
+}
+
+static uint32_t *new_slots(uint32_t count) {
+  uint32_t *slots = malloc(count * sizeof(uint32_t));
+  if (slots != NULL) {
+    memset(slots, 0xff, count * sizeof(uint32_t));
+  }
+  return slots;
+}
+
+// Rebuilds a hash table twice as large. Returns -1 if out of memory.
+static int rehash(uint32_t **slots, uint32_t *mask, uint64_t *hashes, uint32_t count) {
+  uint32_t new_mask = *mask * 2 + 1;
+  uint32_t *table = new_slots(new_mask + 1);
+  uint32_t i, j;
+
+  if (table == NULL) {
+    return -1;
+  }
+  for (i=0; i<count; ++i) {
+    for (j = hashes[i] & new_mask; table[j] != EMPTY_SLOT; j = (j + 1) & new_mask);
+    table[j] = i;
+  }
+  free(*slots);
+  *slots = table;
+  *mask = new_mask;
+  return 0;
+}
+
+// Returns the ID of the page equal to data, adding it if new, or
+// EMPTY_SLOT if out of memory.
+static uint32_t intern_page(state_store_t *store, const unsigned char *data) {
+  uint64_t h = hash_bytes(data, store->page_size, HASH_SEED);
+  uint32_t j;
+  uint32_t id;
+
+  for (j = h & store->page_mask; store->page_slots[j] != EMPTY_SLOT; j = (j + 1) & store->page_mask) {
+    id = store->page_slots[j];
+    if (store->page_hashes[id] == h
+        && memcmp(store->pages + (long) id * store->page_size, data, store->page_size) == 0) {
+      return id;
+    }
+  }
+
+  if (store->num_pages == store->max_pages) {
+    if (grow((void**) &store->pages, store->page_size, store->max_pages * 2L) < 0
+        || grow((void**) &store->page_hashes, sizeof(uint64_t), store->max_pages * 2L) < 0) {
+      return EMPTY_SLOT;
+    }
+    store->max_pages *= 2;
+  }
+  id = store->num_pages++;
+  memcpy(store->pages + (long) id * store->page_size, data, store->page_size);
+  store->page_hashes[id] = h;
+  store->page_slots[j] = id;
+
+  // Keep the table at most half full
+  if (store->num_pages * 2 > store->page_mask
+      && rehash(&store->page_slots, &store->page_mask, store->page_hashes, store->num_pages) < 0) {
+    return EMPTY_SLOT;
+  }
+  return id;
+}
+
+// Creates a store splitting states into pages of page_size bytes
+// (256 if page_size <= 0). Returns NULL if out of memory.
+state_store_t *store_create(int page_size) {
+  state_store_t *store = calloc(1, sizeof(state_store_t));
+
+  if (store == NULL) {
+    return NULL;
+  }
+  pthread_mutex_init(&store->lock, NULL);
+  store->page_size = page_size > 0 ? page_size : STORE_PAGE_SIZE;
+  store->max_pages = 64;
+  store->pages = malloc((long) store->max_pages * store->page_size);
+  store->page_hashes = malloc(store->max_pages * sizeof(uint64_t));
+  store->page_mask = 127;
+  store->page_slots = new_slots(store->page_mask + 1);
+  store->max_ids = 1024;
+  store->ids = malloc(store->max_ids * sizeof(uint32_t));
+  store->max_states = 64;
+  store->state_first = malloc(store->max_states * sizeof(long));
+  store->state_sizes = malloc(store->max_states * sizeof(uint32_t));
+  store->state_hashes = malloc(store->max_states * sizeof(uint64_t));
+  store->state_mask = 127;
+  store->state_slots = new_slots(store->state_mask + 1);
+
+  if (store->pages == NULL || store->page_hashes == NULL || store->page_slots == NULL
+      || store->ids == NULL || store->state_first == NULL || store->state_sizes == NULL
+      || store->state_hashes == NULL || store->state_slots == NULL) {
+    store_free(store);
+    return NULL;
+  }
+  return store;
+}
+
+void store_free(state_store_t *store) {
+  if (store == NULL) {
+    return;
+  }
+  pthread_mutex_destroy(&store->lock);
+  free(store->pages);
+  free(store->page_hashes);
+  free(store->page_slots);
+  free(store->ids);
+  free(store->state_first);
+  free(store->state_sizes);
+  free(store->state_hashes);
+  free(store->state_slots);
+  free(store);
+}
+
+// Adds the machine's state to the store. Returns the ID of the state, or
+// -1 if out of memory. If is_new is not NULL, it is set to 0 when an
+// identical state was already in the store, and to 1 otherwise.
+long store_add(state_store_t *store, zmachine_ctx *ctx, int *is_new) {
+  int size = state_size(ctx);
+  int num_ids = (size + store->page_size - 1) / store->page_size;
+  unsigned char *state;
+  uint32_t *ids;
+  long max_ids;
+  uint64_t h;
+  uint32_t id;
+  uint32_t j;
+  int i;
+
+  // Pad the last page with zeros
+  if ((state = calloc(num_ids, store->page_size)) == NULL) {
+    return -1;
+  }
+  state_pack(ctx, state);
+
+  pthread_mutex_lock(&store->lock);
+  if (store->num_ids + num_ids > store->max_ids) {
+    max_ids = store->max_ids;
+    while (store->num_ids + num_ids > max_ids) {
+      max_ids *= 2;
+    }
+    if (grow((void**) &store->ids, sizeof(uint32_t), max_ids) < 0) {
+      goto out_of_memory;
+    }
+    store->max_ids = max_ids;
+  }
+
+  ids = store->ids + store->num_ids;
+  for (i=0; i<num_ids; ++i) {
+    if ((ids[i] = intern_page(store, state + (long) i * store->page_size)) == EMPTY_SLOT) {
+      goto out_of_memory;
+    }
+  }
+  free(state);
+
+  h = hash_bytes(ids, num_ids * sizeof(uint32_t), hash_bytes(&size, sizeof(size), HASH_SEED));
+  for (j = h & store->state_mask; store->state_slots[j] != EMPTY_SLOT; j = (j + 1) & store->state_mask) {
+    id = store->state_slots[j];
+    if (store->state_hashes[id] == h && store->state_sizes[id] == (uint32_t) size
+        && memcmp(store->ids + store->state_first[id], ids, num_ids * sizeof(uint32_t)) == 0) {
+      pthread_mutex_unlock(&store->lock);
+      if (is_new != NULL) {
+        *is_new = 0;
+      }
+      return id;
+    }
+  }
+
+  if (store->num_states == store->max_states) {
+    if (grow((void**) &store->state_first, sizeof(long), store->max_states * 2L) < 0
+        || grow((void**) &store->state_sizes, sizeof(uint32_t), store->max_states * 2L) < 0
+        || grow((void**) &store->state_hashes, sizeof(uint64_t), store->max_states * 2L) < 0) {
+      pthread_mutex_unlock(&store->lock);
+      return -1;
+    }
+    store->max_states *= 2;
+  }
+  id = store->num_states++;
+  store->state_first[id] = store->num_ids;
+  store->state_sizes[id] = size;
+  store->state_hashes[id] = h;
+  store->state_slots[j] = id;
+  store->num_ids += num_ids;
+
+  if (store->num_states * 2 > store->state_mask
+      && rehash(&store->state_slots, &store->state_mask, store->state_hashes, store->num_states) < 0) {
+    store->num_states--;
+    store->num_ids -= num_ids;
+    store->state_slots[j] = EMPTY_SLOT;
+    pthread_mutex_unlock(&store->lock);
+    return -1;
+  }
+  pthread_mutex_unlock(&store->lock);
+
+  if (is_new != NULL) {
+    *is_new = 1;
+  }
+  return id;
+
+out_of_memory:
+  pthread_mutex_unlock(&store->lock);
+  free(state);
+  return -1;
+}
+
+// Restores the machine to the state of the given ID. Returns 0 on success,
+// or -1 if there is no such state or it is not one of this story.
+int store_restore(state_store_t *store, zmachine_ctx *ctx, long id) {
+  unsigned char *state;
+  uint32_t *ids;
+  int num_ids;
+  int size;
+  int result;
+  int i;
+
+  pthread_mutex_lock(&store->lock);
+  if (id < 0 || id >= store->num_states) {
+    pthread_mutex_unlock(&store->lock);
+    return -1;
+  }
+  size = store->state_sizes[id];
+  num_ids = (size + store->page_size - 1) / store->page_size;
+  if ((state = malloc((long) num_ids * store->page_size)) == NULL) {
+    pthread_mutex_unlock(&store->lock);
+    return -1;
+  }
+  ids = store->ids + store->state_first[id];
+  for (i=0; i<num_ids; ++i) {
+    memcpy(state + (long) i * store->page_size,
+           store->pages + (long) ids[i] * store->page_size, store->page_size);
+  }
+  pthread_mutex_unlock(&store->lock);
+
+  result = state_unpack(ctx, state, size);
+  free(state);
+  return result;
+}
+
+long store_num_states(state_store_t *store) {
+  return store->num_states;
+}
+
+long store_num_pages(state_store_t *store) {
+  return store->num_pages;
+}
+
+// Returns the number of bytes used by the stored pages and page IDs.
+long store_memory_size(state_store_t *store) {
+  return (long) store->num_pages * (store->page_size + sizeof(uint64_t))
+    + store->num_ids * sizeof(uint32_t)
+    + (long) store->num_states * (sizeof(long) + sizeof(uint32_t) + sizeof(uint64_t));
+}
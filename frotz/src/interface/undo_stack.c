@@ -0,0 +1,359 @@
+/*
+Copyright (C) 2018 Microsoft Corporation
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+// Multi-level undo for backtracking searches.
+//
+// Each machine has a stack of saved states. Like the interpreter's undo
+// chain, a level stores dynamic memory as the mem_diff from the level
+// below, and the stack keeps a copy of the memory of the top level. Going
+// down a level applies its diff to that copy. The stack is separate from
+// the game's own undo chain, so save_undo and restore_undo opcodes run by
+// the game do not disturb it.
+//
+// Pushing and popping only look at the pages of memory that may differ
+// from that copy: the pages written since the last push, tracked with
+// the DIRTY_UNDO bit of the dirty pages, and those the diffs undone
+// since then changed in the copy.
+//
+// The oldest levels are dropped when the stack gets deeper than its depth
+// limit or holds more bytes than its memory limit.
+
+#include <stdlib.h>
+#include <string.h>
+#include "frotz.h"
+#include "frotz_interface.h"
+
+extern long mem_diff (zbyte *a, zbyte *b, long mem_size, zbyte *diff);
+extern long mem_diff_pages (zbyte *a, zbyte *b, long mem_size, const zword *pages, int count, zbyte *diff);
+extern void mem_undiff (zbyte *diff, long diff_length, zbyte *dest);
+
+struct undo_level {
+  struct undo_level *below;
+  struct undo_level *above;
+  zbyte *diff;           // From this level's memory to the one below, NULL at the bottom
+  long diff_size;
+  long size;             // Bytes allocated for the level
+  zword *stack_data;     // Live part of the stack, from sp to the bottom
+  int stack_len;
+  char *narrative;
+  int pc_cpy;
+  int sp_cpy;
+  int fp_cpy;
+  int frame_count_cpy;
+  int next_opcode_cpy;
+  long rngA_cpy;
+  int rngInterval_cpy;
+  int rngCounter_cpy;
+};
+
+struct level_stack {
+  struct undo_level *bottom;
+  struct undo_level *top;
+  int depth;
+  long size;             // Bytes held by the levels
+  zbyte *top_mem;        // Dynamic memory of the top level
+  zbyte *diff_buf;       // Room for the largest diff mem_diff may write
+};
+
+#define undo_stack (zctx->undo_stack)
+
+static void free_level(struct undo_level *level) {
+  free(level->diff);
+  free(level);
+}
+
+// Adds a page to those where memory may differ from top_mem.
+static void mark_page(zword page) {
+  if (!(zctx->dirty[page] & DIRTY_UNDO)) {
+    zctx->dirty[page] |= DIRTY_UNDO;
+    zctx->undo_dirty_pages[zctx->undo_dirty_count++] = page;
+  }
+}
+
+// Memory and top_mem are the same again.
+static void clear_pages() {
+  int i;
+
+  for (i=0; i<zctx->undo_dirty_count; ++i) {
+    zctx->dirty[zctx->undo_dirty_pages[i]] &= ~DIRTY_UNDO;
+  }
+  zctx->undo_dirty_count = 0;
+  zctx->all_dirty &= ~DIRTY_UNDO;
+}
+
+static int compare_pages(const void *a, const void *b) {
+  return (int) *(const zword*) a - (int) *(const zword*) b;
+}
+
+// Applies the diff of a level to top_mem, as mem_undiff does, marking
+// the pages it changes.
+static void undiff_top(struct undo_level *level) {
+  zbyte *diff = level->diff;
+  zbyte *end = diff + level->diff_size;
+  long addr = 0;
+  unsigned run;
+
+  while (diff < end) {
+    if (*diff != 0) {
+      undo_stack->top_mem[addr] ^= *diff++;
+      mark_page(addr >> DIRTY_PAGE_SHIFT);
+      addr++;
+    } else {
+      if (diff + 1 >= end) {
+        return;
+      }
+      run = diff[1];
+      diff += 2;
+      if (run & 0x80) {
+        if (diff >= end) {
+          return;
+        }
+        run = (run & 0x7f) | ((unsigned) *diff++ << 7);
+      }
+      addr += run + 1;
+    }
+  }
+}
+
+static void drop_top() {
+  struct undo_level *level = undo_stack->top;
+
+  if (level->diff != NULL) {
+    undiff_top(level);
+  }
+  undo_stack->top = level->below;
+  if (undo_stack->top != NULL) {
+    undo_stack->top->above = NULL;
+  } else {
+    undo_stack->bottom = NULL;
+  }
+  undo_stack->size -= level->size;
+  undo_stack->depth--;
+  free_level(level);
+}
+
+// The level above the bottom one no longer needs its diff.
+static void drop_bottom() {
+  struct undo_level *level = undo_stack->bottom;
+
+  undo_stack->bottom = level->above;
+  if (undo_stack->bottom != NULL) {
+    undo_stack->bottom->below = NULL;
+    free(undo_stack->bottom->diff);
+    undo_stack->bottom->diff = NULL;
+    undo_stack->bottom->size -= undo_stack->bottom->diff_size;
+    undo_stack->size -= undo_stack->bottom->diff_size;
+    undo_stack->bottom->diff_size = 0;
+  } else {
+    undo_stack->top = NULL;
+  }
+  undo_stack->size -= level->size;
+  undo_stack->depth--;
+  free_level(level);
+}
+
+static struct level_stack *new_undo_stack() {
+  struct level_stack *levels = calloc(1, sizeof(struct level_stack));
+  long size = h_dynamic_size;
+
+  if (levels == NULL) {
+    return NULL;
+  }
+  levels->top_mem = malloc(size);
+  // mem_diff writes at most 3 bytes for every 2 bytes compared, plus
+  // 3 bytes for each run of 0x8000 equal bytes.
+  levels->diff_buf = malloc(size + size / 2 + 3 * (size / 0x8000 + 1));
+  if (levels->top_mem == NULL || levels->diff_buf == NULL) {
+    free(levels->top_mem);
+    free(levels->diff_buf);
+    free(levels);
+    return NULL;
+  }
+  return levels;
+}
+
+// Sets the most levels the machine's undo stack keeps (0 for no limit)
+// and the most bytes they may take (0 for no limit). The oldest levels
+// are dropped to fit, though the newest one is always kept.
+void set_undo_limits(zmachine_ctx *ctx, int max_depth, long max_bytes) {
+  zctx = ctx;
+  ctx->undo_max_depth = max_depth;
+  ctx->undo_max_bytes = max_bytes;
+  while (undo_stack != NULL && undo_stack->depth > 1
+         && ((max_depth > 0 && undo_stack->depth > max_depth)
+             || (max_bytes > 0 && undo_stack->size > max_bytes))) {
+    drop_bottom();
+  }
+}
+
+// Saves the machine's state on top of its undo stack. Only the pages
+// written since the previous push are compared. Returns the new depth,
+// or -1 if out of memory.
+int undo_push(zmachine_ctx *ctx) {
+  struct undo_level *level;
+  long diff_size = 0;
+  int stack_len;
+  int narrative_len;
+
+  zctx = ctx;
+  if (undo_stack == NULL && (undo_stack = new_undo_stack()) == NULL) {
+    return -1;
+  }
+
+  stack_len = stack + STACK_SIZE - sp;
+  narrative_len = strlen(world);
+  level = malloc(sizeof(struct undo_level) + stack_len * sizeof(zword) + narrative_len + 1);
+  if (level == NULL) {
+    return -1;
+  }
+  level->diff = NULL;
+  if (undo_stack->top != NULL) {
+    // mem_diff also brings top_mem up to date
+    if (zctx->all_dirty & DIRTY_UNDO) {
+      diff_size = mem_diff(zmp, undo_stack->top_mem, h_dynamic_size, undo_stack->diff_buf);
+    } else {
+      qsort(zctx->undo_dirty_pages, zctx->undo_dirty_count, sizeof(zword), compare_pages);
+      diff_size = mem_diff_pages(zmp, undo_stack->top_mem, h_dynamic_size, zctx->undo_dirty_pages,
+                                 zctx->undo_dirty_count, undo_stack->diff_buf);
+    }
+    if ((level->diff = malloc(diff_size + 1)) == NULL) {
+      mem_undiff(undo_stack->diff_buf, diff_size, undo_stack->top_mem);
+      free(level);
+      return -1;
+    }
+    memcpy(level->diff, undo_stack->diff_buf, diff_size);
+  } else {
+    memcpy(undo_stack->top_mem, zmp, h_dynamic_size);
+  }
+  clear_pages();
+
+  level->diff_size = diff_size;
+  level->size = sizeof(struct undo_level) + stack_len * sizeof(zword) + narrative_len + 1 + diff_size;
+  level->stack_data = (zword*) (level + 1);
+  level->stack_len = stack_len;
+  memcpy(level->stack_data, sp, stack_len * sizeof(zword));
+  level->narrative = (char*) (level->stack_data + stack_len);
+  memcpy(level->narrative, world, narrative_len + 1);
+  GET_PC(level->pc_cpy);
+  level->sp_cpy = sp - stack;
+  level->fp_cpy = fp - stack;
+  level->frame_count_cpy = frame_count;
+  level->next_opcode_cpy = zctx->next_opcode;
+  level->rngA_cpy = zctx->rng_A;
+  level->rngInterval_cpy = zctx->rng_interval;
+  level->rngCounter_cpy = zctx->rng_counter;
+
+  level->below = undo_stack->top;
+  level->above = NULL;
+  if (undo_stack->top != NULL) {
+    undo_stack->top->above = level;
+  } else {
+    undo_stack->bottom = level;
+  }
+  undo_stack->top = level;
+  undo_stack->size += level->size;
+  undo_stack->depth++;
+
+  set_undo_limits(ctx, ctx->undo_max_depth, ctx->undo_max_bytes);
+  return undo_stack->depth;
+}
+
+// Copies a page of top_mem that differs back to memory.
+static void restore_page(long addr) {
+  long len = h_dynamic_size - addr < DIRTY_PAGE_SIZE ? h_dynamic_size - addr : DIRTY_PAGE_SIZE;
+
+  if (len > 0 && memcmp(zmp + addr, undo_stack->top_mem + addr, len) != 0) {
+    memcpy(zmp + addr, undo_stack->top_mem + addr, len);
+    MARK_DIRTY(addr)
+  }
+}
+
+// Removes the count newest levels of the undo stack and restores the
+// machine to the state saved by the last one removed. Only the pages
+// written since the newest level was pushed, and those the levels
+// removed changed, are copied. Returns the new depth, or -1 if the
+// stack holds fewer than count levels.
+int undo_pop(zmachine_ctx *ctx, int count) {
+  struct undo_level *level;
+  long i;
+
+  zctx = ctx;
+  if (count < 1 || undo_stack == NULL || count > undo_stack->depth) {
+    return -1;
+  }
+  while (--count > 0) {
+    drop_top();
+  }
+
+  level = undo_stack->top;
+  if (zctx->all_dirty & DIRTY_UNDO) {
+    for (i=0; i<h_dynamic_size; i+=DIRTY_PAGE_SIZE) {
+      restore_page(i);
+    }
+  } else {
+    for (i=0; i<zctx->undo_dirty_count; ++i) {
+      restore_page((long) zctx->undo_dirty_pages[i] << DIRTY_PAGE_SHIFT);
+    }
+  }
+  clear_pages();
+
+  sp = stack + level->sp_cpy;
+  fp = stack + level->fp_cpy;
+  memcpy(sp, level->stack_data, level->stack_len * sizeof(zword));
+  SET_PC(level->pc_cpy);
+  frame_count = level->frame_count_cpy;
+  zctx->next_opcode = level->next_opcode_cpy;
+  zctx->rng_A = level->rngA_cpy;
+  zctx->rng_interval = level->rngInterval_cpy;
+  zctx->rng_counter = level->rngCounter_cpy;
+  strcpy(world, level->narrative);
+
+  drop_top();
+  return undo_stack->depth;
+}
+
+// Returns the number of levels on the machine's undo stack.
+int undo_depth(zmachine_ctx *ctx) {
+  zctx = ctx;
+  return undo_stack != NULL ? undo_stack->depth : 0;
+}
+
+// Returns the number of bytes held by the levels of the undo stack.
+long undo_memory_size(zmachine_ctx *ctx) {
+  zctx = ctx;
+  return undo_stack != NULL ? undo_stack->size : 0;
+}
+
+// Empties the machine's undo stack and frees its memory.
+void undo_clear(zmachine_ctx *ctx) {
+  struct undo_level *level;
+
+  zctx = ctx;
+  if (undo_stack == NULL) {
+    return;
+  }
+  while (undo_stack->top != NULL) {
+    level = undo_stack->top;
+    undo_stack->top = level->below;
+    free_level(level);
+  }
+  free(undo_stack->top_mem);
+  free(undo_stack->diff_buf);
+  free(undo_stack);
+  undo_stack = NULL;
+}
@@ -53,6 +53,29 @@ unrecognized = [
 #: be captured.
 UNRECOGNIZED_REGEXPS = [re.compile(regexp) for regexp in unrecognized]
 
+#: Names of the Z-machine opcodes, by operand count, as in the Z-Machine Standard.
+OPCODES_2OP = '-/je/jl/jg/dec_chk/inc_chk/jin/test/or/and/test_attr/set_attr/clear_attr/store/insert_obj/loadw/loadb/get_prop/get_prop_addr/get_next_prop/add/sub/mul/div/mod/call_2s/call_2n/set_colour/throw/-/-/-'.split('/')
+OPCODES_1OP = 'jz/get_sibling/get_child/get_parent/get_prop_len/inc/dec/print_addr/call_1s/remove_obj/print_obj/ret/jump/print_paddr/load/call_1n'.split('/')
+OPCODES_0OP = 'rtrue/rfalse/print/print_ret/nop/save/restore/restart/ret_popped/pop/quit/new_line/show_status/verify/extended/piracy'.split('/')
+OPCODES_VAR = 'call_vs/storew/storeb/put_prop/read/print_char/print_num/random/push/pull/split_window/set_window/call_vs2/erase_window/erase_line/set_cursor/get_cursor/set_text_style/buffer_mode/output_stream/input_stream/sound_effect/read_char/scan_table/not/call_vn/call_vn2/tokenise/encode_text/copy_table/print_table/check_arg_count'.split('/')
+OPCODES_EXT = 'save/restore/log_shift/art_shift/set_font/draw_picture/picture_data/erase_picture/set_margins/save_undo/restore_undo/print_unicode/check_unicode/set_true_colour/-/-/move_window/window_size/window_style/get_wind_prop/scroll_window/pop_stack/read_mouse/mouse_window/push_stack/put_wind_prop/print_form/make_menu/picture_table/buffer_screen/-/-'.split('/')
+
+
+def opcode_name(op):
+    """ Returns the name of an opcode as indexed by the profiler: the first
+    byte of the instruction, or 0x100 plus the number of an extended opcode. """
+    if op >= 0x100:
+        name = OPCODES_EXT[op - 0x100]
+    elif op < 0x80 or 0xc0 <= op < 0xe0:
+        name = OPCODES_2OP[op & 0x1f]
+    elif op < 0xb0:
+        name = OPCODES_1OP[op & 0x0f]
+    elif op < 0xc0:
+        name = OPCODES_0OP[op & 0x0f]
+    else:
+        name = OPCODES_VAR[op & 0x1f]
+    return name if name != '-' else 'illegal'
+
 #: The action abbreviation dictionary contains abbreviations of common actions.
 ABBRV_DICT = {
     'n' : 'north',
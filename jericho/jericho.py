@@ -15,14 +15,12 @@
 # Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 import os
-import shutil
-import tempfile
 import warnings
 import hashlib
 
 import importlib.resources
 from collections import defaultdict
-import multiprocessing as mp
+from concurrent.futures import ThreadPoolExecutor
 
 import numpy as np
 from ctypes import *
@@ -39,21 +37,26 @@ FROTZ_LIB_PATH = os.path.join(JERICHO_PATH, 'libfrotz.so')
 # The buffer size for actions in frotz. -2 to allow for newline and null terminator.
 INPUT_BUFFER_SIZE = 200 - 2
 
-# Function to unload a shared library.
-dlclose_func = CDLL(None).dlclose  # This WON'T work on Win
-dlclose_func.argtypes = [c_void_p]
+# The size of frotz's observation buffer, including the null terminator.
+OBSERVATION_BUFFER_SIZE = 8192
 
 
-def init_worker(story, seed):
-    """ Worker that will be used to test candidate actions. """
-    worker.env = FrotzEnv(story, seed)
+def _encode_action(action):
+    """ Converts an action to the newline-terminated bytes expected by frotz. """
+    action_bytes = action.encode('utf-8')
+    if len(action_bytes) > INPUT_BUFFER_SIZE:
+        action_bytes = action_bytes[:INPUT_BUFFER_SIZE]
+        msg = ("Once converted to bytes, actions should have less than 198 characters."
+               " Action '{}' was truncated to '{}'.".format(action, action_bytes.decode()))
+        warnings.warn(msg, TruncatedInputActionWarning)
+
+    return action_bytes + b'\n'
 
 
-def worker(data):
+def worker(env, state, candidate_actions, use_ctypes):
     """ Worker that will be used to test candidate actions. """
-    state, candidate_actions, use_ctypes = data
-    worker.env.set_state(state)
-    return worker.env._filter_candidate_actions(candidate_actions, use_ctypes=use_ctypes, use_parallel=False)
+    env.set_state(state)
+    return env._filter_candidate_actions(candidate_actions, use_ctypes=use_ctypes, use_parallel=False)
 
 
 class ZObject(Structure):
@@ -213,122 +216,216 @@ class DictionaryWord(Structure):
         return pos
 
 
-def _load_frotz_lib():
-    """ Loads a copy of frotz's shared library. """
+_frotz_lib = None
 
-    # Make a copy of libfrotz.so before loading it to avoid concurrency issues.
-    with tempfile.TemporaryDirectory() as tmpdir:
-        frotz_lib_path = os.path.join(tmpdir, 'libfrotz.so')
-        shutil.copyfile(FROTZ_LIB_PATH, frotz_lib_path)
-        frotz_lib = cdll.LoadLibrary(frotz_lib_path)
 
-    frotz_lib.setup.argtypes = [c_char_p, c_int, c_char_p, c_int]
+def _load_frotz_lib():
+    """ Loads frotz's shared library. It is loaded once and shared by all
+    FrotzEnv instances: each instance runs its own Z-machine context. """
+    global _frotz_lib
+    if _frotz_lib is not None:
+        return _frotz_lib
+
+    frotz_lib = cdll.LoadLibrary(FROTZ_LIB_PATH)
+
+    frotz_lib.create_ctx.argtypes = []
+    frotz_lib.create_ctx.restype = c_void_p
+    frotz_lib.free_ctx.argtypes = [c_void_p]
+    frotz_lib.free_ctx.restype = None
+    frotz_lib.setup.argtypes = [c_void_p, c_char_p, c_int, c_char_p, c_int]
     frotz_lib.setup.restype = c_char_p
-    frotz_lib.shutdown.argtypes = []
+    frotz_lib.shutdown.argtypes = [c_void_p]
     frotz_lib.shutdown.restype = None
-    frotz_lib.step.argtypes = [c_char_p]
+    frotz_lib.step.argtypes = [c_void_p, c_char_p]
     frotz_lib.step.restype = c_char_p
-    frotz_lib.save.argtypes = [c_char_p]
+    frotz_lib.set_decode_cache.argtypes = [c_void_p, c_int]
+    frotz_lib.set_decode_cache.restype = None
+    frotz_lib.set_insn_fusion.argtypes = [c_void_p, c_int]
+    frotz_lib.set_insn_fusion.restype = None
+    frotz_lib.set_object_index.argtypes = [c_void_p, c_int]
+    frotz_lib.set_object_index.restype = None
+    frotz_lib.set_auto_undo.argtypes = [c_void_p, c_int]
+    frotz_lib.set_auto_undo.restype = None
+    frotz_lib.set_headless_probing.argtypes = [c_void_p, c_int]
+    frotz_lib.set_headless_probing.restype = None
+    frotz_lib.set_profiling.argtypes = [c_void_p, c_int]
+    frotz_lib.set_profiling.restype = None
+    frotz_lib.get_profile_opcodes.argtypes = [c_void_p, c_void_p, c_void_p]
+    frotz_lib.get_profile_opcodes.restype = c_longlong
+    frotz_lib.get_profile_routines.argtypes = [c_void_p, c_void_p, c_void_p, c_void_p, c_int]
+    frotz_lib.get_profile_routines.restype = int
+    frotz_lib.step_batch.argtypes = [POINTER(c_void_p), POINTER(c_char_p), c_int, c_char_p, c_int,
+                                     c_void_p, c_void_p, c_void_p, c_void_p, c_void_p]
+    frotz_lib.step_batch.restype = None
+    frotz_lib.save.argtypes = [c_void_p, c_char_p]
     frotz_lib.save.restype = int
-    frotz_lib.restore.argtypes = [c_char_p]
+    frotz_lib.restore.argtypes = [c_void_p, c_char_p]
     frotz_lib.restore.restype = int
-    frotz_lib.get_object.argtypes = [c_void_p, c_int]
+    frotz_lib.get_object.argtypes = [c_void_p, c_void_p, c_int]
     frotz_lib.get_object.restype = None
-    frotz_lib.get_num_world_objs.argtypes = []
+    frotz_lib.get_num_world_objs.argtypes = [c_void_p]
     frotz_lib.get_num_world_objs.restype = int
-    frotz_lib.get_world_objects.argtypes = [POINTER(ZObject), c_int]
+    frotz_lib.get_world_objects.argtypes = [c_void_p, POINTER(ZObject), c_int]
     frotz_lib.get_world_objects.restype = None
-    frotz_lib.get_self_object_num.argtypes = []
+    frotz_lib.get_self_object_num.argtypes = [c_void_p]
     frotz_lib.get_self_object_num.restype = int
-    frotz_lib.get_moves.argtypes = []
+    frotz_lib.get_moves.argtypes = [c_void_p]
     frotz_lib.get_moves.restype = int
-    frotz_lib.get_score.argtypes = []
+    frotz_lib.get_score.argtypes = [c_void_p]
     frotz_lib.get_score.restype = c_short
-    frotz_lib.get_max_score.argtypes = []
+    frotz_lib.get_max_score.argtypes = [c_void_p]
     frotz_lib.get_max_score.restype = int
-    frotz_lib.save_str.argtypes = [c_void_p]
+    frotz_lib.save_str.argtypes = [c_void_p, c_void_p]
     frotz_lib.save_str.restype = int
-    frotz_lib.restore_str.argtypes = [c_void_p]
+    frotz_lib.restore_str.argtypes = [c_void_p, c_void_p]
     frotz_lib.restore_str.restype = int
-    frotz_lib.world_changed.argtypes = []
+    frotz_lib.quetzal_bound.argtypes = [c_void_p]
+    frotz_lib.quetzal_bound.restype = int
+    frotz_lib.quetzal_export.argtypes = [c_void_p, c_void_p, c_int]
+    frotz_lib.quetzal_export.restype = int
+    frotz_lib.quetzal_import.argtypes = [c_void_p, c_void_p, c_int]
+    frotz_lib.quetzal_import.restype = int
+    frotz_lib.world_changed.argtypes = [c_void_p]
     frotz_lib.world_changed.restype = int
-    frotz_lib.get_cleaned_world_diff.argtypes = [c_void_p, c_void_p]
+    frotz_lib.get_cleaned_world_diff.argtypes = [c_void_p, c_void_p, c_void_p]
     frotz_lib.get_cleaned_world_diff.restype = None
-    frotz_lib.game_over.argtypes = []
+    frotz_lib.game_over.argtypes = [c_void_p]
     frotz_lib.game_over.restype = int
-    frotz_lib.victory.argtypes = []
+    frotz_lib.victory.argtypes = [c_void_p]
     frotz_lib.victory.restype = int
-    frotz_lib.halted.argtypes = []
+    frotz_lib.halted.argtypes = [c_void_p]
     frotz_lib.halted.restype = int
+    frotz_lib.set_max_instructions.argtypes = [c_void_p, c_long]
+    frotz_lib.set_max_instructions.restype = None
+    frotz_lib.timed_out.argtypes = [c_void_p]
+    frotz_lib.timed_out.restype = int
 
-    frotz_lib.filter_candidate_actions.argtypes = [c_char_p, c_char_p, c_void_p]
+    frotz_lib.filter_candidate_actions.argtypes = [c_void_p, c_char_p, c_char_p, c_void_p]
     frotz_lib.filter_candidate_actions.restype = int
+    frotz_lib.filter_candidate_actions_parallel.argtypes = [c_void_p, c_char_p, c_char_p, c_void_p, c_int]
+    frotz_lib.filter_candidate_actions_parallel.restype = int
 
-    frotz_lib.getRAMSize.argtypes = []
+    frotz_lib.getRAMSize.argtypes = [c_void_p]
     frotz_lib.getRAMSize.restype = int
-    frotz_lib.getRAM.argtypes = [c_void_p]
+    frotz_lib.getRAM.argtypes = [c_void_p, c_void_p]
     frotz_lib.getRAM.restype = None
 
-    frotz_lib.get_special_ram_size.argtypes = []
+    frotz_lib.get_special_ram_size.argtypes = [c_void_p]
     frotz_lib.get_special_ram_size.restype = int
-    frotz_lib.get_special_ram.argtypes = [c_void_p]
+    frotz_lib.get_special_ram.argtypes = [c_void_p, c_void_p]
     frotz_lib.get_special_ram.restype = None
 
-    frotz_lib.get_narrative_text.argtypes = []
+    frotz_lib.get_narrative_text.argtypes = [c_void_p]
     frotz_lib.get_narrative_text.restype = c_char_p
-    frotz_lib.set_narrative_text.argtypes = [c_char_p]
+    frotz_lib.set_narrative_text.argtypes = [c_void_p, c_char_p]
     frotz_lib.set_narrative_text.restype = None
 
-    frotz_lib.getPC.argtypes = []
+    frotz_lib.getPC.argtypes = [c_void_p]
     frotz_lib.getPC.restype = int
-    frotz_lib.setPC.argtypes = [c_int]
+    frotz_lib.setPC.argtypes = [c_void_p, c_int]
     frotz_lib.setPC.restype = None
 
-    frotz_lib.getSP.argtypes = []
+    frotz_lib.getSP.argtypes = [c_void_p]
     frotz_lib.getSP.restype = int
-    frotz_lib.setSP.argtypes = [c_int]
+    frotz_lib.setSP.argtypes = [c_void_p, c_int]
     frotz_lib.setSP.restype = None
 
-    frotz_lib.getFP.argtypes = []
+    frotz_lib.getFP.argtypes = [c_void_p]
     frotz_lib.getFP.restype = int
-    frotz_lib.setFP.argtypes = [c_int]
+    frotz_lib.setFP.argtypes = [c_void_p, c_int]
     frotz_lib.setFP.restype = None
 
-    frotz_lib.getFrameCount.argtypes = []
+    frotz_lib.getFrameCount.argtypes = [c_void_p]
     frotz_lib.getFrameCount.restype = int
-    frotz_lib.setFrameCount.argtypes = [c_int]
+    frotz_lib.setFrameCount.argtypes = [c_void_p, c_int]
     frotz_lib.setFrameCount.restype = None
 
-    frotz_lib.getRngA.argtypes = []
+    frotz_lib.getRngA.argtypes = [c_void_p]
     frotz_lib.getRngA.restype = np.int64
-    frotz_lib.getRngInterval.argtypes = []
+    frotz_lib.getRngInterval.argtypes = [c_void_p]
     frotz_lib.getRngInterval.restype = int
-    frotz_lib.getRngCounter.argtypes = []
+    frotz_lib.getRngCounter.argtypes = [c_void_p]
     frotz_lib.getRngCounter.restype = int
-    frotz_lib.setRng.argtypes = [c_long, c_int, c_int]
+    frotz_lib.setRng.argtypes = [c_void_p, c_long, c_int, c_int]
     frotz_lib.setRng.restype = None
 
-    frotz_lib.getRAMSize.argtypes = []
+    frotz_lib.getRAMSize.argtypes = [c_void_p]
     frotz_lib.getRAMSize.restype = int
-    frotz_lib.getRAM.argtypes = [c_void_p]
+    frotz_lib.getRAM.argtypes = [c_void_p, c_void_p]
     frotz_lib.getRAM.restype = None
-    frotz_lib.setRAM.argtypes = [c_void_p]
+    frotz_lib.setRAM.argtypes = [c_void_p, c_void_p]
     frotz_lib.setRAM.restype = None
-    frotz_lib.getStack.argtypes = [c_void_p]
+    frotz_lib.set_checkpoint.argtypes = [c_void_p]
+    frotz_lib.set_checkpoint.restype = None
+    frotz_lib.restore_checkpoint.argtypes = [c_void_p]
+    frotz_lib.restore_checkpoint.restype = int
+    frotz_lib.snap_take.argtypes = [c_void_p]
+    frotz_lib.snap_take.restype = c_void_p
+    frotz_lib.snap_restore.argtypes = [c_void_p, c_void_p]
+    frotz_lib.snap_restore.restype = int
+    frotz_lib.snap_free.argtypes = [c_void_p]
+    frotz_lib.snap_free.restype = None
+    frotz_lib.snap_private_size.argtypes = [c_void_p]
+    frotz_lib.snap_private_size.restype = c_long
+    frotz_lib.set_undo_limits.argtypes = [c_void_p, c_int, c_long]
+    frotz_lib.set_undo_limits.restype = None
+    frotz_lib.undo_push.argtypes = [c_void_p]
+    frotz_lib.undo_push.restype = int
+    frotz_lib.undo_pop.argtypes = [c_void_p, c_int]
+    frotz_lib.undo_pop.restype = int
+    frotz_lib.undo_depth.argtypes = [c_void_p]
+    frotz_lib.undo_depth.restype = int
+    frotz_lib.undo_memory_size.argtypes = [c_void_p]
+    frotz_lib.undo_memory_size.restype = c_long
+    frotz_lib.undo_clear.argtypes = [c_void_p]
+    frotz_lib.undo_clear.restype = None
+    frotz_lib.state_size.argtypes = [c_void_p]
+    frotz_lib.state_size.restype = int
+    frotz_lib.state_pack.argtypes = [c_void_p, c_void_p]
+    frotz_lib.state_pack.restype = int
+    frotz_lib.state_unpack.argtypes = [c_void_p, c_void_p, c_int]
+    frotz_lib.state_unpack.restype = int
+    frotz_lib.state_delta_bound.argtypes = [c_void_p, c_int]
+    frotz_lib.state_delta_bound.restype = int
+    frotz_lib.state_delta.argtypes = [c_void_p, c_void_p, c_int, c_void_p, c_int]
+    frotz_lib.state_delta.restype = int
+    frotz_lib.state_apply_delta.argtypes = [c_void_p, c_void_p, c_int, c_void_p, c_int]
+    frotz_lib.state_apply_delta.restype = int
+    frotz_lib.store_create.argtypes = [c_int]
+    frotz_lib.store_create.restype = c_void_p
+    frotz_lib.store_free.argtypes = [c_void_p]
+    frotz_lib.store_free.restype = None
+    frotz_lib.store_add.argtypes = [c_void_p, c_void_p, POINTER(c_int)]
+    frotz_lib.store_add.restype = c_long
+    frotz_lib.store_restore.argtypes = [c_void_p, c_void_p, c_long]
+    frotz_lib.store_restore.restype = int
+    frotz_lib.store_num_states.argtypes = [c_void_p]
+    frotz_lib.store_num_states.restype = c_long
+    frotz_lib.store_num_pages.argtypes = [c_void_p]
+    frotz_lib.store_num_pages.restype = c_long
+    frotz_lib.store_memory_size.argtypes = [c_void_p]
+    frotz_lib.store_memory_size.restype = c_long
+    frotz_lib.getStack.argtypes = [c_void_p, c_void_p]
     frotz_lib.getStack.restype = None
-    frotz_lib.setStack.argtypes = [c_void_p]
+    frotz_lib.setStack.argtypes = [c_void_p, c_void_p]
     frotz_lib.setStack.restype = None
-    frotz_lib.getStackSize.argtypes = []
+    frotz_lib.getLiveStackSize.argtypes = [c_void_p]
+    frotz_lib.getLiveStackSize.restype = int
+    frotz_lib.getLiveStack.argtypes = [c_void_p, c_void_p]
+    frotz_lib.getLiveStack.restype = None
+    frotz_lib.setLiveStack.argtypes = [c_void_p, c_void_p, c_int]
+    frotz_lib.setLiveStack.restype = None
+    frotz_lib.getStackSize.argtypes = [c_void_p]
     frotz_lib.getStackSize.restype = int
 
-    frotz_lib.get_opcode.argtypes = []
+    frotz_lib.get_opcode.argtypes = [c_void_p]
     frotz_lib.get_opcode.restype = int
-    frotz_lib.set_opcode.argtypes = [c_int]
+    frotz_lib.set_opcode.argtypes = [c_void_p, c_int]
     frotz_lib.set_opcode.restype = None
 
     frotz_lib.disassemble.argtypes = [c_char_p]
     frotz_lib.disassemble.restype = None
-    frotz_lib.is_supported.argtypes = [c_char_p]
+    frotz_lib.is_supported.argtypes = [c_void_p, c_char_p]
     frotz_lib.is_supported.restype = int
     frotz_lib.get_dictionary_word_count.argtypes = [c_char_p]
     frotz_lib.get_dictionary_word_count.restype = int
@@ -336,6 +433,8 @@ def _load_frotz_lib():
     frotz_lib.get_dictionary.restype = None
     frotz_lib.ztools_cleanup.argtypes = []
     frotz_lib.ztools_cleanup.restype = None
+
+    _frotz_lib = frotz_lib
     return frotz_lib
 
 
@@ -360,6 +459,84 @@ def _load_bindings(md5hash):
     return defines.BINDINGS_DICT.get(md5hash, {})
 
 
+class Snapshot:
+    '''
+    Copy-on-write snapshot of a game state, as returned by
+    :meth:`jericho.FrotzEnv.take_snapshot`. Its memory is released when
+    the object is garbage collected.
+
+    '''
+    def __init__(self, frotz_lib, handle):
+        self._frotz_lib = frotz_lib
+        self._handle = handle
+
+    def __del__(self):
+        self._frotz_lib.snap_free(self._handle)
+
+    def private_size(self):
+        ''' Returns the number of bytes of game memory not shared with any other snapshot. '''
+        return self._frotz_lib.snap_private_size(self._handle)
+
+
+class StateStore:
+    '''
+    Store of game states that keeps each distinct page of their memory only
+    once. States are identified by the integer ID returned when adding them,
+    and identical states share the same ID, which makes the store suitable
+    as a visited set. A store may be used from several threads and with any
+    FrotzEnv playing the same game.
+
+    :param page_size: Size in bytes of the pages states are split into.
+    :type page_size: int
+
+    >>> from jericho import *
+    >>> env = FrotzEnv(rom_path)
+    >>> store = StateStore()
+    >>> state_id, is_new = store.add(env)
+    >>> env.step('open mailbox')
+    >>> store.restore(env, state_id)
+
+    '''
+    def __init__(self, page_size=256):
+        self._frotz_lib = _load_frotz_lib()
+        self._handle = self._frotz_lib.store_create(page_size)
+        if not self._handle:
+            raise MemoryError("Not enough memory to create a state store.")
+
+    def __del__(self):
+        if getattr(self, '_handle', None):
+            self._frotz_lib.store_free(self._handle)
+
+    def __len__(self):
+        return self._frotz_lib.store_num_states(self._handle)
+
+    def add(self, env):
+        '''
+        Adds the current state of env to the store.
+
+        :returns: Tuple of (state_id, is_new), is_new being False if an\
+        identical state was already stored.
+        '''
+        is_new = c_int()
+        state_id = self._frotz_lib.store_add(self._handle, env._ctx, byref(is_new))
+        if state_id < 0:
+            raise MemoryError("Not enough memory to store the state.")
+        return state_id, bool(is_new.value)
+
+    def restore(self, env, state_id):
+        ''' Restores env to a stored state. '''
+        if self._frotz_lib.store_restore(self._handle, env._ctx, state_id) < 0:
+            raise ValueError("No state {} for this game in the store.".format(state_id))
+
+    def num_pages(self):
+        ''' Returns the number of distinct pages stored. '''
+        return self._frotz_lib.store_num_pages(self._handle)
+
+    def memory_size(self):
+        ''' Returns the number of bytes used by the stored states. '''
+        return self._frotz_lib.store_memory_size(self._handle)
+
+
 class UnsupportedGameWarning(UserWarning):
     pass
 
@@ -383,13 +560,19 @@ class FrotzEnv():
     def __init__(self, story_file, seed=None):
         self._cache = {}
         self.frotz_lib = _load_frotz_lib()
+        self._ctx = self.frotz_lib.create_ctx()
+        if not self._ctx:
+            raise MemoryError("Unable to allocate a Z-machine context.")
         self._bindings = None
+        self._profile_cycles = False
         self.load(story_file, seed)
 
     def __del__(self):
-        if hasattr(self, 'frotz_lib'):
-            self.frotz_lib.shutdown()
-            dlclose_func(self.frotz_lib._handle)
+        if getattr(self, '_executor', None):
+            self._executor.shutdown(wait=False)
+        if getattr(self, '_ctx', None):
+            self.frotz_lib.free_ctx(self._ctx)
+            self._ctx = None
 
     def load(self, story_file, seed=None):
         '''
@@ -411,7 +594,7 @@ class FrotzEnv():
             with open(story_file, "rb") as f:
                 rom = f.read()
 
-            self.is_fully_supported = bool(self.frotz_lib.is_supported(self.story_file))
+            self.is_fully_supported = bool(self.frotz_lib.is_supported(self._ctx, self.story_file))
             if not self.is_fully_supported:
                 msg = ("Game '{}' is not fully supported. Score, move, change"
                     " detection will be disabled.").format(story_file)
@@ -426,8 +609,10 @@ class FrotzEnv():
         rom, self._bindings, self.act_gen = self._cache[story_file]
 
         self.seed(seed)
-        self.frotz_lib.setup(self.story_file, self._seed, rom, len(rom))
-        self.player_obj_num = self.frotz_lib.get_self_object_num()
+        self.frotz_lib.setup(self._ctx, self.story_file, self._seed, rom, len(rom))
+        if self._emulator_halted():
+            raise RuntimeError("Unable to load the story file: {}".format(story_file))
+        self.player_obj_num = self.frotz_lib.get_self_object_num(self._ctx)
 
     def seed(self, seed=None):
         '''
@@ -457,8 +642,8 @@ class FrotzEnv():
         '''
         self.close()
         rom, _, _ = self._cache[self.story_file.decode()]
-        obs_ini = self.frotz_lib.setup(self.story_file, self._seed, rom, len(rom)).decode('cp1252')
-        score = self.frotz_lib.get_score()
+        obs_ini = self.frotz_lib.setup(self._ctx, self.story_file, self._seed, rom, len(rom)).decode('cp1252')
+        score = self.frotz_lib.get_score(self._ctx)
         return obs_ini, {'moves':self.get_moves(), 'score':score}
 
     def step(self, action):
@@ -475,24 +660,69 @@ class FrotzEnv():
 
         Note:
         - The action is converted to bytes and truncated to 198 characters.
+        - An action running more instructions than allowed by\
+        :meth:`jericho.FrotzEnv.set_max_instructions` is undone, and the info\
+        has `timed_out` set.
         '''
-        action_bytes = action.encode('utf-8')
-        if len(action_bytes) > INPUT_BUFFER_SIZE:
-            action_bytes = action_bytes[:INPUT_BUFFER_SIZE]
-            msg = ("Once converted to bytes, actions should have less than 198 characters."
-                   " Action '{}' was truncated to '{}'.".format(action, action_bytes.decode()))
-            warnings.warn(msg, TruncatedInputActionWarning)
-
-        old_score = self.frotz_lib.get_score()
-        next_state = self.frotz_lib.step(action_bytes + b'\n').decode('cp1252')
-        score = self.frotz_lib.get_score()
+        old_score = self.frotz_lib.get_score(self._ctx)
+        next_state = self.frotz_lib.step(self._ctx, _encode_action(action)).decode('cp1252')
+        score = self.frotz_lib.get_score(self._ctx)
         reward = score - old_score
-        return next_state, reward, (self.game_over() or self.victory()),\
-            {'moves':self.get_moves(), 'score':score}
+        info = {'moves':self.get_moves(), 'score':score}
+        if self.frotz_lib.timed_out(self._ctx):
+            info['timed_out'] = True
+        return next_state, reward, (self.game_over() or self.victory()), info
+
+    def set_auto_undo(self, enabled):
+        '''
+        Sets whether V1-V4 games keep an undo state for every turn, as
+        standard interpreters do. These states are only used by the
+        interpreter's undo hotkey, not by :meth:`jericho.FrotzEnv.get_state`
+        or :meth:`jericho.FrotzEnv.set_state`, so turning them off makes each
+        step cheaper. On by default.
+
+        :param enabled: Whether to save an undo state before each turn.
+        :type enabled: bool
+
+        '''
+        self.frotz_lib.set_auto_undo(self._ctx, int(enabled))
+
+    def set_headless_probing(self, enabled):
+        '''
+        Sets whether :meth:`jericho.FrotzEnv.get_valid_actions` tries the
+        candidate actions headless: their output is kept as plain text,
+        skipping the bookkeeping of the screen model. The valid actions
+        found are the same. Off by default.
+
+        :param enabled: Whether to try candidate actions headless.
+        :type enabled: bool
+
+        '''
+        self.frotz_lib.set_headless_probing(self._ctx, int(enabled))
+
+    def set_max_instructions(self, max_instructions=None):
+        '''
+        Bounds the time a step may take. A step running more than
+        max_instructions Z-machine instructions is aborted and the game
+        returns to its state before the step. This also applies to each
+        action tried by :meth:`jericho.FrotzEnv.get_valid_actions`, an action
+        timing out being deemed invalid. With a limit set, each step saves
+        the state it may return to as the checkpoint of
+        :meth:`jericho.FrotzEnv.set_checkpoint`, replacing the one set before.
+
+        :param max_instructions: Instructions allowed per step, or None for no limit.
+        :type max_instructions: int
+
+        '''
+        self.frotz_lib.set_max_instructions(self._ctx, max_instructions or 0)
+
+    def timed_out(self):
+        ''' Returns True if the last step was aborted for running too many instructions. '''
+        return self.frotz_lib.timed_out(self._ctx) != 0
 
     def close(self):
         ''' Cleans up the FrotzEnv, freeing any allocated memory. '''
-        self.frotz_lib.shutdown()
+        self.frotz_lib.shutdown(self._ctx)
 
     @property
     def bindings(self):
@@ -580,8 +810,9 @@ class FrotzEnv():
         Sets the game's internal state.
 
         :param state: Tuple of (ram, stack, pc, sp, fp, frame_count, rng) as\
-        obtained by :meth:`jericho.FrotzEnv.get_state`.
-        :type state: tuple
+        obtained by :meth:`jericho.FrotzEnv.get_state`, or a packed state as\
+        obtained by :meth:`jericho.FrotzEnv.pack_state`.
+        :type state: tuple or bytes-like
 
         >>> from jericho import *
         >>> env = FrotzEnv(rom_path)
@@ -591,23 +822,30 @@ class FrotzEnv():
         >>> env.set_state(state) # Whew, let's try something else
 
         '''
+        if not isinstance(state, tuple):
+            return self.unpack_state(state)
+
         ram, stack, pc, sp, fp, frame_count, opcode, rng, narrative = state
-        self.frotz_lib.setRng(*rng)
-        self.frotz_lib.setRAM(as_ctypes(ram))
-        self.frotz_lib.setStack(as_ctypes(stack))
-        self.frotz_lib.setPC(pc)
-        self.frotz_lib.setSP(sp)
-        self.frotz_lib.setFP(fp)
-        self.frotz_lib.set_opcode(opcode)
-        self.frotz_lib.setFrameCount(frame_count)
-        self.frotz_lib.set_narrative_text(narrative)
+        self.frotz_lib.setRng(self._ctx, *rng)
+        self.frotz_lib.setRAM(self._ctx, as_ctypes(ram))
+        if len(stack) == self.frotz_lib.getStackSize(self._ctx):
+            self.frotz_lib.setStack(self._ctx, as_ctypes(stack))
+        else:
+            self.frotz_lib.setLiveStack(self._ctx, stack.ctypes.data_as(c_void_p), len(stack))
+        self.frotz_lib.setPC(self._ctx, pc)
+        self.frotz_lib.setSP(self._ctx, sp)
+        self.frotz_lib.setFP(self._ctx, fp)
+        self.frotz_lib.set_opcode(self._ctx, opcode)
+        self.frotz_lib.setFrameCount(self._ctx, frame_count)
+        self.frotz_lib.set_narrative_text(self._ctx, narrative)
 
     def get_state(self):
         '''
         Returns the internal game state. This state can be subsequently restored
         using :meth:`jericho.FrotzEnv.set_state`.
 
-        :returns: Tuple of (ram, stack, pc, sp, fp, frame_count, rng).
+        :returns: Tuple of (ram, stack, pc, sp, fp, frame_count, rng). Only the\
+        live part of the stack, from sp to its bottom, is included.
 
         >>> from jericho import *
         >>> env = FrotzEnv(rom_path)
@@ -617,23 +855,329 @@ class FrotzEnv():
         >>> env.set_state(state) # Whew, let's try something else
 
         '''
-        ram = np.zeros(self.frotz_lib.getRAMSize(), dtype=np.uint8)
-        stack = np.zeros(self.frotz_lib.getStackSize(), dtype=np.uint8)
-        self.frotz_lib.getRAM(as_ctypes(ram))
-        self.frotz_lib.getStack(as_ctypes(stack))
-        pc = self.frotz_lib.getPC()
-        sp = self.frotz_lib.getSP()
-        fp = self.frotz_lib.getFP()
-        opcode = self.frotz_lib.get_opcode()
-        frame_count = self.frotz_lib.getFrameCount()
-        rng = self.frotz_lib.getRngA(), self.frotz_lib.getRngInterval(), self.frotz_lib.getRngCounter()
-        narrative = self.frotz_lib.get_narrative_text()
+        ram = np.zeros(self.frotz_lib.getRAMSize(self._ctx), dtype=np.uint8)
+        stack = np.zeros(self.frotz_lib.getLiveStackSize(self._ctx), dtype=np.uint8)
+        self.frotz_lib.getRAM(self._ctx, as_ctypes(ram))
+        self.frotz_lib.getLiveStack(self._ctx, stack.ctypes.data_as(c_void_p))
+        pc = self.frotz_lib.getPC(self._ctx)
+        sp = self.frotz_lib.getSP(self._ctx)
+        fp = self.frotz_lib.getFP(self._ctx)
+        opcode = self.frotz_lib.get_opcode(self._ctx)
+        frame_count = self.frotz_lib.getFrameCount(self._ctx)
+        rng = self.frotz_lib.getRngA(self._ctx), self.frotz_lib.getRngInterval(self._ctx), self.frotz_lib.getRngCounter(self._ctx)
+        narrative = self.frotz_lib.get_narrative_text(self._ctx)
         state = ram, stack, pc, sp, fp, frame_count, opcode, rng, narrative
         return state
 
+    def set_checkpoint(self):
+        '''
+        Remembers the current game state inside the emulator. Unlike
+        :meth:`jericho.FrotzEnv.get_state`, nothing is copied out: returning
+        to the checkpoint with :meth:`jericho.FrotzEnv.restore_checkpoint`
+        only copies back the memory written since, which makes it the
+        cheaper option for trying many actions from the same state. There is
+        a single checkpoint, which :meth:`jericho.FrotzEnv.get_valid_actions`
+        also uses and replaces, as does every step once
+        :meth:`jericho.FrotzEnv.set_max_instructions` is set.
+
+        >>> from jericho import *
+        >>> env = FrotzEnv(rom_path)
+        >>> env.set_checkpoint()
+        >>> env.step('attack troll') # Oops!
+        'You swing and miss. The troll neatly removes your head.'
+        >>> env.restore_checkpoint() # Whew, let's try something else
+
+        '''
+        self.frotz_lib.set_checkpoint(self._ctx)
+        self._checkpoint_narrative = self.frotz_lib.get_narrative_text(self._ctx)
+
+    def restore_checkpoint(self):
+        '''
+        Returns to the game state saved by :meth:`jericho.FrotzEnv.set_checkpoint`.
+        The checkpoint is kept and may be restored again.
+
+        '''
+        if self.frotz_lib.restore_checkpoint(self._ctx) < 0:
+            raise RuntimeError("No checkpoint to restore. Call set_checkpoint first.")
+        self.frotz_lib.set_narrative_text(self._ctx, self._checkpoint_narrative)
+
+    def enable_profiling(self, cycles=False):
+        '''
+        Starts counting the instructions the emulator runs, per opcode and
+        per routine of the game, from an empty profile. The profile is kept
+        across :meth:`jericho.FrotzEnv.reset` and read with
+        :meth:`jericho.FrotzEnv.get_profile`.
+
+        :param cycles: Also measure the CPU cycles spent on each opcode (x86 only).
+        :type cycles: boolean
+
+        '''
+        self.frotz_lib.set_profiling(self._ctx, 2 if cycles else 1)
+        self._profile_cycles = cycles
+
+    def disable_profiling(self):
+        '''
+        Stops profiling and discards the profile.
+        '''
+        self.frotz_lib.set_profiling(self._ctx, 0)
+
+    def get_profile(self, top_n=20):
+        '''
+        Returns the profile gathered since :meth:`jericho.FrotzEnv.enable_profiling`.
+
+        :param top_n: Number of routines to report.
+        :type top_n: int
+        :returns: A dictionary with the total number of `instructions` run,\
+        the number of executions of each opcode by name in `opcodes`, the\
+        CPU cycles per opcode in `cycles` if requested, and in `routines` the\
+        (byte address, calls, instructions) of the routines running the most\
+        instructions, including the routines they call.
+
+        >>> from jericho import *
+        >>> env = FrotzEnv(rom_path)
+        >>> env.enable_profiling()
+        >>> env.step('open mailbox')
+        >>> env.get_profile(top_n=1)
+        {'instructions': 15873, 'opcodes': {'je': 2960, 'jz': 1514, ...}, 'routines': [(20200, 1, 15802)]}
+
+        '''
+        counts = np.zeros(0x120, dtype=np.uint64)
+        cycles = np.zeros(0x120, dtype=np.uint64)
+        total = self.frotz_lib.get_profile_opcodes(self._ctx, counts.ctypes.data_as(c_void_p),
+                                                   cycles.ctypes.data_as(c_void_p))
+        if total < 0:
+            raise RuntimeError("Profiling is off. Call enable_profiling first.")
+
+        profile = {'instructions': total, 'opcodes': defaultdict(int)}
+        if self._profile_cycles:
+            profile['cycles'] = defaultdict(int)
+        for op in np.nonzero(counts)[0]:
+            name = defines.opcode_name(int(op))
+            profile['opcodes'][name] += int(counts[op])
+            if self._profile_cycles:
+                profile['cycles'][name] += int(cycles[op])
+
+        addrs = np.zeros(top_n, dtype=np.int64)
+        calls = np.zeros(top_n, dtype=np.uint64)
+        instructions = np.zeros(top_n, dtype=np.uint64)
+        n = self.frotz_lib.get_profile_routines(self._ctx, addrs.ctypes.data_as(c_void_p),
+                                                calls.ctypes.data_as(c_void_p),
+                                                instructions.ctypes.data_as(c_void_p), top_n)
+        profile['routines'] = [(int(addrs[i]), int(calls[i]), int(instructions[i])) for i in range(n)]
+        return profile
+
+    def take_snapshot(self):
+        '''
+        Returns a :class:`jericho.Snapshot` of the current game state. Snapshots
+        share the pages of dynamic memory they have in common, so a large
+        number of them can be kept alive at a small cost. A snapshot may be
+        restored on any FrotzEnv playing the same game.
+
+        >>> from jericho import *
+        >>> env = FrotzEnv(rom_path)
+        >>> snap = env.take_snapshot()
+        >>> env.step('attack troll') # Oops!
+        'You swing and miss. The troll neatly removes your head.'
+        >>> env.restore_snapshot(snap) # Whew, let's try something else
+
+        '''
+        handle = self.frotz_lib.snap_take(self._ctx)
+        if not handle:
+            raise MemoryError("Not enough memory to take a snapshot.")
+        return Snapshot(self.frotz_lib, handle)
+
+    def restore_snapshot(self, snapshot):
+        '''
+        Restores the game state saved in a snapshot obtained by
+        :meth:`jericho.FrotzEnv.take_snapshot`.
+
+        :param snapshot: Snapshot to restore.
+        :type snapshot: :class:`jericho.Snapshot`
+
+        '''
+        if self.frotz_lib.snap_restore(self._ctx, snapshot._handle) < 0:
+            raise ValueError("Snapshot was taken on a different game.")
+
+    def push_undo(self):
+        '''
+        Saves the current game state on top of the undo stack, to be returned
+        to with :meth:`jericho.FrotzEnv.pop_undo`. Each level only stores the
+        bytes changed since the level below, which suits depth-first searches
+        backtracking to the states they came from.
+
+        >>> from jericho import *
+        >>> env = FrotzEnv(rom_path)
+        >>> env.push_undo()
+        1
+        >>> env.step('attack troll') # Oops!
+        'You swing and miss. The troll neatly removes your head.'
+        >>> env.pop_undo() # Whew, let's try something else
+        0
+
+        :returns: The depth of the undo stack.
+
+        '''
+        depth = self.frotz_lib.undo_push(self._ctx)
+        if depth < 0:
+            raise MemoryError("Not enough memory to save an undo state.")
+        return depth
+
+    def pop_undo(self, count=1):
+        '''
+        Removes the count newest levels of the undo stack and restores the
+        game state saved by the last one removed.
+
+        :param count: Number of levels to go back.
+        :type count: int
+        :returns: The depth of the undo stack.
+
+        '''
+        depth = self.frotz_lib.undo_pop(self._ctx, count)
+        if depth < 0:
+            raise ValueError("The undo stack holds fewer than {} states.".format(count))
+        return depth
+
+    def undo_depth(self):
+        ''' Returns the number of states on the undo stack. '''
+        return self.frotz_lib.undo_depth(self._ctx)
+
+    def undo_memory_size(self):
+        ''' Returns the number of bytes used by the states on the undo stack. '''
+        return self.frotz_lib.undo_memory_size(self._ctx)
+
+    def set_undo_limits(self, max_depth=None, max_bytes=None):
+        '''
+        Bounds the undo stack. The oldest states are dropped when it holds
+        more than max_depth states or more than max_bytes bytes, though the
+        newest state is always kept.
+
+        :param max_depth: Most states kept, or None for no limit.
+        :type max_depth: int
+        :param max_bytes: Most bytes used, or None for no limit.
+        :type max_bytes: int
+
+        '''
+        self.frotz_lib.set_undo_limits(self._ctx, max_depth or 0, max_bytes or 0)
+
+    def clear_undo(self):
+        ''' Empties the undo stack. '''
+        self.frotz_lib.undo_clear(self._ctx)
+
+    def pack_state(self, out=None):
+        '''
+        Returns the internal game state serialized into a single flat buffer
+        of bytes. It holds the same information as :meth:`jericho.FrotzEnv.get_state`
+        and can be restored with :meth:`jericho.FrotzEnv.set_state` or
+        :meth:`jericho.FrotzEnv.unpack_state`.
+
+        :param out: Optional uint8 array to write the state into, e.g. a view\
+        on shared memory. It must hold at least :meth:`jericho.FrotzEnv.state_size` bytes.
+        :type out: numpy.ndarray
+        :returns: uint8 numpy array holding the packed state.
+
+        '''
+        size = self.frotz_lib.state_size(self._ctx)
+        if out is None:
+            out = np.empty(size, dtype=np.uint8)
+        elif out.nbytes < size:
+            raise ValueError("Buffer of {} bytes too small for a state of {} bytes.".format(out.nbytes, size))
+
+        out = out.reshape(-1).view(np.uint8)[:size]
+        self.frotz_lib.state_pack(self._ctx, out.ctypes.data_as(c_void_p))
+        return out
+
+    def unpack_state(self, state):
+        '''
+        Restores a game state packed by :meth:`jericho.FrotzEnv.pack_state`.
+
+        :param state: Packed state.
+        :type state: bytes-like
+
+        '''
+        buf = np.frombuffer(state, dtype=np.uint8)
+        if self.frotz_lib.state_unpack(self._ctx, buf.ctypes.data_as(c_void_p), buf.nbytes) < 0:
+            raise ValueError("Not a packed state of this game.")
+
+    def state_delta(self, base):
+        '''
+        Returns the current game state encoded as its difference from a base
+        state packed by :meth:`jericho.FrotzEnv.pack_state`. States close to
+        their base, such as siblings in a search tree, take a few bytes.
+
+        :param base: Packed state the delta is relative to.
+        :type base: bytes-like
+        :returns: uint8 numpy array holding the delta.
+
+        >>> from jericho import *
+        >>> env = FrotzEnv(rom_path)
+        >>> base = env.pack_state()
+        >>> env.step('open mailbox')
+        >>> delta = env.state_delta(base)
+        >>> env.apply_state_delta(base, delta) # Back to after opening the mailbox
+
+        '''
+        base = np.frombuffer(base, dtype=np.uint8)
+        out = np.empty(self.frotz_lib.state_delta_bound(self._ctx, base.nbytes), dtype=np.uint8)
+        size = self.frotz_lib.state_delta(self._ctx, base.ctypes.data_as(c_void_p), base.nbytes,
+                                          out.ctypes.data_as(c_void_p), out.nbytes)
+        return out[:size].copy()
+
+    def apply_state_delta(self, base, delta):
+        '''
+        Restores the game state made of a packed base state and a delta
+        obtained by :meth:`jericho.FrotzEnv.state_delta`.
+
+        :param base: Packed state the delta is relative to.
+        :type base: bytes-like
+        :param delta: Delta to apply.
+        :type delta: bytes-like
+
+        '''
+        base = np.frombuffer(base, dtype=np.uint8)
+        delta = np.frombuffer(delta, dtype=np.uint8)
+        if self.frotz_lib.state_apply_delta(self._ctx, base.ctypes.data_as(c_void_p), base.nbytes,
+                                            delta.ctypes.data_as(c_void_p), delta.nbytes) < 0:
+            raise ValueError("Delta does not apply to this base state.")
+
+    def state_size(self):
+        ''' Returns the size in bytes of the current game state once packed. '''
+        return self.frotz_lib.state_size(self._ctx)
+
+    def quetzal_export(self):
+        '''
+        Returns the current game state as a Quetzal save file, written
+        directly without running the game's save routine. The save resumes
+        at the current point of the game and can be restored with
+        :meth:`jericho.FrotzEnv.quetzal_import`, in any FrotzEnv playing
+        the same game. Like saves made by the game, it holds the state of
+        the Z-machine only, not the random number generator nor the last
+        observation.
+
+        :returns: uint8 numpy array holding the save.
+
+        '''
+        out = np.empty(self.frotz_lib.quetzal_bound(self._ctx), dtype=np.uint8)
+        size = self.frotz_lib.quetzal_export(self._ctx, out.ctypes.data_as(c_void_p), out.nbytes)
+        if size < 0:
+            raise RuntimeError("Unable to save the game state.")
+        return out[:size].copy()
+
+    def quetzal_import(self, save):
+        '''
+        Restores the game state from a save obtained by
+        :meth:`jericho.FrotzEnv.quetzal_export`.
+
+        :param save: Quetzal save to restore.
+        :type save: bytes-like
+
+        '''
+        save = np.frombuffer(save, dtype=np.uint8)
+        if self.frotz_lib.quetzal_import(self._ctx, save.ctypes.data_as(c_void_p), save.nbytes) < 0:
+            raise ValueError("Not a save of this game.")
+
     def get_max_score(self):
         ''' Returns the integer maximum possible score for the game. '''
-        return self.frotz_lib.get_max_score()
+        return self.frotz_lib.get_max_score(self._ctx)
 
     def copy(self):
         ''' Forks this FrotzEnv instance. '''
@@ -656,7 +1200,7 @@ class FrotzEnv():
         :type obj_num: int
         '''
         obj = ZObject()
-        self.frotz_lib.get_object(byref(obj), obj_num)
+        self.frotz_lib.get_object(self._ctx, byref(obj), obj_num)
         if obj.num < 0:
             return None
         return obj
@@ -686,9 +1230,9 @@ class FrotzEnv():
          Obj250: board Parent249 Sibling73 Child0 Attributes [14] Properties [18, 17]
 
         '''
-        n_objs = self.frotz_lib.get_num_world_objs()
+        n_objs = self.frotz_lib.get_num_world_objs(self._ctx)
         objs = (ZObject * (n_objs+1))() # Add extra spot for zero'th object
-        self.frotz_lib.get_world_objects(objs, clean)
+        self.frotz_lib.get_world_objects(self._ctx, objs, clean)
         return objs
 
     def get_player_object(self):
@@ -739,19 +1283,19 @@ class FrotzEnv():
 
     def get_moves(self):
         ''' Returns the integer number of moves taken by the player in the current episode. '''
-        return self.frotz_lib.get_moves()
+        return self.frotz_lib.get_moves(self._ctx)
 
     def get_score(self):
         ''' Returns the integer current game score. '''
-        return self.frotz_lib.get_score()
+        return self.frotz_lib.get_score(self._ctx)
 
     def victory(self):
         ''' Returns `True` if the game is over and the player has won. '''
-        return self.frotz_lib.victory() > 0
+        return self.frotz_lib.victory(self._ctx) > 0
 
     def game_over(self):
         ''' Returns `True` if the game is over and the player has lost. '''
-        return self.frotz_lib.game_over() > 0
+        return self.frotz_lib.game_over(self._ctx) > 0
 
     def _disassemble_game(self):
         ''' Prints the subroutines and strings used by the game. '''
@@ -759,7 +1303,7 @@ class FrotzEnv():
 
     def _emulator_halted(self):
         ''' Returns `True` if the emulator has halted. To fix a halted game, use :meth:`jericho.FrotzEnv.reset`. '''
-        return self.frotz_lib.halted() > 0
+        return self.frotz_lib.halted(self._ctx) > 0
 
     def _world_changed(self):
         ''' Returns True if the last action caused a change in the world.
@@ -777,7 +1321,7 @@ class FrotzEnv():
         >>> env.world_changed()
         False
         '''
-        return self.frotz_lib.world_changed() > 0
+        return self.frotz_lib.world_changed(self._ctx) > 0
 
     def _get_world_diff(self):
         '''
@@ -791,7 +1335,7 @@ class FrotzEnv():
         '''
         objs = np.zeros(64, dtype=np.uint16)
         dest = np.zeros(64, dtype=np.uint16)
-        self.frotz_lib.get_cleaned_world_diff(as_ctypes(objs), as_ctypes(dest))
+        self.frotz_lib.get_cleaned_world_diff(self._ctx, as_ctypes(objs), as_ctypes(dest))
         # First 16 spots allocated for objects that have moved
         moved_objs = []
         for i in range(16):
@@ -935,18 +1479,22 @@ class FrotzEnv():
         self.set_state(state)
         return desc2obj
 
-    def _filter_candidate_actions(self, candidate_actions, use_ctypes=False, use_parallel=False):
+    def _filter_candidate_actions(self, candidate_actions, use_ctypes=False, use_parallel=False, num_workers=0):
         """
         Given a list of candidate actions, returns a dictionary mapping world_diff
         to the list of candidate actions that cause this diff. Only actions that
-        cause a valid world diff are returned.
+        cause a valid world diff are returned. Actions halting the emulator
+        are skipped.
 
         :param candidate_actions: Candidate actions to test for validity.
         :type candidate_actions: list
         :param use_ctypes: Uses the optimized ctypes implementation of valid action filtering.
         :type use_ctypes: boolean
-        :param use_parallel: Uses the parallized implementation of valid action filtering.
+        :param use_parallel: Uses the parallized implementation of valid action filtering.\
+        Combined with `use_ctypes`, candidates are split among native threads.
         :type use_parallel: boolean
+        :param num_workers: Number of native threads to use. Default: one per core.
+        :type num_workers: int
         :returns: Dictionary of world_diff to list of actions.
 
         """
@@ -958,13 +1506,36 @@ class FrotzEnv():
         state = self.get_state()
         diff2acts = defaultdict(list)
 
-        if use_parallel:
-            state = self.get_state()
-            if not hasattr(self, 'pool'):
-                self.pool = mp.Pool(initializer=init_worker, initargs=(self.story_file.decode(), self._seed))
+        if use_parallel and use_ctypes:
+            candidate_str = (";".join(candidate_actions)).encode('utf-8')
+            valid_str = (' '*(len(candidate_str)+1)).encode('utf-8')
+
+            DIFF_SIZE = 128
+            diff_array = np.zeros(len(candidate_actions) * DIFF_SIZE, dtype=np.uint16)
+            valid_cnt = self.frotz_lib.filter_candidate_actions_parallel(
+                self._ctx,
+                candidate_str,
+                valid_str,
+                as_ctypes(diff_array),
+                num_workers
+            )
+
+            valid_acts = valid_str.decode('cp1252').strip().split(';')[:-1]
+            for i in range(valid_cnt):
+                diff = tuple(diff_array[i*DIFF_SIZE:(i+1)*DIFF_SIZE])
+                diff2acts[diff].append(valid_acts[i])
 
-            args = [(state, actions, use_ctypes) for actions in chunk(candidate_actions, n=self.pool._processes)]
-            list_diff2acts = self.pool.map(worker, args)
+        elif use_parallel:
+            # Each worker thread drives its own Z-machine. Calls into frotz_lib
+            # release the GIL, so the workers run concurrently.
+            if not hasattr(self, '_workers'):
+                self._workers = [FrotzEnv(self.story_file.decode(), self._seed)
+                                 for _ in range(os.cpu_count() or 1)]
+                self._executor = ThreadPoolExecutor(max_workers=len(self._workers))
+
+            chunks = chunk(candidate_actions, n=len(self._workers))
+            list_diff2acts = self._executor.map(worker, self._workers, [state] * len(chunks),
+                                                chunks, [use_ctypes] * len(chunks))
             for d in list_diff2acts:
                 for k, v in d.items():
                     diff2acts[k].extend(v)
@@ -976,13 +1547,11 @@ class FrotzEnv():
             DIFF_SIZE = 128
             diff_array = np.zeros(len(candidate_actions) * DIFF_SIZE, dtype=np.uint16)
             valid_cnt = self.frotz_lib.filter_candidate_actions(
+                self._ctx,
                 candidate_str,
                 valid_str,
                 as_ctypes(diff_array)
             )
-            if self._emulator_halted():
-                self.reset()
-
             valid_acts = valid_str.decode('cp1252').strip().split(';')[:-1]
             for i in range(valid_cnt):
                 diff = tuple(diff_array[i*DIFF_SIZE:(i+1)*DIFF_SIZE])
@@ -1014,9 +1583,9 @@ class FrotzEnv():
         Returns a numpy array containing the contents of the Z-Machine's RAM.
 
         """
-        ram_size = self.frotz_lib.getRAMSize()
+        ram_size = self.frotz_lib.getRAMSize(self._ctx)
         ram = np.zeros(ram_size, dtype=np.uint8)
-        self.frotz_lib.getRAM(as_ctypes(ram))
+        self.frotz_lib.getRAM(self._ctx, as_ctypes(ram))
         return ram
 
     def _get_special_ram(self):
@@ -1024,7 +1593,56 @@ class FrotzEnv():
         Returns a numpy array containing the contents of the special ram addresses for the game.
 
         """
-        ram_size = self.frotz_lib.get_special_ram_size()
+        ram_size = self.frotz_lib.get_special_ram_size(self._ctx)
         ram = np.zeros(ram_size, dtype=np.uint8)
-        self.frotz_lib.get_special_ram(as_ctypes(ram))
+        self.frotz_lib.get_special_ram(self._ctx, as_ctypes(ram))
         return ram
+
+
+def step_batch(envs, actions):
+    '''
+    Takes one action in each of several environments, using a single call
+    into frotz.
+
+    :param envs: Environments to step.
+    :type envs: list of :class:`jericho.FrotzEnv`
+    :param actions: Text command to send to each environment.
+    :type actions: list of string
+
+    :returns: A list containing, for each environment, the same tuple as\
+    :meth:`jericho.FrotzEnv.step`. The info dictionary also has a\
+    `world_changed` entry.
+
+    >>> from jericho import *
+    >>> envs = [FrotzEnv(rom_path) for _ in range(4)]
+    >>> for env in envs: env.reset()
+    >>> results = step_batch(envs, ['north', 'south', 'east', 'west'])
+
+    '''
+    n = len(envs)
+    if len(actions) != n:
+        raise ValueError("Expected one action per environment.")
+
+    if n == 0:
+        return []
+
+    frotz_lib = envs[0].frotz_lib
+    ctxs = (c_void_p * n)(*[env._ctx for env in envs])
+    actions = (c_char_p * n)(*[_encode_action(action) for action in actions])
+    obs = create_string_buffer(n * OBSERVATION_BUFFER_SIZE)
+    rewards, scores, moves, dones, changed = np.zeros((5, n), dtype=np.int32)
+    frotz_lib.step_batch(ctxs, actions, n, obs, OBSERVATION_BUFFER_SIZE,
+                         as_ctypes(rewards), as_ctypes(scores), as_ctypes(moves),
+                         as_ctypes(dones), as_ctypes(changed))
+
+    raw = obs.raw
+    results = []
+    for i in range(n):
+        text = raw[i*OBSERVATION_BUFFER_SIZE:(i+1)*OBSERVATION_BUFFER_SIZE]
+        text = text.split(b'\0', 1)[0].decode('cp1252')
+        info = {'moves': int(moves[i]), 'score': int(scores[i]), 'world_changed': bool(changed[i])}
+        if frotz_lib.timed_out(envs[i]._ctx):
+            info['timed_out'] = True
+        results.append((text, int(rewards[i]), bool(dones[i]), info))
+
+    return results
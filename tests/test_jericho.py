@@ -1,6 +1,9 @@
 import os
 import sys
+import struct
 import pytest
+import numpy as np
+from concurrent.futures import ThreadPoolExecutor
 from os.path import join as pjoin
 
 import jericho
@@ -9,14 +12,24 @@ import jericho
 DATA_PATH = os.path.abspath(pjoin(__file__, '..', "data"))
 
 
+def dictionary_word(word, length):
+    # Encoded form of a lowercase word in a dictionary of 2-word (V1-V3)
+    # or 3-word (V4+) entries.
+    zchars = [ord(c) - ord('a') + 6 for c in word] + [5] * (3 * length - len(word))
+    words = [zchars[i] << 10 | zchars[i+1] << 5 | zchars[i+2] for i in range(0, 3 * length, 3)]
+    words[-1] |= 0x8000
+    return struct.pack(">%dH" % length, *words)
+
+
 def test_multiple_instances():
     gamefile1 = pjoin(DATA_PATH, "905.z5")
     gamefile2 = pjoin(DATA_PATH, "tw-game.z8")
 
-    # Make sure both frotz_lib have different handles.
+    # Make sure both envs share frotz_lib but run their own Z-machine.
     env1 = jericho.FrotzEnv(gamefile1)
     env2 = jericho.FrotzEnv(gamefile2)
-    assert env1.frotz_lib._handle != env2.frotz_lib._handle
+    assert env1.frotz_lib is env2.frotz_lib
+    assert env1._ctx != env2._ctx
 
     # Test we can play two different games in parallel.
     state1, _ = env1.reset()
@@ -96,6 +109,678 @@ def test_copy():
                 assert (obs, rew, done, info) == expected[j]
 
 
+def test_threaded_step():
+    rom = pjoin(DATA_PATH, "905.z5")
+    env = jericho.FrotzEnv(rom)
+    env.reset()
+    walkthrough = env.get_walkthrough()
+    expected = [env.step(act) for act in walkthrough]
+
+    def play(_):
+        env = jericho.FrotzEnv(rom)
+        env.reset()
+        return [env.step(act) for act in walkthrough]
+
+    # Several envs stepped concurrently must behave as a single env would.
+    with ThreadPoolExecutor(max_workers=4) as executor:
+        for transcript in executor.map(play, range(4)):
+            assert transcript == expected
+
+
+def test_step_batch():
+    rom = pjoin(DATA_PATH, "905.z5")
+    env = jericho.FrotzEnv(rom)
+    env.reset()
+    walkthrough = env.get_walkthrough()
+    expected = [env.step(act) for act in walkthrough]
+
+    # Play the walkthrough in lockstep, one of the envs being one move behind.
+    envs = [jericho.FrotzEnv(rom) for _ in range(3)]
+    for e in envs:
+        e.reset()
+    envs[2].step(walkthrough[0])
+
+    for i in range(len(walkthrough) - 1):
+        acts = [walkthrough[i], walkthrough[i], walkthrough[i+1]]
+        results = jericho.step_batch(envs, acts)
+        for (obs, rew, done, info), j in zip(results, (i, i, i+1)):
+            assert (obs, rew, done) == expected[j][:3]
+            assert info['moves'] == expected[j][3]['moves']
+            assert info['score'] == expected[j][3]['score']
+
+
+def test_filter_candidate_actions_parallel():
+    rom = pjoin(DATA_PATH, "905.z5")
+    env = jericho.FrotzEnv(rom)
+    env.reset()
+    candidates = ["north", "south", "east", "west", "look", "inventory",
+                  "take all", "examine me", "stand", "open door", "undo"]
+
+    for act in env.get_walkthrough()[:10]:
+        state = env.get_state()
+        expected = env._filter_candidate_actions(candidates, use_ctypes=True, use_parallel=False)
+        diff2acts = env._filter_candidate_actions(candidates, use_ctypes=True, use_parallel=True, num_workers=3)
+        assert diff2acts == expected
+
+        # The env's own state is left untouched.
+        assert (env.get_state()[0] == state[0]).all()
+        env.step(act)
+
+
+def test_headless_probing():
+    rom = pjoin(DATA_PATH, "905.z5")
+    env = jericho.FrotzEnv(rom)
+    env.reset()
+    candidates = ["north", "south", "east", "west", "look", "inventory",
+                  "take all", "examine me", "stand", "open door", "undo"]
+
+    for act in env.get_walkthrough()[:10]:
+        env.set_headless_probing(False)
+        expected = env._filter_candidate_actions(candidates, use_ctypes=True)
+        env.set_headless_probing(True)
+        assert env._filter_candidate_actions(candidates, use_ctypes=True) == expected
+        assert env._filter_candidate_actions(candidates, use_ctypes=True, use_parallel=True, num_workers=2) == expected
+        env.step(act)
+
+
+def test_checkpoint():
+    rom = pjoin(DATA_PATH, "905.z5")
+    env = jericho.FrotzEnv(rom)
+    env.reset()
+    walkthrough = env.get_walkthrough()
+
+    with pytest.raises(RuntimeError):
+        env.restore_checkpoint()
+
+    for i, act in enumerate(walkthrough[:-1]):
+        env.set_checkpoint()
+        state = env.get_state()
+        expected = env.step(walkthrough[i+1])
+
+        # Returning to the checkpoint several times must replay identically.
+        for _ in range(2):
+            env.restore_checkpoint()
+            assert (env.get_state()[0] == state[0]).all()
+            assert env.step(walkthrough[i+1]) == expected
+
+        env.restore_checkpoint()
+        env.step(act)
+
+
+def test_snapshot():
+    rom = pjoin(DATA_PATH, "905.z5")
+    env = jericho.FrotzEnv(rom)
+    env.reset()
+    walkthrough = env.get_walkthrough()
+    expected = [env.step(act) for act in walkthrough]
+
+    env.reset()
+    snaps = [env.take_snapshot()]
+    for act in walkthrough:
+        env.step(act)
+        snaps.append(env.take_snapshot())
+
+    # Consecutive snapshots share most of their memory.
+    ram_size = len(env.get_state()[0])
+    assert all(snap.private_size() < ram_size for snap in snaps[1:])
+
+    # Replay from every snapshot, on a different env than the one that took it.
+    other = jericho.FrotzEnv(rom)
+    for i in reversed(range(len(walkthrough))):
+        other.restore_snapshot(snaps[i])
+        assert [other.step(act) for act in walkthrough[i:]] == expected[i:]
+        del snaps[i+1:]
+
+
+def test_live_stack_in_state():
+    rom = pjoin(DATA_PATH, "905.z5")
+    env = jericho.FrotzEnv(rom)
+    env.reset()
+    walkthrough = env.get_walkthrough()
+    expected = [env.step(act) for act in walkthrough]
+
+    env.reset()
+    full_stack_size = env.frotz_lib.getStackSize(env._ctx)
+    for i, act in enumerate(walkthrough):
+        state = env.get_state()
+        assert len(state[1]) < full_stack_size
+        assert len(state[1]) == full_stack_size - 2 * state[3]  # sp counts words
+
+        env.step("look")
+        env.set_state(state)
+        assert env.step(act) == expected[i]
+
+
+def test_packed_state():
+    rom = pjoin(DATA_PATH, "905.z5")
+    env = jericho.FrotzEnv(rom)
+    env.reset()
+    walkthrough = env.get_walkthrough()
+    expected = [env.step(act) for act in walkthrough]
+
+    env.reset()
+    for i, act in enumerate(walkthrough):
+        packed = env.pack_state()
+        assert len(packed) == env.state_size()
+        state = env.get_state()
+
+        assert env.step(act) == expected[i]
+        env.set_state(bytes(packed))
+        assert (env.get_state()[0] == state[0]).all()
+        assert env.get_state()[2:] == state[2:]
+        assert env.step(act) == expected[i]
+
+    # Packed states can be written into a preallocated buffer.
+    arena = np.zeros(2 * env.state_size(), dtype=np.uint8)
+    packed = env.pack_state(out=arena)
+    assert (arena[:len(packed)] == packed).all()
+
+    with pytest.raises(ValueError):
+        env.unpack_state(packed[:-1])
+
+
+def test_state_delta():
+    rom = pjoin(DATA_PATH, "905.z5")
+    env = jericho.FrotzEnv(rom)
+    env.reset()
+    walkthrough = env.get_walkthrough()
+    expected = [env.step(act) for act in walkthrough]
+
+    env.reset()
+    base = env.pack_state()
+    deltas = []
+    for act in walkthrough[:-1]:
+        env.step(act)
+        deltas.append(env.state_delta(base))
+        assert len(deltas[-1]) < len(base)
+
+    # Deltas can be applied on any env playing the same game.
+    other = jericho.FrotzEnv(rom)
+    for i, delta in enumerate(deltas):
+        other.apply_state_delta(base, delta)
+        env.apply_state_delta(base, delta)
+        assert other.pack_state().tobytes() == env.pack_state().tobytes()
+        assert other.step(walkthrough[i+1]) == expected[i+1]
+
+    with pytest.raises(ValueError):
+        other.apply_state_delta(base[:-1], deltas[0])
+
+    # A diff whose runs skip past the end of the base is rejected.
+    corrupt = deltas[0].copy()
+    corrupt[20:23] = [0, 0xff, 0xff]
+    with pytest.raises(ValueError):
+        other.apply_state_delta(base, corrupt)
+
+
+def test_state_store():
+    rom = pjoin(DATA_PATH, "905.z5")
+    env = jericho.FrotzEnv(rom)
+    env.reset()
+    walkthrough = env.get_walkthrough()
+    expected = [env.step(act) for act in walkthrough]
+
+    env.reset()
+    store = jericho.StateStore()
+    ids = []
+    for act in walkthrough:
+        state_id, is_new = store.add(env)
+        assert is_new
+        assert store.add(env) == (state_id, False)
+        ids.append(state_id)
+        env.step(act)
+
+    assert len(store) == len(walkthrough)
+    assert store.memory_size() < sum(len(env.pack_state()) for _ in walkthrough) / 2
+
+    other = jericho.FrotzEnv(rom)
+    for i in reversed(range(len(walkthrough))):
+        store.restore(other, ids[i])
+        assert other.step(walkthrough[i]) == expected[i]
+
+    with pytest.raises(ValueError):
+        store.restore(other, len(store))
+
+
+def test_undo_stack():
+    rom = pjoin(DATA_PATH, "905.z5")
+    env = jericho.FrotzEnv(rom)
+    env.reset()
+    walkthrough = env.get_walkthrough()
+    expected = [env.step(act) for act in walkthrough]
+
+    env.reset()
+    states = []
+    for depth, act in enumerate(walkthrough, 1):
+        states.append(env.pack_state().tobytes())
+        assert env.push_undo() == depth
+        env.step(act)
+
+    # Go back one level, then several at once.
+    assert env.pop_undo() == len(walkthrough) - 1
+    assert env.pack_state().tobytes() == states[-1]
+    assert env.step(walkthrough[-1]) == expected[-1]
+    assert env.pop_undo(3) == len(walkthrough) - 4
+    assert env.pack_state().tobytes() == states[-4]
+    assert [env.step(act) for act in walkthrough[-4:]] == expected[-4:]
+
+    with pytest.raises(ValueError):
+        env.pop_undo(env.undo_depth() + 1)
+
+    # The oldest levels are dropped to fit the limits.
+    env.set_undo_limits(max_depth=5)
+    assert env.undo_depth() == 5
+    env.set_undo_limits(max_bytes=1)
+    assert env.undo_depth() == 1
+    assert env.pop_undo() == 0
+    assert env.pack_state().tobytes() == states[-5]
+
+    # Memory written back by restore_checkpoint is restored by pop_undo.
+    env.reset()
+    env.set_checkpoint()
+    env.step(walkthrough[0])
+    state = env.pack_state().tobytes()
+    env.push_undo()
+    env.restore_checkpoint()
+    env.pop_undo()
+    assert env.pack_state().tobytes() == state
+
+    env.push_undo()
+    env.clear_undo()
+    assert env.undo_depth() == 0 and env.undo_memory_size() == 0
+
+
+def test_auto_undo(tmpdir):
+    # None of the test games is V1-V4, the versions that save an undo state
+    # on each read. This V3 story counts the turns in the score and prints
+    # the dictionary entry of the first word of each line.
+    story = bytearray(0x520)
+    story[0x00] = 3
+    struct.pack_into(">7H", story, 0x04, 0x500, 0x500, 0x400, 0x220, 0x40, 0x400, 0)
+    struct.pack_into(">H", story, 0x1a, len(story) // 2)
+    struct.pack_into(">H", story, 0x40, 1)  # Location
+    struct.pack_into(">H", story, 0x265, 0x268)  # Properties of object 1
+    story[0x300] = 60  # Input line
+    story[0x320] = 4  # Parsed words
+    story[0x400:0x404] = [0, 4, 0, 2]  # Dictionary
+    story[0x404:0x40c] = dictionary_word("look", 2) + dictionary_word("take", 2)
+    story[0x500:0x515] = bytes.fromhex(
+        "e40f03000320"  # sread text parse
+        "9511"          # inc score
+        "cf1f03200113"  # loadw parse 1 -> g3
+        "e6bf13"        # print_num g3
+        "bb"            # new_line
+        "8cffed")       # jump to the start
+    rom = str(tmpdir.join("undo.z3"))
+    with open(rom, 'wb') as f:
+        f.write(story)
+
+    transcripts = []
+    for enabled in (True, False):
+        env = jericho.FrotzEnv(rom)
+        env.set_auto_undo(enabled)
+        transcript = [env.reset()]
+        for act in ["look", "take", "jump", "look", "take"]:
+            transcript.append(env.step(act))
+        transcript.append(env.pack_state().tobytes())
+        transcripts.append(transcript)
+
+    assert "Score: 5" in transcripts[0][-2][0]
+    # Undo states are only for the undo hotkey; the game plays the same.
+    assert transcripts[0] == transcripts[1]
+
+
+def test_quetzal_export():
+    rom = pjoin(DATA_PATH, "905.z5")
+    env = jericho.FrotzEnv(rom)
+    env.reset()
+    walkthrough = env.get_walkthrough()
+    expected = [env.step(act) for act in walkthrough]
+
+    env.reset()
+    saves = []
+    for act in walkthrough:
+        saves.append(env.quetzal_export())
+        env.step(act)
+    assert all(save[:4].tobytes() == b"FORM" and save[8:12].tobytes() == b"IFZS" for save in saves)
+
+    # Saves can be restored on any env playing the same game. They do not
+    # hold the last observation, which the reward of the first step after
+    # restoring them may depend on.
+    other = jericho.FrotzEnv(rom)
+    for i in reversed(range(len(walkthrough))):
+        other.quetzal_import(saves[i])
+        transitions = [other.step(act) for act in walkthrough[i:]]
+        assert [t[0] for t in transitions] == [e[0] for e in expected[i:]]
+        assert transitions[1:] == expected[i+1:]
+
+    # Invalid saves leave the game as it was.
+    state = other.pack_state().tobytes()
+    with pytest.raises(ValueError):
+        other.quetzal_import(saves[0][:-4])
+    with pytest.raises(ValueError):
+        other.quetzal_import(jericho.FrotzEnv(pjoin(DATA_PATH, "tw-game.z8")).quetzal_export())
+    # So do saves with a PC, or the return PC of a frame, past the story.
+    save = saves[-1].tobytes()
+    ifhd = save.index(b"IFhd") + 8
+    with pytest.raises(ValueError):
+        other.quetzal_import(save[:ifhd+10] + b"\xff\xff\xff" + save[ifhd+13:])
+    stks = save.index(b"Stks") + 8
+    frame = stks + 8 + 2 * struct.unpack_from(">H", save, stks + 6)[0]
+    with pytest.raises(ValueError):
+        other.quetzal_import(save[:frame] + b"\xff\xff\xff" + save[frame+3:])
+    assert other.pack_state().tobytes() == state
+
+
+def test_decode_cache():
+    rom = pjoin(DATA_PATH, "905.z5")
+    transcripts = []
+    for enabled in (False, True):
+        env = jericho.FrotzEnv(rom)
+        env.frotz_lib.set_decode_cache(env._ctx, enabled)
+        env.load(rom)
+        transcript = [env.reset()]
+        for act in env.get_walkthrough():
+            transcript.append(env.step(act))
+        transcript.append(env.pack_state().tobytes())
+        transcripts.append(transcript)
+
+    # Pre-decoded instructions must behave exactly as decoding them as they run.
+    assert transcripts[0] == transcripts[1]
+
+
+def test_insn_fusion(tmpdir):
+    # A story whose loop runs each pair of instructions that gets fused:
+    # a jump to inc_chk, loadw then je, get_prop then jz, and test_attr.
+    story = bytearray(0x630)
+    story[0x00] = 5
+    struct.pack_into(">7H", story, 0x04, 0x500, 0x500, 0x400, 0x220, 0x40, 0x400, 0)
+    struct.pack_into(">H", story, 0x1a, len(story) // 4)
+    struct.pack_into(">H", story, 0x222, 9)  # Default of property 2
+    story[0x29e] = 0x28  # Object 1 has attributes 2 and 4
+    struct.pack_into(">H", story, 0x2aa, 0x2c0)  # Properties of object 1
+    story[0x2c1] = 0x45  # Property 5, of 2 bytes, is 0
+    story[0x300] = 60  # Input line
+    story[0x320] = 4  # Parsed words
+    story[0x400:0x404] = [0, 6, 0, 0]  # Empty dictionary
+    struct.pack_into(">H", story, 0x606, 7)  # Word 3 of the table is 7
+    story[0x500:0x545] = bytes.fromhex(
+        "e21703000100"      # storeb text 1 0
+        "e40f0300032010"    # aread text parse -> g0
+        "0d1100"            # store g1 0
+        "0d1200"            # store g2 0
+        "8c0002"            # jump to the loop head
+        "051105e6"          # inc_chk g1 5 ?done
+        "cf2f06001100"      # loadw table g1 -> sp
+        "41000746"          # je sp 7 ?~nohit
+        "54126412"          # add g2 100 -> g2
+        "2a011146"          # nohit: test_attr 1 g1 ?~noattr
+        "54120a12"          # add g2 10 -> g2
+        "31011100"          # noattr: get_prop 1 g1 -> sp
+        "a000c6"            # jz sp ?zero
+        "54120112"          # add g2 1 -> g2
+        "8cffda"            # zero: jump to the loop head
+        "e6bf12"            # done: print_num g2
+        "bb"                # new_line
+        "8cffbd")           # jump to the start
+    rom = str(tmpdir.join("fusion.z5"))
+    with open(rom, 'wb') as f:
+        f.write(story)
+
+    walkthrough = jericho.FrotzEnv(pjoin(DATA_PATH, "905.z5")).get_walkthrough()
+    for game, actions in ((rom, ["go", "go"]), (pjoin(DATA_PATH, "905.z5"), walkthrough)):
+        transcripts = []
+        for enabled in (False, True):
+            env = jericho.FrotzEnv(game)
+            env.frotz_lib.set_insn_fusion(env._ctx, enabled)
+            env.load(game)
+            env.enable_profiling()
+            transcript = [env.reset()]
+            for act in actions:
+                transcript.append(env.step(act))
+            transcript.append(env.pack_state().tobytes())
+            # Both instructions of a fused pair are counted.
+            transcript.append(env.get_profile()['opcodes'])
+            transcripts.append(transcript)
+
+        assert transcripts[0] == transcripts[1]
+        if game == rom:
+            assert transcripts[1][1][0].strip() == "121"
+
+
+def test_object_index():
+    rom = pjoin(DATA_PATH, "905.z5")
+    transcripts = []
+    for enabled in (False, True):
+        env = jericho.FrotzEnv(rom)
+        env.frotz_lib.set_object_index(env._ctx, enabled)
+        env.load(rom)
+        transcript = [env.reset(), str(env.get_world_objects())]
+        for act in env.get_walkthrough():
+            transcript.append(env.step(act))
+            transcript.append(str(env.get_world_objects()))
+        transcripts.append(transcript)
+
+    # The object table and the property index must agree with the object
+    # entries and property lists they are built from.
+    assert transcripts[0] == transcripts[1]
+
+
+def test_string_cache_abbreviations(tmpdir):
+    # Make the room description of 905, a string in static memory, start
+    # with abbreviation 0 instead of "T".
+    story = bytearray(open(pjoin(DATA_PATH, "905.z5"), 'rb').read())
+    this_bedroom = bytes.fromhex("132d3b001d49")  # Encoded "This bedroom"
+    start = story.index(this_bedroom)
+    story[start:start+2] = bytes.fromhex("040d")
+    rom = str(tmpdir.join("905-abbr.z5"))
+    with open(rom, 'wb') as f:
+        f.write(story)
+
+    # Point abbreviation 0 at the text of a dictionary word, which is in
+    # static memory.
+    dictionary = (story[0x08] << 8) | story[0x09]
+    words = dictionary + 1 + story[dictionary] + 3
+    words += words % 2  # Even, as abbreviations are word addresses.
+    entry_length = story[dictionary + 1 + story[dictionary]]
+
+    def set_abbreviation(env, word):
+        state = env.get_state()
+        ram = state[0]
+        table = (int(ram[0x18]) << 8) | int(ram[0x19])
+        addr = words + 2 * entry_length * word
+        ram[table:table+2] = [addr >> 9, (addr >> 1) & 0xff]
+        env.set_state((ram,) + state[1:])
+
+    def abbreviation(obs):
+        return obs[:obs.index("his bedroom")].split("\n")[-1]
+
+    env = jericho.FrotzEnv(rom)
+    env.reset()
+    set_abbreviation(env, 10)
+    first = abbreviation(env.step("look")[0])
+    assert abbreviation(env.step("look")[0]) == first
+    # The cached description must not keep the old abbreviation.
+    set_abbreviation(env, 11)
+    second = abbreviation(env.step("look")[0])
+    assert second != first
+
+    env = jericho.FrotzEnv(rom)
+    env.reset()
+    set_abbreviation(env, 11)
+    assert abbreviation(env.step("look")[0]) == second
+
+
+def test_custom_dictionary(tmpdir):
+    # A story that tokenises each line of input against a dictionary of its
+    # own, in dynamic memory, and prints the entry found for the first word.
+    story = bytearray(0x530)
+    story[0x00] = 5
+    struct.pack_into(">7H", story, 0x04, 0x500, 0x500, 0x400, 0x220, 0x40, 0x400, 0)
+    struct.pack_into(">H", story, 0x1a, len(story) // 4)
+    struct.pack_into(">H", story, 0x2aa, 0x2ac)  # Properties of object 1
+    story[0x300] = 60  # Input line
+    story[0x320] = story[0x340] = 4  # Parsed words
+    story[0x360:0x364] = [0, 6, 0, 2]  # Custom dictionary
+    story[0x364:0x370] = dictionary_word("look", 3) + dictionary_word("take", 3)
+    story[0x400:0x404] = [0, 6, 0, 0]  # Empty standard dictionary
+    story[0x500:0x522] = bytes.fromhex(
+        "e21703000100"      # storeb text 1 0
+        "e40f0300032010"    # aread text parse -> g0
+        "fb03030003400360"  # tokenise text parse2 dictionary
+        "cf1f03400111"      # loadw parse2 1 -> g1
+        "e6bf11"            # print_num g1
+        "bb"                # new_line
+        "8cffe0")           # jump to the start
+    rom = str(tmpdir.join("dictionary.z5"))
+    with open(rom, 'wb') as f:
+        f.write(story)
+
+    env = jericho.FrotzEnv(rom)
+    env.reset()
+    assert env.step("look")[0].strip() == str(0x364)
+    assert env.step("take")[0].strip() == str(0x36a)
+
+    # Renaming an entry must be seen by the next tokenise.
+    state = env.get_state()
+    ram = state[0]
+    ram[0x364:0x36a] = list(dictionary_word("lookx", 3))
+    env.set_state((ram,) + state[1:])
+    assert env.step("look")[0].strip() == "0"
+    assert env.step("lookx")[0].strip() == str(0x364)
+    assert env.step("take")[0].strip() == str(0x36a)
+
+
+def test_filter_skips_halting_actions(tmpdir):
+    # A story where "boom" runs an illegal opcode, halting the emulator, and
+    # "pick" moves object 1 into object 2.
+    story = bytearray(0x530)
+    story[0x00] = 5
+    struct.pack_into(">7H", story, 0x04, 0x500, 0x500, 0x400, 0x220, 0x40, 0x400, 0)
+    struct.pack_into(">H", story, 0x1a, len(story) // 4)
+    struct.pack_into(">H", story, 0x2aa, 0x2c0)  # Properties of object 1
+    struct.pack_into(">H", story, 0x2b8, 0x2c0)  # Properties of object 2
+    story[0x300] = 60  # Input line
+    story[0x320] = 4  # Parsed words
+    story[0x400:0x404] = [0, 6, 0, 2]  # Dictionary
+    story[0x404:0x410] = dictionary_word("boom", 3) + dictionary_word("pick", 3)
+    story[0x500:0x52c] = bytes.fromhex(
+        "e21703000100"      # storeb text 1 0
+        "e40f0300032010"    # aread text parse -> g0
+        "cf1f03200111"      # loadw parse 1 -> g1
+        "c18f110404cc"      # je g1 "boom" ?illegal
+        "c18f11040ac9"      # je g1 "pick" ?insert
+        "bb"                # new_line
+        "8cffdf"            # jump to the start
+        "000000"            # illegal
+        "0e0102"            # insert_obj 1 2
+        "8cffd6")           # jump to the start
+    rom = str(tmpdir.join("halt.z5"))
+    with open(rom, 'wb') as f:
+        f.write(story)
+
+    env = jericho.FrotzEnv(rom)
+    env.reset()
+    state = env.get_state()
+    candidates = ["boom", "pick", "wait"]
+    # The serial and parallel filters both skip the halting action.
+    for use_parallel in (False, True):
+        valid = env._filter_candidate_actions(candidates, use_ctypes=True, use_parallel=use_parallel)
+        assert list(valid.values()) == [["pick"]]
+        assert not env._emulator_halted()
+        assert env.get_state()[0].tobytes() == state[0].tobytes()
+
+
+def test_profiling():
+    rom = pjoin(DATA_PATH, "905.z5")
+    env = jericho.FrotzEnv(rom)
+    env.reset()
+    env.enable_profiling()
+    for act in env.get_walkthrough()[:5]:
+        env.step(act)
+
+    profile = env.get_profile(top_n=5)
+    assert profile['instructions'] > 0
+    assert sum(profile['opcodes'].values()) == profile['instructions']
+    assert 'cycles' not in profile
+    assert 0 < len(profile['routines']) <= 5
+    # Sorted by instructions run, none running more than was run in total.
+    counts = [instructions for _, _, instructions in profile['routines']]
+    assert counts == sorted(counts, reverse=True)
+    assert counts[0] <= profile['instructions']
+
+    # Turning profiling off discards the profile.
+    env.disable_profiling()
+    with pytest.raises(RuntimeError):
+        env.get_profile()
+
+
+def test_max_instructions():
+    rom = pjoin(DATA_PATH, "905.z5")
+    env = jericho.FrotzEnv(rom)
+    env.reset()
+    state = env.pack_state().tobytes()
+
+    env.set_max_instructions(10)
+    obs, reward, done, info = env.step("look")
+    assert info['timed_out'] and env.timed_out()
+    assert not done and reward == 0
+    # The step was undone.
+    assert env.pack_state().tobytes() == state
+    (obs, reward, done, info), = jericho.step_batch([env], ["look"])
+    assert info['timed_out']
+
+    # Candidate actions timing out are not valid.
+    candidates = ["stand up", "open door", "wait"]
+    for use_parallel in (False, True):
+        assert env._filter_candidate_actions(candidates, use_ctypes=True, use_parallel=use_parallel) == {}
+
+    env.set_max_instructions(None)
+    obs, reward, done, info = env.step("look")
+    assert 'timed_out' not in info and not env.timed_out()
+    # No text of the aborted steps leaks into the next one.
+    fresh = jericho.FrotzEnv(rom)
+    fresh.reset()
+    assert obs == fresh.step("look")[0]
+    assert env._filter_candidate_actions(candidates, use_ctypes=True) != {}
+
+
+def test_max_instructions_parallel():
+    rom = pjoin(DATA_PATH, "905.z5")
+    env = jericho.FrotzEnv(rom)
+    env.reset()
+    candidates = ["stand up", "open door", "wait"]
+    # The first parallel filter clones the worker machines.
+    valid = env._filter_candidate_actions(candidates, use_ctypes=True, use_parallel=True)
+    assert valid != {}
+
+    # Settings changed later still reach the workers.
+    env.set_max_instructions(10)
+    assert env._filter_candidate_actions(candidates, use_ctypes=True, use_parallel=True) == {}
+
+    env.set_max_instructions(None)
+    assert env._filter_candidate_actions(candidates, use_ctypes=True, use_parallel=True) == valid
+
+
+def test_fatal_error_is_recoverable(tmpdir):
+    rom = pjoin(DATA_PATH, "905.z5")
+    env = jericho.FrotzEnv(rom)
+    env.reset()
+
+    # A truncated story file is a fatal error, which must not end the process.
+    bad_rom = tmpdir.join("truncated.z5")
+    with open(rom, "rb") as f:
+        bad_rom.write_binary(f.read(1000))
+
+    with pytest.warns(jericho.UnsupportedGameWarning):
+        with pytest.raises(RuntimeError):
+            jericho.FrotzEnv(str(bad_rom))
+
+    # Other machines keep running.
+    obs, _, _, _ = env.step(env.get_walkthrough()[0])
+    assert not env._emulator_halted()
+    assert "Hadley" in obs
+
+
 @pytest.mark.skipif(not os.path.exists(pjoin(DATA_PATH, "roms", "yomomma.z8")), reason="Missing data: roms/yomomma.z8")
 def test_saving_opcode_in_state():
     # At some point in yomomma.z8, the player is asked to hit [enter] to continue.